@@ -1,21 +1,32 @@
 #include <benchmark/benchmark.h>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <opencv2/opencv.hpp>
 #include <sstream>
 #include <string>
 
 #include "apriltag.h"
 #include "apriltag_helper.h"
+#include "apriltag_pose.h"
 #include "ccl/bmrs.h"
 #include "common/image_u8.h"
 #include "common/pjpeg.h"
 #include "common/unionfind.h"
 #include "common/workerpool.h"
+#include "contour_clusters.h"
 #include "fit_quads.h"
 #include "gradient_clusters.h"
 #include "halide/bm_only_halide_gradient_clusters.h"
+#include "refine_edges.h"
 #include "simdtag/vision_utils.h"
+#include "tag36h11.h"
+#include "tagStandard41h12.h"
+#include "tag_decoder.h"
+#include "tag_families/tag36h11.h"
+#include "tag_families/tagStandard41h12.h"
+#include "tag_pose.h"
 #include "threshold.h"
 
 #define IMAGE_PATH CMAKE_PROJECT_SOURCE_DIR "/assets/apriltag/tags_3_desk.jpg"
@@ -41,9 +52,332 @@ static void BM_FitQuads(benchmark::State& state) {
     ccl.PerformLabelingDual(threshold, labels);
     gc.Perform(threshold, labels, hash);
 
+    std::vector<simdtag::Quad> quads;
     for (auto _ : state) {
-        simdtag::FitQuads::Perform(hash, input.size());
+        simdtag::FitQuads::Perform(hash, input.size(), quads);
     }
+
+    state.counters["clusters"] = hash.size();
+    state.counters["quads"] = quads.size();
+}
+
+// Line fits weighted by the gradient of the grayscale frame, as in apriltag
+static void BM_FitQuadsWeighted(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        simdtag::FitQuads::Perform(hash, input.size(), quads, {}, &input);
+    }
+
+    state.counters["quads"] = quads.size();
+}
+
+// All selected clusters sorted by slope in one VQSort on (cluster, slope) keys
+static void BM_FitQuadsBatched(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    simdtag::FitQuadsParams params;
+    params.batched_sort = true;
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        simdtag::FitQuads::Perform(hash, input.size(), quads, params);
+    }
+
+    state.counters["quads"] = quads.size();
+}
+
+// Scaling over threads, clusters are fit largest first with work stealing
+static void BM_FitQuadsParallel(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::ThreadPool pool{static_cast<size_t>(state.range(0))};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        simdtag::FitQuads::Perform(hash, input.size(), quads, pool);
+    }
+
+    state.counters["quads"] = quads.size();
+}
+
+// Hashmap free route, Halide gradient clusters straight into FitQuads
+static void BM_FitQuadsHalideSpans(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::HalideGradientClusters gc{input.size()};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels);
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        simdtag::FitQuads::Perform(gc.GetBuffer(), gc.Spans(), input.size(), quads);
+    }
+
+    state.counters["clusters"] = gc.Spans().size();
+    state.counters["quads"] = quads.size();
+}
+
+// Includes decoding the clusters into the SoA layout
+static void BM_FitQuadsSoA(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::ClusterSoA soa;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        soa.Build(hash);
+        simdtag::FitQuads::Perform(soa, input.size(), quads);
+    }
+
+    state.counters["clusters"] = soa.Count();
+    state.counters["quads"] = quads.size();
+}
+
+// End to end from the label image, gradient clusters and slope sort against contour tracing.
+// Arg 0 is tags_3_desk, arg 1 the denser shapes scene.
+static const char* SceneImage(int64_t scene) {
+    return scene == 0 ? IMAGE_PATH : IMAGE_PATH2;
+}
+
+static void BM_GradientClustersFitQuads(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(SceneImage(state.range(0)), cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        gc.Perform(threshold, labels, hash);
+        simdtag::FitQuads::Perform(hash, input.size(), quads);
+    }
+
+    state.counters["clusters"] = hash.size();
+    state.counters["quads"] = quads.size();
+}
+
+static void BM_ContourClustersFitQuads(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(SceneImage(state.range(0)), cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::ContourClusters contours{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    // Contour clusters hold one point per pixel of outline instead of about two
+    simdtag::FitQuadsParams params;
+    params.ordered_clusters = true;
+    params.min_cluster_points /= 2;
+
+    std::vector<simdtag::Quad> quads;
+    for (auto _ : state) {
+        contours.Perform(threshold, labels, ccl.LabelCount(), hash);
+        simdtag::FitQuads::Perform(hash, input.size(), quads, params);
+    }
+
+    state.counters["clusters"] = hash.size();
+    state.counters["quads"] = quads.size();
+}
+
+// Decode the quads of the desk scene as tag36h11
+static void BM_DecodeQuads(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    simdtag::FitQuads::Perform(hash, input.size(), quads, {}, &input);
+
+    simdtag::TagDecoder decoder{simdtag::kTag36h11};
+    std::vector<simdtag::Detection> detections;
+    for (auto _ : state) {
+        decoder.Decode(input, quads, detections);
+    }
+
+    state.counters["quads"] = quads.size();
+    state.counters["detections"] = detections.size();
+}
+
+// All edges of the quads of the desk image, the quads are copied back each iteration
+static void BM_RefineEdges(benchmark::State& state) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    simdtag::FitQuads::Perform(hash, input.size(), quads, {}, &input);
+
+    simdtag::EdgeRefiner refiner;
+    std::vector<simdtag::Quad> refined;
+    for (auto _ : state) {
+        refined = quads;
+        refiner.Refine(input, refined);
+        benchmark::DoNotOptimize(refined.data());
+    }
+
+    state.counters["quads"] = quads.size();
+}
+
+static simdtag::TagFamily const& BenchFamily(int64_t family) {
+    return family == 0 ? simdtag::kTag36h11 : simdtag::kTagStandard41h12;
+}
+
+// One code against the whole rotation expanded family
+static void BM_MatchCode(benchmark::State& state) {
+    simdtag::TagFamily const& family = BenchFamily(state.range(0));
+    const uint64_t code = family.codes[family.codes.size() / 2] ^ 0x5;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(HWY_NAMESPACE::__MatchCode(family.codebook, code));
+    }
+}
+
+// apriltag startup, the quick decode table with 2 bits corrected
+static void BM_AprilTagAddFamily(benchmark::State& state) {
+    apriltag_family_t* tf = state.range(0) == 0 ? tag36h11_create() : tagStandard41h12_create();
+
+    for (auto _ : state) {
+        apriltag_detector_t* td = apriltag_detector_create();
+        apriltag_detector_add_family_bits(td, tf, 2);
+        apriltag_detector_destroy(td);
+    }
+
+    state.range(0) == 0 ? tag36h11_destroy(tf) : tagStandard41h12_destroy(tf);
+}
+
+// The detections of the desk image repeated to a few batches, and a made up camera
+static std::vector<simdtag::Detection> PoseDetections(simdtag::TagPoseParams& params) {
+    cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<simdtag::Quad> quads;
+    simdtag::FitQuads::Perform(hash, input.size(), quads, {}, &input);
+
+    simdtag::TagDecoder decoder{simdtag::kTag36h11};
+    std::vector<simdtag::Detection> detections;
+    decoder.Decode(input, quads, detections);
+
+    params = simdtag::TagPoseParams{0.16, 900, 900, input.cols / 2.0, input.rows / 2.0};
+
+    std::vector<simdtag::Detection> repeated;
+    while (!detections.empty() && repeated.size() < 32) {
+        repeated.insert(repeated.end(), detections.begin(), detections.end());
+    }
+    return repeated;
+}
+
+static void BM_EstimatePoses(benchmark::State& state) {
+    simdtag::TagPoseParams params;
+    const std::vector<simdtag::Detection> detections = PoseDetections(params);
+
+    std::vector<simdtag::TagPose> poses;
+    for (auto _ : state) {
+        simdtag::PoseEstimator::Perform(detections, params, poses);
+        benchmark::DoNotOptimize(poses.data());
+    }
+
+    state.counters["detections"] = detections.size();
+}
+
+// apriltag estimate_tag_pose one detection at a time, on the same detections
+static void BM_AprilTagEstimatePoses(benchmark::State& state) {
+    simdtag::TagPoseParams params;
+    const std::vector<simdtag::Detection> detections = PoseDetections(params);
+
+    std::vector<apriltag_detection_t> converted(detections.size());
+    for (size_t i = 0; i < detections.size(); i++) {
+        converted[i].H = matd_create(3, 3);
+        for (int k = 0; k < 9; k++) {
+            converted[i].H->data[k] = detections[i].H.h[k / 3][k % 3];
+        }
+        std::copy_n(detections[i].c, 2, converted[i].c);
+        std::copy_n(&detections[i].p[0][0], 8, &converted[i].p[0][0]);
+    }
+
+    for (auto _ : state) {
+        for (apriltag_detection_t& detection : converted) {
+            apriltag_detection_info_t info{&detection, params.tagsize, params.fx,
+                                           params.fy, params.cx, params.cy};
+            apriltag_pose_t pose;
+            benchmark::DoNotOptimize(estimate_tag_pose(&info, &pose));
+            matd_destroy(pose.R);
+            matd_destroy(pose.t);
+        }
+    }
+
+    for (apriltag_detection_t& detection : converted) {
+        matd_destroy(detection.H);
+    }
+    state.counters["detections"] = detections.size();
 }
 
 ////////////////////////////////////////////////////
@@ -152,6 +486,55 @@ static inline void ptsort(struct pt* pts, int sz) {
 #undef MERGE
 }
 
+// Cluster size sweep of the slope sort alone. Keys are random, the copy into the work buffer is
+// part of every iteration for all three.
+static std::vector<uint64_t> RandomKeys(size_t size) {
+    std::srand(0);
+    std::vector<uint64_t> keys(size);
+    for (uint64_t& key : keys) {
+        key = uint64_t(std::rand()) << 32 | std::rand();
+    }
+    return keys;
+}
+
+// Bitonic network up to 256 keys, VQSort above
+static void BM_SortKeys(benchmark::State& state) {
+    std::vector<uint64_t> keys = RandomKeys(state.range(0));
+    std::vector<uint64_t> work(keys.size());
+
+    for (auto _ : state) {
+        std::copy(keys.begin(), keys.end(), work.begin());
+        simdtag::HWY_NAMESPACE::__SortKeys(work.data(), work.size());
+        benchmark::DoNotOptimize(work.data());
+    }
+}
+
+static void BM_VQSortKeys(benchmark::State& state) {
+    std::vector<uint64_t> keys = RandomKeys(state.range(0));
+    std::vector<uint64_t> work(keys.size());
+
+    for (auto _ : state) {
+        std::copy(keys.begin(), keys.end(), work.begin());
+        hw::VQSortStatic(work.data(), work.size(), hwy::SortAscending{});
+        benchmark::DoNotOptimize(work.data());
+    }
+}
+
+static void BM_AprilTagPtSort(benchmark::State& state) {
+    std::vector<uint64_t> keys = RandomKeys(state.range(0));
+    std::vector<struct pt> pts(keys.size());
+    std::vector<struct pt> work(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        pts[i].slope = static_cast<float>(keys[i] >> 32);
+    }
+
+    for (auto _ : state) {
+        std::copy(pts.begin(), pts.end(), work.begin());
+        ptsort(work.data(), work.size());
+        benchmark::DoNotOptimize(work.data());
+    }
+}
+
 static void fit_quads_epoch1(apriltag_detector_t* td, image_u8_t* im, zarray_t* cluster,
                              int tag_width) {
     int res = 0;
@@ -262,6 +645,26 @@ static void BM_AprilTagFitQuads(benchmark::State& state) {
 }
 
 BENCHMARK(BM_FitQuads);
+BENCHMARK(BM_FitQuadsWeighted);
+BENCHMARK(BM_FitQuadsBatched);
+BENCHMARK(BM_FitQuadsParallel)
+        ->ArgName("threads")
+        ->RangeMultiplier(2)
+        ->Range(1, 8)
+        ->UseRealTime();
+BENCHMARK(BM_FitQuadsHalideSpans);
+BENCHMARK(BM_FitQuadsSoA);
 BENCHMARK(BM_AprilTagFitQuads);
+BENCHMARK(BM_GradientClustersFitQuads)->ArgName("scene")->DenseRange(0, 1);
+BENCHMARK(BM_ContourClustersFitQuads)->ArgName("scene")->DenseRange(0, 1);
+BENCHMARK(BM_DecodeQuads);
+BENCHMARK(BM_RefineEdges);
+BENCHMARK(BM_MatchCode)->ArgName("family")->DenseRange(0, 1);
+BENCHMARK(BM_AprilTagAddFamily)->ArgName("family")->DenseRange(0, 1)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EstimatePoses);
+BENCHMARK(BM_AprilTagEstimatePoses);
+BENCHMARK(BM_SortKeys)->ArgName("points")->RangeMultiplier(2)->Range(16, 2048);
+BENCHMARK(BM_VQSortKeys)->ArgName("points")->RangeMultiplier(2)->Range(16, 2048);
+BENCHMARK(BM_AprilTagPtSort)->ArgName("points")->RangeMultiplier(2)->Range(16, 2048);
 
 BENCHMARK_MAIN();
@@ -14,6 +14,8 @@
 #include "common/workerpool.h"
 #include "gradient_clusters.h"
 #include "halide/bm_only_halide_gradient_clusters.h"
+#include "region_graph.h"
+#include "simdtag/thread_pool.h"
 #include "simdtag/vision_utils.h"
 #include "threshold.h"
 
@@ -28,8 +30,27 @@ extern zarray_t* gradient_clusters(apriltag_detector_t* td, image_u8_t* threshim
                                    int ts, unionfind_t* uf);
 }
 
-static void BM_GradientClusters(benchmark::State& state) {
+// Desk scene tiled tiles x tiles times, then scaled to the requested width. More tiles means
+// more (and smaller) tags and edges per frame at the same resolution.
+static cv::Mat1b LoadScene(int width, int tiles) {
     cv::Mat1b input = cv::imread(IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b tiled;
+    cv::repeat(input, tiles, tiles, tiled);
+
+    cv::Mat1b result;
+    cv::Size size{width, width * input.rows / input.cols};
+    cv::resize(tiled, result, size, 0, 0, cv::INTER_AREA);
+    return result;
+}
+
+// {width, tiles}
+static void SceneArguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"width", "tiles"});
+    b->ArgsProduct({{640, 1280, 1600}, {1, 2, 4}});
+}
+
+static void BM_GradientClusters(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
     cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
     cv::Mat1i labels = cv::Mat1i{input.size(), 0};
     simdtag::BMRS ccl{input.size()};
@@ -42,6 +63,126 @@ static void BM_GradientClusters(benchmark::State& state) {
     for (auto _ : state) {
         gc.Perform(threshold, labels, hash);
     }
+
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = hash.size();
+}
+
+static void BM_GradientClustersSparse(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    for (auto _ : state) {
+        gc.PerformSparse(threshold, labels, hash);
+    }
+
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = hash.size();
+}
+
+static void BM_GradientClustersSort(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterArray array;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    for (auto _ : state) {
+        gc.Perform(threshold, labels, array);
+    }
+
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = array.Spans().size();
+}
+
+static void BM_GradientClustersLabels(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::LabelClusterStore store;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    for (auto _ : state) {
+        gc.Perform(threshold, labels, store, ccl.LabelCount());
+    }
+
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = store.Spans().size();
+}
+
+// Components that can't be a tag border are pruned with the region graph first. Includes
+// building the graph, the pruning works on a copy of the threshold.
+static void BM_GradientClustersPruned(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1b pruned = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::RegionGraph graph;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    size_t borders = 0;
+    for (auto _ : state) {
+        threshold.copyTo(pruned);
+        graph.Build(pruned, labels, ccl.LabelCount());
+        borders = graph.SelectTagBorders(simdtag::FitQuadsParams{});
+        graph.Prune(pruned, labels);
+        gc.Perform(pruned, labels, hash);
+    }
+
+    state.counters["borders"] = borders;
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = hash.size();
+}
+
+static void BM_GradientClustersParallel(benchmark::State& state) {
+    cv::Mat1b input = LoadScene(state.range(0), state.range(1));
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::ThreadPool pool{static_cast<size_t>(state.range(2))};
+    std::vector<simdtag::GradientClusterHash> partitions;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    for (auto _ : state) {
+        gc.Perform(threshold, labels, pool, partitions);
+    }
+
+    size_t clusters = 0;
+    for (auto& partition : partitions) {
+        clusters += partition.size();
+    }
+
+    state.counters["points"] = gc.Size();
+    state.counters["clusters"] = clusters;
+}
+
+// {width, tiles, threads}
+static void ParallelArguments(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"width", "tiles", "threads"});
+    b->ArgsProduct({{640, 1280, 1600}, {1, 4}, {1, 2, 4, 8}});
 }
 
 static void BM_HalideGradientClusters(benchmark::State& state) {
@@ -62,7 +203,7 @@ static void BM_HalideGradientClusters(benchmark::State& state) {
         gc.Perform(threshold, labels);
     }
 
-    gc.Perform(threshold, labels);
+    state.counters["points"] = gc.Size();
 }
 
 static void BM_AprilTagGradientClusters(benchmark::State& state) {
@@ -90,7 +231,12 @@ static void BM_AprilTagGradientClusters(benchmark::State& state) {
     }
 }
 
-BENCHMARK(BM_GradientClusters);
+BENCHMARK(BM_GradientClusters)->Apply(SceneArguments);
+BENCHMARK(BM_GradientClustersSparse)->Apply(SceneArguments);
+BENCHMARK(BM_GradientClustersSort)->Apply(SceneArguments);
+BENCHMARK(BM_GradientClustersLabels)->Apply(SceneArguments);
+BENCHMARK(BM_GradientClustersPruned)->Apply(SceneArguments);
+BENCHMARK(BM_GradientClustersParallel)->Apply(ParallelArguments)->UseRealTime();
 BENCHMARK(BM_HalideGradientClusters);
 BENCHMARK(BM_AprilTagGradientClusters);
 
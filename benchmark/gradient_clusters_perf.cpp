@@ -40,7 +40,8 @@ static void Perf_GradientClusters() {
         gc.Perform(threshold, labels, hash);
     }
 
-    simdtag::FitQuads::Perform(hash, input.size());
+    std::vector<simdtag::Quad> quads;
+    simdtag::FitQuads::Perform(hash, input.size(), quads);
 
     // gc.Print(buffer);
     cv::Mat1b result = gc.Draw(hash);
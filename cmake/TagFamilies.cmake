@@ -0,0 +1,81 @@
+# Generates constexpr codebooks from the apriltag family sources, so nothing is built at runtime.
+# Each family becomes ${TAG_FAMILIES_INCLUDE_DIR}/tag_families/<name>.h with the codes, the bit
+# layout, a simdtag::TagFamily and its rotation expanded codebook.
+
+set(TAG_FAMILIES_INCLUDE_DIR "${CMAKE_BINARY_DIR}/generated")
+
+function(simdtag_generate_tag_family name source)
+    file(READ "${source}" text)
+
+    foreach(field h nbits width_at_border total_width reversed_border)
+        string(REGEX MATCH "tf->${field} = ([a-z0-9]+);" match "${text}")
+        if(NOT match)
+            message(FATAL_ERROR "No ${field} in ${source}")
+        endif()
+        set(${field} "${CMAKE_MATCH_1}")
+    endforeach()
+
+    string(REGEX MATCHALL "0x[0-9a-fA-F]+UL" codes "${text}")
+    list(LENGTH codes ncodes)
+    list(TRANSFORM codes REPLACE "UL$" "ull")
+    list(JOIN codes ",\n        " codes)
+
+    set(bit_x "")
+    set(bit_y "")
+    math(EXPR last "${nbits} - 1")
+    foreach(i RANGE ${last})
+        foreach(axis x y)
+            string(REGEX MATCH "tf->bit_${axis}\\[${i}\\] = (-?[0-9]+);" match "${text}")
+            if(NOT match)
+                message(FATAL_ERROR "No bit_${axis}[${i}] in ${source}")
+            endif()
+            list(APPEND bit_${axis} "${CMAKE_MATCH_1}")
+        endforeach()
+    endforeach()
+    list(JOIN bit_x ", " bit_x)
+    list(JOIN bit_y ", " bit_y)
+
+    # tag36h11 -> Tag36h11, tagStandard41h12 -> TagStandard41h12
+    string(SUBSTRING "${name}" 0 1 head)
+    string(SUBSTRING "${name}" 1 -1 tail)
+    string(TOUPPER "${head}" head)
+    set(constant "k${head}${tail}")
+
+    set(header "// Generated by cmake/TagFamilies.cmake from apriltag ${name}.c, do not edit
+#pragma once
+
+#include <cstdint>
+
+#include \"tag_codebook.h\"
+#include \"tag_family.h\"
+
+namespace simdtag {
+
+inline constexpr uint64_t ${constant}Codes[${ncodes}] = {
+        ${codes}};
+
+inline constexpr int8_t ${constant}BitX[${nbits}] = {${bit_x}};
+inline constexpr int8_t ${constant}BitY[${nbits}] = {${bit_y}};
+
+alignas(64) inline constexpr auto ${constant}Codebook = MakeCodebook(${constant}Codes, ${nbits});
+
+inline constexpr TagFamily ${constant}{\"${name}\",
+                                    ${constant}Codes,
+                                    ${constant}BitX,
+                                    ${constant}BitY,
+                                    ${nbits},
+                                    ${h},
+                                    ${width_at_border},
+                                    ${total_width},
+                                    ${reversed_border},
+                                    ${constant}Codebook};
+
+}  // namespace simdtag
+")
+
+    # Only touched when the contents change, so the tests don't rebuild on every configure
+    set(output "${TAG_FAMILIES_INCLUDE_DIR}/tag_families/${name}.h")
+    file(WRITE "${output}.tmp" "${header}")
+    configure_file("${output}.tmp" "${output}" COPYONLY)
+    file(REMOVE "${output}.tmp")
+endfunction()
@@ -79,6 +79,13 @@ class PackedBinaryImage {
         return PackedBinaryImage{image, HWY_NAMESPACE::__ToBinaryAlignedPaddedMasked<MASK>};
     }
 
+    // Refill an existing image (of the same size) without reallocating
+    template <size_t MASK>
+    void UpdateFromMask(cv::Mat1b const& image) {
+        assert(image.rows == height_ && image.cols == width_);
+        Fill(image, HWY_NAMESPACE::__ToBinaryAlignedPaddedMasked<MASK>);
+    }
+
     ~PackedBinaryImage() {
         if (bits_) delete[] bits_;
     }
@@ -170,8 +177,15 @@ class PackedBinaryImage {
     template <typename FCN>
     PackedBinaryImage(cv::Mat1b const& image, FCN&& fcn)
         : PackedBinaryImage(image.rows, image.cols) {
+        Fill(image, fcn);
+    }
+
+    template <typename FCN>
+    void Fill(cv::Mat1b const& image, FCN&& fcn) {
         assert(image.isContinuous());
-        uint64_t mask = 0xFFFFFFFFFFFFFFFF >> (64 - (width_ % 64));
+
+        // When the width is a multiple of 64 the last word is entirely past the end of the row
+        uint64_t mask = (width_ % 64) ? 0xFFFFFFFFFFFFFFFF >> (64 - (width_ % 64)) : 0;
         for (int i = 0; i < height_; i++) {
             uint64_t* dst = bits_ + double_word_stride_ * i;
             fcn(dst, image.ptr<uint8_t>(i), image.cols);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <hwy/aligned_allocator.h>
+#include <hwy/base.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace simdtag {
+
+// Bump allocator for per-thread temporary buffers. Every allocation is 64-byte aligned and
+// followed by at least kPadding bytes that belong to it, so SIMD loops may load and store whole
+// vectors past the requested count. Reset() releases everything at once and keeps the memory,
+// so after the first frame there are no more allocations. When a block runs out a new one is
+// chained on, earlier pointers stay valid until Reset(), which then merges the blocks.
+class ScratchArena {
+   public:
+    static constexpr size_t kAlignment = 64;
+    // Two vectors, an interleaved store of one vector of points writes a vector of pairs
+    static constexpr size_t kPadding = 2 * HWY_MAX_BYTES;
+
+    explicit ScratchArena(size_t capacity = 1 << 16) {
+        AddBlock(capacity);
+    }
+
+    ScratchArena(ScratchArena&&) = default;
+    ScratchArena& operator=(ScratchArena&&) = default;
+
+    // Room for count values of T plus kPadding bytes, uninitialized
+    template <class T>
+    T* Allocate(size_t count) {
+        const size_t bytes = hwy::RoundUpTo(count * sizeof(T) + kPadding, kAlignment);
+
+        if (used_ + bytes > capacity_) [[unlikely]] {
+            AddBlock(std::max(bytes, capacity_ * 2));
+        }
+
+        T* result = reinterpret_cast<T*>(blocks_.back().get() + used_);
+        used_ += bytes;
+        return result;
+    }
+
+    void Reset() {
+        if (blocks_.size() > 1) {
+            size_t total = total_;
+            blocks_.clear();
+            total_ = 0;
+            AddBlock(total);
+        }
+        used_ = 0;
+    }
+
+    // Total bytes held by the arena
+    size_t Capacity() const {
+        return total_;
+    }
+
+   private:
+    void AddBlock(size_t bytes) {
+        blocks_.push_back(hwy::AllocateAligned<uint8_t>(bytes));
+        capacity_ = bytes;
+        total_ += bytes;
+        used_ = 0;
+    }
+
+    std::vector<hwy::AlignedFreeUniquePtr<uint8_t[]>> blocks_;
+    size_t capacity_ = 0;
+    size_t total_ = 0;
+    size_t used_ = 0;
+};
+
+}  // namespace simdtag
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace simdtag {
+
+// Minimal fork-join pool with persistent workers. Run() hands out the task indices
+// [0, num_tasks) to the workers and the calling thread, then blocks until every task is done.
+// Thread index 0 is always the calling thread, so per-thread scratch can be indexed by it.
+//
+// RunStealing() deals the tasks round-robin to per-thread queues instead of one shared counter,
+// so with tasks sorted largest first every thread starts on a large one and mostly touches its
+// own cache line. A thread that runs out steals from the back of the other queues, which is
+// where the smallest tasks are.
+class ThreadPool {
+   public:
+    using TaskFunction = std::function<void(size_t task, size_t thread)>;
+
+    explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency()) {
+        num_threads = std::max<size_t>(num_threads, 1);
+        queues_ = std::make_unique<Queue[]>(num_threads);
+        for (size_t i = 1; i < num_threads; i++) {
+            workers_.emplace_back([this, i]() { this->WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::scoped_lock lock{mutex_};
+            stop_ = true;
+        }
+        start_cv_.notify_all();
+
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t NumThreads() const {
+        return workers_.size() + 1;
+    }
+
+    void Run(size_t num_tasks, TaskFunction const& fcn) {
+        Start(num_tasks, fcn, false);
+    }
+
+    void RunStealing(size_t num_tasks, TaskFunction const& fcn) {
+        const size_t num_threads = NumThreads();
+        for (size_t thread = 0; thread < num_threads; thread++) {
+            // Thread t owns the tasks t, t + T, t + 2T, ...
+            const uint64_t count = (num_tasks + num_threads - 1 - thread) / num_threads;
+            queues_[thread].range.store(count, std::memory_order_relaxed);
+        }
+
+        Start(num_tasks, fcn, true);
+    }
+
+   private:
+    // Range of slots [head, tail) of one thread, packed as head << 32 | tail so both ends can be
+    // taken with one compare exchange. Slot s of thread t is task s * T + t.
+    struct alignas(64) Queue {
+        std::atomic<uint64_t> range = 0;
+    };
+
+    void Start(size_t num_tasks, TaskFunction const& fcn, bool stealing) {
+        {
+            std::scoped_lock lock{mutex_};
+            fcn_ = &fcn;
+            num_tasks_ = num_tasks;
+            next_task_ = 0;
+            stealing_ = stealing;
+            active_ = workers_.size();
+            generation_++;
+        }
+        start_cv_.notify_all();
+
+        Work(0);
+
+        std::unique_lock lock{mutex_};
+        done_cv_.wait(lock, [this]() { return active_ == 0; });
+        fcn_ = nullptr;
+    }
+
+    void Work(size_t thread) {
+        if (stealing_) {
+            WorkStealing(thread);
+            return;
+        }
+
+        for (size_t task = next_task_++; task < num_tasks_; task = next_task_++) {
+            (*fcn_)(task, thread);
+        }
+    }
+
+    // Take the front (own queue) or back (stolen) slot, false once the queue is empty
+    static bool Take(Queue& queue, bool front, uint64_t& slot) {
+        uint64_t range = queue.range.load(std::memory_order_relaxed);
+        while (true) {
+            const uint64_t head = range >> 32;
+            const uint64_t tail = range & 0xFFFFFFFF;
+            if (head >= tail) return false;
+
+            const uint64_t next = front ? (head + 1) << 32 | tail : head << 32 | (tail - 1);
+            if (queue.range.compare_exchange_weak(range, next, std::memory_order_relaxed)) {
+                slot = front ? head : tail - 1;
+                return true;
+            }
+        }
+    }
+
+    void WorkStealing(size_t thread) {
+        const size_t num_threads = NumThreads();
+        uint64_t slot;
+
+        while (Take(queues_[thread], true, slot)) {
+            (*fcn_)(slot * num_threads + thread, thread);
+        }
+
+        for (size_t i = 1; i < num_threads; i++) {
+            const size_t victim = (thread + i) % num_threads;
+            while (Take(queues_[victim], false, slot)) {
+                (*fcn_)(slot * num_threads + victim, thread);
+            }
+        }
+    }
+
+    void WorkerLoop(size_t thread) {
+        uint64_t seen = 0;
+
+        while (true) {
+            {
+                std::unique_lock lock{mutex_};
+                start_cv_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+
+            Work(thread);
+
+            {
+                std::scoped_lock lock{mutex_};
+                if (--active_ == 0) done_cv_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    uint64_t generation_ = 0;
+    size_t active_ = 0;
+    bool stop_ = false;
+
+    const TaskFunction* fcn_ = nullptr;
+    size_t num_tasks_ = 0;
+    std::atomic<size_t> next_task_ = 0;
+    bool stealing_ = false;
+    std::unique_ptr<Queue[]> queues_;
+};
+
+}  // namespace simdtag
@@ -0,0 +1,147 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "gradient_clusters.h"
+#include "gradient_point.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Unpack size points into the float planes, which must be vector aligned. Coordinates stay
+// doubled as in GradientPoint. The last vector is padded with copies of the last point and a zero
+// gradient, so min/max and dot product kernels can run over whole vectors without masks.
+template <class T>
+inline void __DecodePoints(const T* points, size_t size, float* x, float* y, float* gx,
+                           float* gy) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr int N = hw::Lanes(dfloat);
+
+    size_t i = 0;
+    for (; i + N <= size; i += N) {
+        const auto va = __LoadPoints(points + i);
+        hw::Store(hw::ConvertTo(dfloat, __GetXVector(va)), dfloat, x + i);
+        hw::Store(hw::ConvertTo(dfloat, __GetYVector(va)), dfloat, y + i);
+        hw::Store(hw::ConvertTo(dfloat, __GetGxVector(va)), dfloat, gx + i);
+        hw::Store(hw::ConvertTo(dfloat, __GetGyVector(va)), dfloat, gy + i);
+    }
+
+    const size_t padded = hwy::RoundUpTo(size, N);
+    for (; i < padded; i++) {
+        GradientPoint p{static_cast<uint32_t>(points[std::min(i, size - 1)])};
+        float sign = p.GetBlackToWhite() ? 1.0f : -1.0f;
+
+        x[i] = p.GetX() * 2.0f;
+        y[i] = p.GetY() * 2.0f;
+        gx[i] = i < size ? sign * p.GetDx() : 0.0f;
+        gy[i] = i < size ? sign * p.GetDy() : 0.0f;
+    }
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// One cluster of a ClusterSoA, the planes hold size points and are padded to whole vectors
+struct ClusterView {
+    float* x;
+    float* y;
+    float* gx;
+    float* gy;
+    uint32_t size;
+};
+
+// Structure of arrays copy of the clusters, decoded once so FitQuads can work on aligned float
+// loads instead of unpacking GradientPoint bit fields in every pass. Floats rather than int16 so
+// the moments and line fits can use FMA directly. Each cluster starts on a vector boundary.
+class ClusterSoA {
+   public:
+    ClusterSoA(size_t capacity = 1 << 16) {
+        Reserve(capacity);
+    }
+
+    void Clear() {
+        size_ = 0;
+        spans_.clear();
+    }
+
+    // From a sorted (key << 32 | point) buffer, e.g. GradientClusterArray or
+    // HalideGradientClusters
+    void Build(const uint64_t* points, std::vector<ClusterSpan> const& spans) {
+        Clear();
+        for (auto const& span : spans) {
+            Append(points + span.offset, span.length);
+        }
+    }
+
+    void Build(GradientClusterHash& hash) {
+        Clear();
+        for (auto it = hash.cbegin(); it != hash.cend(); it++) {
+            Append(it->second.points.data(), it->second.points.size());
+        }
+    }
+
+    size_t Count() const {
+        return spans_.size();
+    }
+
+    ClusterView Cluster(size_t i) {
+        const ClusterSpan& span = spans_[i];
+        return {x_.get() + span.offset, y_.get() + span.offset, gx_.get() + span.offset,
+                gy_.get() + span.offset, span.length};
+    }
+
+   private:
+    template <class T>
+    void Append(const T* points, size_t size) {
+        constexpr hw::ScalableTag<float> dfloat;
+        const size_t padded = hwy::RoundUpTo(size, hw::Lanes(dfloat));
+
+        if (size_ + padded > capacity_) [[unlikely]] {
+            Reserve(std::max(size_ + padded, capacity_ * 2));
+        }
+
+        HWY_NAMESPACE::__DecodePoints(points, size, x_.get() + size_, y_.get() + size_,
+                                      gx_.get() + size_, gy_.get() + size_);
+
+        spans_.push_back({static_cast<uint32_t>(size_), static_cast<uint32_t>(size)});
+        size_ += padded;
+    }
+
+    // Grow the planes (keeping their contents) so that at least count floats fit
+    void Reserve(size_t count) {
+        if (count <= capacity_) return;
+
+        for (auto* plane : {&x_, &y_, &gx_, &gy_}) {
+            auto grown = hwy::AllocateAligned<float>(count);
+            if (size_) std::copy(plane->get(), plane->get() + size_, grown.get());
+            *plane = std::move(grown);
+        }
+
+        capacity_ = count;
+    }
+
+    hwy::AlignedFreeUniquePtr<float[]> x_;
+    hwy::AlignedFreeUniquePtr<float[]> y_;
+    hwy::AlignedFreeUniquePtr<float[]> gx_;
+    hwy::AlignedFreeUniquePtr<float[]> gy_;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+    // Offsets are in floats and vector aligned, length is the number of points
+    std::vector<ClusterSpan> spans_;
+};
+
+}  // namespace simdtag
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "gradient_clusters.h"
+#include "gradient_point.h"
+
+namespace simdtag {
+
+// Alternative to GradientClusters that traces the outer boundary of each component of the BMRS
+// label image instead of visiting every pixel pair. Points come out in the order they are walked,
+// which for the convex outline of a tag is already the slope order FitQuads sorts into, so
+// FitQuadsParams::ordered_clusters can skip __FindCenterPoint and __SortBySlope entirely.
+//
+// Each boundary crack between a component pixel and a 4-neighbor of the opposite polarity gives
+// one GradientPoint, packed exactly as GradientClusters does, so ClusterStats and every FitQuads
+// route work unchanged. Diagonal pairs are not emitted, clusters hold about half as many points.
+class ContourClusters {
+   public:
+    explicit ContourClusters([[maybe_unused]] cv::Size size) {
+        assert(size.width <= GradientPoint::kMaxImageSize);
+        assert(size.height <= GradientPoint::kMaxImageSize);
+    }
+
+    // label_count as returned by BMRS::LabelCount(). Black components are traced for normal
+    // borders, with reversed_border white ones as well. Clusters are keyed by the (traced,
+    // neighbor) label pair, so a side by side pair traced from both components stays apart.
+    void Perform(cv::Mat1b const& input, cv::Mat1i const& labels, int label_count,
+                 GradientClusterHash& hash, bool reversed_border = false) {
+        hash.clear();
+        points_ = 0;
+
+        // Label 0 is the unknown gray of the threshold, never traced
+        traced_.assign(label_count + 1, 0);
+        traced_[0] = 1;
+
+        for (int y = 0; y < input.rows; y++) {
+            const uint8_t* row = input.ptr<uint8_t>(y);
+            const unsigned* label_row = labels.ptr<unsigned>(y);
+
+            uint32_t last = 0;
+            for (int x = 0; x < input.cols; x++) {
+                const uint32_t label = label_row[x];
+                if (label == last) continue;
+
+                last = label;
+                if (traced_[label]) continue;
+                traced_[label] = 1;
+
+                // The first pixel of a component in raster order always has its top side on
+                // the boundary
+                if (row[x] == 0 || (reversed_border && row[x] == 255)) {
+                    Trace(input, labels, x, y, hash);
+                }
+            }
+        }
+    }
+
+    // Points emitted by the last Perform
+    int Points() const {
+        return points_;
+    }
+
+   private:
+    // Crack following with the component on the right hand side. This walks the outer boundary
+    // clockwise on screen, which with y down is the order of increasing slope in FitQuads.
+    // Sides are numbered right, down, left, up. Diagonal steps are taken first since BMRS
+    // components are 8-connected.
+    void Trace(cv::Mat1b const& input, cv::Mat1i const& labels, int x0, int y0,
+               GradientClusterHash& hash) {
+        static constexpr int kDx[4] = {1, 0, -1, 0};
+        static constexpr int kDy[4] = {0, 1, 0, -1};
+
+        const uint32_t label = static_cast<uint32_t>(labels(y0, x0));
+
+        auto in_image = [&](int x, int y) {
+            return x >= 0 && y >= 0 && x < input.cols && y < input.rows;
+        };
+        auto inside = [&](int x, int y) {
+            return in_image(x, y) && static_cast<uint32_t>(labels(y, x)) == label;
+        };
+
+        // Boundaries mostly run along one neighbor for long stretches, keep its cluster at hand.
+        // Only a new neighbor inserts into the hash, so the pointer stays valid until then.
+        GradientCluster* cluster = nullptr;
+        uint32_t cluster_neighbor = 0;
+
+        int x = x0;
+        int y = y0;
+        int side = 3;
+
+        do {
+            const int qx = x + kDx[side];
+            const int qy = y + kDy[side];
+
+            // Only black/white pairs, as in apriltag, gray is unknown
+            if (in_image(qx, qy) && input(y, x) + input(qy, qx) == 255) {
+                const uint32_t neighbor = static_cast<uint32_t>(labels(qy, qx));
+                if (cluster == nullptr || neighbor != cluster_neighbor) {
+                    cluster = FindOrInsert(hash, ClusterKey(label, neighbor));
+                    cluster_neighbor = neighbor;
+                }
+
+                // Same orientation as GradientClusters, from the pixel with the smaller
+                // coordinate along the positive direction
+                uint32_t point;
+                if (side < 2) {
+                    point = GradientPoint::Pack(x, y, kDx[side], kDy[side],
+                                                input(y, x) < input(qy, qx));
+                } else {
+                    point = GradientPoint::Pack(qx, qy, -kDx[side], -kDy[side],
+                                                input(qy, qx) < input(y, x));
+                }
+                cluster->Add(point);
+                points_++;
+            }
+
+            // a is the pixel ahead, b the one diagonally ahead on the outside
+            const int walk = (side + 1) & 3;
+            const int ax = x + kDx[walk];
+            const int ay = y + kDy[walk];
+            const int bx = ax + kDx[side];
+            const int by = ay + kDy[side];
+
+            if (inside(bx, by)) {
+                x = bx;
+                y = by;
+                side = (side + 3) & 3;
+            } else if (inside(ax, ay)) {
+                x = ax;
+                y = ay;
+            } else {
+                side = walk;
+            }
+        } while (x != x0 || y != y0 || side != 3);
+    }
+
+    // "Knuth's Multiplicative Hash" of the ordered pair, as __HashLabelPair
+    static uint32_t ClusterKey(uint32_t traced, uint32_t neighbor) {
+        const uint64_t pair = static_cast<uint64_t>(traced) << 32 | neighbor;
+        return static_cast<uint32_t>((pair * 2654435761ull) >> 32);
+    }
+
+    static GradientCluster* FindOrInsert(GradientClusterHash& hash, uint32_t key) {
+        GradientCluster* cluster = hash.try_get(key);
+        if (cluster == nullptr) {
+            hash.insert_unique(key, GradientCluster{});
+            cluster = hash.try_get(key);
+        }
+        return cluster;
+    }
+
+    int points_ = 0;
+
+    // One flag per label, set once the component has been seen
+    std::vector<uint8_t> traced_;
+};
+
+}  // namespace simdtag
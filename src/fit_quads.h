@@ -7,8 +7,6 @@
 
 #include <hwy/highway.h>
 
-#include <hwy/contrib/math/math-inl.h>
-
 #define VQSORT_ONLY_STATIC 1
 #include <hwy/contrib/sort/vqsort-inl.h>
 #include <hwy/contrib/sort/order.h>
@@ -19,253 +17,320 @@
 #include <algorithm>
 #include <opencv2/core.hpp>
 
+#include "cluster_soa.h"
 #include "gradient_clusters.h"
+#include "line_fit.h"
+#include "quad.h"
+#include "quad_corners.h"
+#include "simdtag/scratch_arena.h"
+#include "simdtag/thread_pool.h"
 
 namespace hw = hwy::HWY_NAMESPACE;
 
 namespace simdtag {
 
+// Tuning of FitQuads, defaults follow apriltag
+struct FitQuadsParams {
+    // Early rejection of clusters before they are sorted. A typical point along an edge is added
+    // two times (because it has 2 unique neighbors), so this is roughly 12 pixels of outline.
+    // Values below the vector width are raised to it.
+    uint32_t min_cluster_points = 24;
+
+    // Smallest tag in pixels, the bounding box must hold at least 0.95 * min_tag_width^2
+    float min_tag_width = 8.0f;
+
+    // Longest over shortest side of the bounding box
+    float max_aspect_ratio = 8.0f;
+
+    // Which border winding to keep, see the dot product in __CalculateSlopes. Normal families
+    // have a black border inside a white one.
+    bool normal_border = true;
+    bool reversed_border = false;
+
+    // Corner search, see QuadCorners. How many error maxima are tried as corners, the largest
+    // line fit mean squared error of a side and the cosine of the smallest corner angle.
+    size_t max_nmaxima = 10;
+    double max_line_fit_mse = 10.0;
+    double cos_critical_rad = 0.984807753012208;  // cos(10 degrees)
+
+    // Sort the points of all selected clusters in a single VQSort on (cluster, slope) keys
+    // instead of one sort per cluster. Only the serial hashmap route.
+    bool batched_sort = false;
+
+    // Clusters are already in slope order around their center, e.g. from ContourClusters, so
+    // the sort is skipped and the border direction comes from the cluster statistics
+    bool ordered_clusters = false;
+};
+
 HWY_BEFORE_NAMESPACE();
 namespace HWY_NAMESPACE {
 
 using V32 = hw::VFromD<hw::ScalableTag<uint32_t>>;
 using VFloat = hw::VFromD<hw::ScalableTag<float>>;
 
-V32 __GetXVector(const V32& vvalue) {
-    return hw::ShiftRight<20>(vvalue);
-}
+// Sortable pseudo angle of the offset (dx, dy) from the center. Each slope is calculated by
+// quadrant in range [0, 1) multiplied by a scalar then the top two bits specify quadrant. Used to
+// allow uint32_t sort of slope
+inline V32 __PseudoAngle(const VFloat& vdx, const VFloat& vdy) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr hw::ScalableTag<float> dfloat;
 
-V32 __GetYVector(const V32& vvalue) {
-    hw::DFromV<V32> d;
-    return hw::ShiftRight<8>(vvalue) & hw::Set(d, 0xFFFu);
-}
+    const auto vquad0 = hw::Zero(d);
+    const auto vquad1 = hw::Set(d, 1 << 30);
+    const auto vquad2 = hw::Set(d, 2 << 30);
+    const auto vquad3 = hw::Set(d, 3 << 30);
+    const auto vscale = hw::Set(dfloat, 1 << 20);
 
-V32 __GetGxVector(const V32& vvalue) {
-    hw::DFromV<V32> d;
-    return hw::ShiftRight<6>(vvalue) + hw::Set(d, 1);
-}
+    const auto mdx_lt = vdx < hw::Zero(dfloat);
+    const auto mdy_lt = vdy < hw::Zero(dfloat);
+    const auto mdx_ge = vdx >= hw::Zero(dfloat);
+    const auto mdy_ge = vdy >= hw::Zero(dfloat);
+
+    const auto mquad1 = hw::And(mdy_ge, mdx_lt);
+    const auto mquad2 = hw::And(mdy_lt, mdx_lt);
+    const auto mquad3 = hw::And(mdy_lt, mdx_ge);
+
+    const auto vneg_dx = hw::Neg(vdx);
+    const auto vneg_dy = hw::Neg(vdy);
 
-V32 __GetGyVector(const V32& vvalue) {
-    hw::DFromV<V32> d;
-    return hw::ShiftRight<4>(vvalue) + hw::Set(d, 1);
+    // dy >= 0 && dx >= 0
+    auto vquad = vquad0;
+    vquad = hw::IfThenElse(RebindMask(d, mquad1), vquad1, vquad);
+    vquad = hw::IfThenElse(RebindMask(d, mquad2), vquad2, vquad);
+    vquad = hw::IfThenElse(RebindMask(d, mquad3), vquad3, vquad);
+
+    auto vslope = vdy / (vdx + vdy);
+    vslope = hw::IfThenElse(mquad1, vneg_dx / (vneg_dx + vdy), vslope);
+    vslope = hw::IfThenElse(mquad2, vneg_dy / (vneg_dx - vdy), vslope);
+    vslope = hw::IfThenElse(mquad3, vdx / (vdx - vdy), vslope);
+
+    return hw::ConvertTo(d, vslope * vscale) + vquad;
 }
-inline void __SortBySlopeApriltag(ClusterStore& cluster, std::pair<float, float>& center) {
+
+// Pass every vector of points and their slopes to store(i, vpoints, vslopes). The last vector
+// overlaps the previous one instead of reading past the end, store may write to the points.
+// Returns the sum of the dot products of the offset from the center with the gradient, as in
+// apriltag the sign tells which way the border is wound.
+template <class T, class StoreFunction>
+inline float __ForEachSlope(const T* points, size_t size, std::pair<float, float>& center,
+                            StoreFunction store) {
     constexpr hw::ScalableTag<uint32_t> d;
-    constexpr hw::ScalableTag<uint64_t> d64;
     constexpr hw::ScalableTag<float> dfloat;
     constexpr int N = hw::Lanes(d);
 
-    std::vector<uint64_t> ret;
-    ret.reserve(cluster.size() + N * 2);
-    uint64_t* output_ptr = ret.data();
-
-    // Copy exact from apriltag, compare to hw::atan2
-    constexpr float quadrants[2][2] = {{-1 * (2 << 15), 0}, {2 * (2 << 15), 2 << 15}};
+    // The tail is done by a last overlapping vector instead of reading past the end
+    assert(size >= N);
 
     const auto vcx = hw::Set(dfloat, center.first);
     const auto vcy = hw::Set(dfloat, center.second);
 
-    uint32_t* buffer = cluster.data();
-    size_t size = cluster.size();
-
     auto vdot = hw::Zero(dfloat);
-    // TODO: This is size + 1 to get all plus some extra. We should make sure vector is padded (and
-    // aligned would be neat too)
-    for (int i = 0; i < size + 1; i += N) {
-        const auto va = hw::LoadU(d, buffer + i);
+
+    auto slopes = [&](size_t i, const auto& mnew) {
+        const auto va = __LoadPoints(points + i);
         const auto vx = hw::ConvertTo(dfloat, __GetXVector(va));
         const auto vy = hw::ConvertTo(dfloat, __GetYVector(va));
 
-        auto vdx = vx - vcx;
-        auto vdy = vy - vcy;
+        const auto vdx = vx - vcx;
+        const auto vdy = vy - vcy;
         const auto vgx = hw::ConvertTo(dfloat, __GetGxVector(va));
         const auto vgy = hw::ConvertTo(dfloat, __GetGyVector(va));
 
-        vdot = vdot + vdx * vgx + vdy * vgy;
-
-        const auto mdx_lt = vdx < hw::Zero(dfloat);
-        const auto mdy_lt = vdy < hw::Zero(dfloat);
-        const auto mdx_ge = vdx >= hw::Zero(dfloat);
-        const auto mdy_ge = vdy >= hw::Zero(dfloat);
-
-        const auto vneg1 = hw::Set(dfloat, -1);
-        const auto vneg_dx = vdx * vneg1;
-        const auto vneg_dy = vdy * vneg1;
-
-        // dy >= 0 && dx >= 0
-        auto vquad = hw::Set(dfloat, quadrants[1][1]);
-
-        // dy < 0 && dx < 0
-        vquad = hw::IfThenElse(hw::And(mdx_lt, mdy_lt), hw::Set(dfloat, quadrants[0][0]), vquad);
-
-        // dy < 0 && dx >= 0
-        vquad = hw::IfThenElse(hw::And(mdx_lt, mdx_ge), hw::Set(dfloat, quadrants[1][0]), vquad);
-
-        // dy >= 0 && dx < 0
-        vquad = hw::IfThenElse(hw::And(mdy_ge, mdy_lt), hw::Set(dfloat, quadrants[0][1]), vquad);
+        vdot = vdot + hw::IfThenElseZero(mnew, vdx * vgx + vdy * vgy);
 
-        // vdx = hw::MaskedMulOr(vdx, mdy_lt, vdx, vneg1);
-        // vdy = hw::MaskedMulOr(vdy, mdy_lt, vdy, vneg1);
-        vdx = hw::IfThenElse(mdy_lt, vneg_dx, vdx);
-        vdy = hw::IfThenElse(mdy_lt, vneg_dy, vdy);
+        store(i, va, __PseudoAngle(vdx, vdy));
+    };
 
-        vdx = hw::IfThenElse(mdx_lt, vdy, vdx);
-        vdy = hw::IfThenElse(mdx_lt, vneg_dx, vdy);
-
-        // p->slope = quadrant + dy / dx;
-
-        auto vslope = hw::ConvertTo(d, (vquad + vdy / vdx));
-        hw::StoreInterleaved2(va, vslope, d, (uint32_t*)(output_ptr + i));
+    size_t i = 0;
+    for (; i + N <= size; i += N) {
+        slopes(i, hw::FirstN(dfloat, N));
     }
 
-    hw::VQSortStatic((hwy::K32V32*)output_ptr, size, hwy::SortAscending{});
-
-    for (int i = 0; i < size + 1; i += N) {
-        V32 _discard, vcpy;
-        hw::LoadInterleaved2(d, (uint32_t*)output_ptr, vcpy, _discard);
-        hw::StoreU(vcpy, d, buffer);
+    // Lanes already done by the previous vector are recomputed but not counted twice
+    if (i != size) {
+        slopes(size - N, hw::Not(hw::FirstN(dfloat, N - (size - i))));
     }
+
+    return hw::ReduceSum(dfloat, vdot);
 }
 
-inline float __SortBySlope(ClusterStore& cluster, std::pair<float, float>& center) {
+// Write (slope << 32 | point) of every point to out, out may alias a uint64_t points buffer
+template <class T>
+inline float __CalculateSlopes(const T* points, size_t size, std::pair<float, float>& center,
+                               uint64_t* out) {
     constexpr hw::ScalableTag<uint32_t> d;
-    constexpr hw::ScalableTag<uint64_t> d64;
-    constexpr hw::ScalableTag<float> dfloat;
-    constexpr int N = hw::Lanes(d);
 
-    std::vector<uint64_t> ret(cluster.size() + N * 2);
-    uint64_t* output_ptr = ret.data();
-
-    // Each slope is calculated by quadrant in rand [0, 1) multiplied
-    // by a scalar then the top two bits specify quadrant. Used to allow
-    // uint32_t sort of slope
-    const auto vquad0 = hw::Zero(d);
-    const auto vquad1 = hw::Set(d, 1 << 30);
-    const auto vquad2 = hw::Set(d, 2 << 30);
-    const auto vquad3 = hw::Set(d, 3 << 30);
-    const auto vscale = hw::Set(dfloat, 1 << 20);
+    return __ForEachSlope(points, size, center, [&](size_t i, V32 va, V32 vslope) {
+        hw::StoreInterleaved2(va, vslope, d, reinterpret_cast<uint32_t*>(out + i));
+    });
+}
 
-    const auto vcx = hw::Set(dfloat, center.first);
-    const auto vcy = hw::Set(dfloat, center.second);
+// Write (index << 96 | slope << 64 | point) of every point to out, so the clusters of a frame
+// can be sorted by slope in one go. The point breaks ties as in the per cluster keys.
+template <class T>
+inline float __CalculateBatchedSlopes(const T* points, size_t size,
+                                      std::pair<float, float>& center, uint32_t index,
+                                      hwy::uint128_t* out) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr hw::Half<decltype(d)> dh;
+    constexpr hw::Repartition<uint64_t, decltype(d)> d64;
+    constexpr int N64 = hw::Lanes(d64);
+
+    const auto vindex = hw::Set(d64, uint64_t{index} << 32);
+
+    return __ForEachSlope(points, size, center, [&](size_t i, V32 va, V32 vslope) {
+        uint64_t* dst = reinterpret_cast<uint64_t*>(out + i);
+
+        // (lo, hi) pairs, half a vector of points each
+        hw::StoreInterleaved2(hw::PromoteTo(d64, hw::LowerHalf(dh, va)),
+                              hw::Or(vindex, hw::PromoteTo(d64, hw::LowerHalf(dh, vslope))), d64,
+                              dst);
+        hw::StoreInterleaved2(hw::PromoteTo(d64, hw::UpperHalf(dh, va)),
+                              hw::Or(vindex, hw::PromoteTo(d64, hw::UpperHalf(dh, vslope))), d64,
+                              dst + 2 * N64);
+    });
+}
 
-    uint32_t* buffer = cluster.data();
-    size_t size = cluster.size();
+// Sort size keys in place with a bitonic network, size is a power of two and whole vectors.
+// Pairs further apart than a vector are exchanged between two vectors, closer ones within a
+// vector after a lane shuffle.
+inline void __BitonicSort(uint64_t* keys, size_t size) {
+    constexpr hw::ScalableTag<uint64_t> d64;
+    constexpr int N = hw::Lanes(d64);
 
-    auto vdot = hw::Zero(dfloat);
-    // TODO: This is size + 1 to get all plus some extra. We should make sure vector is padded (and
-    // aligned would be neat too)
-    for (int i = 0; i < size + N; i += N) {
-        const auto va = hw::LoadU(d, buffer + i);
-        const auto vx = hw::ConvertTo(dfloat, __GetXVector(va));
-        const auto vy = hw::ConvertTo(dfloat, __GetYVector(va));
+    const auto vzero = hw::Zero(d64);
 
-        auto vdx = vx - vcx;
-        auto vdy = vy - vcy;
-        const auto vgx = hw::ConvertTo(dfloat, __GetGxVector(va));
-        const auto vgy = hw::ConvertTo(dfloat, __GetGyVector(va));
+    for (size_t k = 2; k <= size; k *= 2) {
+        for (size_t j = k / 2; j > 0; j /= 2) {
+            if (j >= N) {
+                for (size_t i = 0; i < size; i += N) {
+                    if (i & j) continue;
 
-        vdot = vdot + vdx * vgx + vdy * vgy;
+                    const auto va = hw::Load(d64, keys + i);
+                    const auto vb = hw::Load(d64, keys + i + j);
+                    auto vlow = hw::Min(va, vb);
+                    auto vhigh = hw::Max(va, vb);
 
-        const auto mdx_lt = vdx < hw::Zero(dfloat);
-        const auto mdy_lt = vdy < hw::Zero(dfloat);
-        const auto mdx_ge = vdx >= hw::Zero(dfloat);
-        const auto mdy_ge = vdy >= hw::Zero(dfloat);
+                    // Every lane of the vector has the same direction
+                    if (i & k) std::swap(vlow, vhigh);
 
-        const auto mquad0 = hw::And(mdy_ge, mdx_ge);
-        const auto mquad1 = hw::And(mdy_ge, mdx_lt);
-        const auto mquad2 = hw::And(mdy_lt, mdx_lt);
-        const auto mquad3 = hw::And(mdy_lt, mdx_ge);
+                    hw::Store(vlow, d64, keys + i);
+                    hw::Store(vhigh, d64, keys + i + j);
+                }
+                continue;
+            }
 
-        const auto vneg1 = hw::Set(dfloat, -1);
-        const auto vneg_dx = vdx * vneg1;
-        const auto vneg_dy = vdy * vneg1;
+            const auto vj = hw::Set(d64, j);
+            const auto vk = hw::Set(d64, k);
+            const auto indices = hw::IndicesFromVec(d64, hw::Xor(hw::Iota(d64, 0), vj));
 
-        // dy >= 0 && dx >= 0
-        auto vquad = vquad0;
-        vquad = hw::IfThenElse(RebindMask(d, mquad1), vquad1, vquad);
-        vquad = hw::IfThenElse(RebindMask(d, mquad2), vquad2, vquad);
-        vquad = hw::IfThenElse(RebindMask(d, mquad3), vquad3, vquad);
+            for (size_t i = 0; i < size; i += N) {
+                const auto va = hw::Load(d64, keys + i);
+                const auto vpartner = hw::TableLookupLanes(va, indices);
 
-        auto vslope = vdy / (vdx + vdy);
-        vslope = hw::IfThenElse(mquad1, vneg_dx / (vneg_dx + vdy), vslope);
-        vslope = hw::IfThenElse(mquad2, vneg_dy / (vneg_dx - vdy), vslope);
-        vslope = hw::IfThenElse(mquad3, vdx / (vdx - vdy), vslope);
+                // The upper key of an ascending pair takes the max, as does the lower key of a
+                // descending one
+                const auto vindex = hw::Iota(d64, i);
+                const auto mupper = hw::Ne(hw::And(vindex, vj), vzero);
+                const auto mdescending = hw::Ne(hw::And(vindex, vk), vzero);
 
-        auto vresult = hw::ConvertTo(d, vslope * vscale) + vquad;
-        hw::StoreInterleaved2(va, vresult, d, (uint32_t*)(output_ptr + i));
+                const auto vresult = hw::IfThenElse(hw::Xor(mupper, mdescending),
+                                                    hw::Max(va, vpartner), hw::Min(va, vpartner));
+                hw::Store(vresult, d64, keys + i);
+            }
+        }
     }
+}
 
-    hw::VQSortStatic(output_ptr, size, hwy::SortAscending{});
+// Sort (slope << 32 | point) keys. Most clusters are a few hundred points at most, where the
+// setup of VQSort dominates, those go through a bitonic network on the stack instead. Narrow
+// vectors need more passes of the network, so the cutoff scales with the vector width.
+inline void __SortKeys(uint64_t* keys, size_t size) {
+    constexpr hw::ScalableTag<uint64_t> d64;
+    constexpr size_t N = hw::Lanes(d64);
+    constexpr size_t kMaxNetworkKeys = HWY_MIN(256, 64 * N);
 
-    for (int i = 0; i < size + N; i += N) {
-        V32 _discard, vcpy;
-        hw::LoadInterleaved2(d, (uint32_t*)(output_ptr + i), vcpy, _discard);
-        hw::StoreU(vcpy, d, buffer + i);
+    if (size > kMaxNetworkKeys) {
+        hw::VQSortStatic(keys, size, hwy::SortAscending{});
+        return;
     }
 
-#if 0
-    for (int i = 0; i < size + N; i++) {
-        uint64_t v = output_ptr[i];
-        uint32_t rout = cluster[i];
-        GradientPoint p((uint32_t)v);
-        GradientPoint p2(rout);
-        fmt::println("{:x} --> {}, {{{},{}}} ==> Copied into: {{{},{}}}", v, v >> 32, p.GetIntX(),
-                     p.GetIntY(), p2.GetIntX(), p2.GetIntY());
+    if (size < 2) {
+        return;
     }
-#endif
 
-    return 0.0f;
-}
-
-inline void __SortBySlopeAtan2(ClusterStore& cluster, std::pair<float, float>& center) {
-    constexpr hw::ScalableTag<uint32_t> d;
-    constexpr hw::ScalableTag<float> dfloat;
-    constexpr int N = hw::Lanes(d);
+    size_t padded = N;
+    while (padded < size) {
+        padded *= 2;
+    }
 
-    std::vector<uint64_t> ret;
-    ret.reserve(cluster.size() + N * 2);
-    uint64_t* output_ptr = ret.data();
+    // Padding sorts to the end
+    HWY_ALIGN uint64_t network[kMaxNetworkKeys];
+    std::copy(keys, keys + size, network);
+    std::fill(network + size, network + padded, ~uint64_t{0});
 
-    // Copy exact from apriltag, compare to hw::atan2
-    constexpr float quadrants[2][2] = {{-1 * (2 << 15), 0}, {2 * (2 << 15), 2 << 15}};
+    __BitonicSort(network, padded);
 
-    const auto vcx = hw::Set(dfloat, center.first);
-    const auto vcy = hw::Set(dfloat, center.second);
+    std::copy(network, network + size, keys);
+}
 
+// Sort the points of cluster by slope around center, the keys are sorted in a buffer from arena
+inline float __SortBySlope(ClusterStore& cluster, std::pair<float, float>& center,
+                           ScratchArena& arena) {
     uint32_t* buffer = cluster.data();
     size_t size = cluster.size();
 
-    auto vdot = hw::Zero(dfloat);
-    for (int i = 0; i < size + 1; i += N) {
-        const auto va = hw::LoadU(d, buffer + i);
-        const auto vx = hw::ConvertTo(dfloat, __GetGxVector(va));
-        const auto vy = hw::ConvertTo(dfloat, __GetYVector(va));
+    uint64_t* output_ptr = arena.Allocate<uint64_t>(size);
+    float dot = __CalculateSlopes(buffer, size, center, output_ptr);
 
-        auto vdx = vx - vcx;
-        auto vdy = vy - vcy;
-        const auto vgx = hw::ConvertTo(dfloat, __GetGxVector(va));
-        const auto vgy = hw::ConvertTo(dfloat, __GetGyVector(va));
+    __SortKeys(output_ptr, size);
 
-        vdot = vdot + vdx * vgx + vdy * vgy;
-
-        auto vangle = hw::ConvertTo(d, hw::Atan2(dfloat, vdy, vdx) * hw::Set(dfloat, 8e6));
-        hw::StoreInterleaved2(vangle, va, d, (uint32_t*)(output_ptr + i));
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = static_cast<uint32_t>(output_ptr[i]);
     }
+
+    return dot;
+}
+
+// In place version for a span of a sorted (key << 32 | point) buffer, on return the span holds
+// (slope << 32 | point) in slope order. Needs no scratch, the key is not needed past clustering.
+inline float __SortBySlope(uint64_t* points, size_t size, std::pair<float, float>& center) {
+    float dot = __CalculateSlopes(points, size, center, points);
+    __SortKeys(points, size);
+    return dot;
+}
+
+inline std::pair<float, float> __BoundsCenter(float x_min, float x_max, float y_min, float y_max) {
+    // from apriltag, I don't quite understand the point, but carry over anyway
+    // added benefit of not having to check for divide by 0 errors in slope
+    // calculations
+    // add some noise to (cx,cy) so that pixels get a more diverse set
+    // of theta estimates. This will help us remove more points.
+    // (Only helps a small amount. The actual noise values here don't
+    // matter much at all, but we want them [-1, 1]. (XXX with
+    // fixed-point, should range be bigger?)
+    float cx = (x_min + x_max) * 0.5 + 0.6118;    // 0.05118;
+    float cy = (y_min + y_max) * 0.5 + -0.68581;  //-0.028581;
+
+    return {cx, cy};
+}
+
+// Center from the bounding box accumulated during clustering, no pass over the points
+inline std::pair<float, float> __FindCenterPoint(ClusterStats const& stats) {
+    return __BoundsCenter(stats.x_min, stats.x_max, stats.y_min, stats.y_max);
 }
 
 // std::min std::max would likely vectorize here, std::minmax_element may not for some reason
 // easy enough to just manually vectorize and not worry
-inline std::pair<float, float> __FindCenterPoint(ClusterStore& cluster) {
+template <class T>
+inline std::pair<float, float> __FindCenterPoint(const T* buffer, size_t size) {
     constexpr hw::ScalableTag<uint32_t> d;
     constexpr int N = hw::Lanes(d);
 
-    uint32_t* buffer = cluster.data();
-    size_t size = cluster.size();
-
     // Lazy (but valid) way to deal with initial condition
-    assert(size > 2 * N);
+    assert(size >= N);
 
-    const auto va = hw::LoadU(d, buffer);
+    const auto va = __LoadPoints(buffer);
     const auto vx = __GetXVector(va);
     const auto vy = __GetYVector(va);
 
@@ -273,11 +338,9 @@ inline std::pair<float, float> __FindCenterPoint(ClusterStore& cluster) {
     auto vx_max = vx;
     auto vy_min = vy;
     auto vy_max = vy;
-    int i = N;
 
-    // size is guarenteed to be > 24 so no need to handle case of overrun on first 2*N elements
-    for (; i < size; i += N) {
-        const auto va = hw::LoadU(d, buffer + i);
+    auto minmax = [&](size_t i) {
+        const auto va = __LoadPoints(buffer + i);
         const auto vx = __GetXVector(va);
         const auto vy = __GetYVector(va);
 
@@ -285,6 +348,16 @@ inline std::pair<float, float> __FindCenterPoint(ClusterStore& cluster) {
         vx_max = hw::Max(vx, vx_max);
         vy_min = hw::Min(vy, vy_min);
         vy_max = hw::Max(vy, vy_max);
+    };
+
+    size_t i = N;
+    for (; i + N <= size; i += N) {
+        minmax(i);
+    }
+
+    // Non-aligned remaining, overlapping the previous vector doesn't change min/max
+    if (i != size) {
+        minmax(size - N);
     }
 
     uint32_t x_min = hw::ReduceMin(d, vx_min);
@@ -292,29 +365,137 @@ inline std::pair<float, float> __FindCenterPoint(ClusterStore& cluster) {
     uint32_t y_min = hw::ReduceMin(d, vy_min);
     uint32_t y_max = hw::ReduceMax(d, vy_max);
 
-    // Non-aligned remaining
-    if (i != size) {
-        uint32_t* buffer_end = buffer + i - N;
-        for (int j = 0; j < N - (i - size); j++) {
-            x_min = std::min(buffer_end[i], x_min);
-            x_max = std::max(buffer_end[i], x_max);
-            y_min = std::min(buffer_end[i], y_min);
-            y_max = std::max(buffer_end[i], y_max);
+    return __BoundsCenter(x_min, x_max, y_min, y_max);
+}
+
+inline std::pair<float, float> __FindCenterPoint(ClusterStore& cluster) {
+    return __FindCenterPoint(cluster.data(), cluster.size());
+}
+
+// SoA counterparts of the above, every load is aligned and nothing needs unpacking. The padding of
+// the planes is a copy of a real point with zero gradient, so no masking is needed either.
+inline std::pair<float, float> __FindCenterPoint(ClusterView const& cluster) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr int N = hw::Lanes(dfloat);
+
+    auto vx_min = hw::Load(dfloat, cluster.x);
+    auto vx_max = vx_min;
+    auto vy_min = hw::Load(dfloat, cluster.y);
+    auto vy_max = vy_min;
+
+    for (size_t i = N; i < cluster.size; i += N) {
+        const auto vx = hw::Load(dfloat, cluster.x + i);
+        const auto vy = hw::Load(dfloat, cluster.y + i);
+
+        vx_min = hw::Min(vx, vx_min);
+        vx_max = hw::Max(vx, vx_max);
+        vy_min = hw::Min(vy, vy_min);
+        vy_max = hw::Max(vy, vy_max);
+    }
+
+    float x_min = hw::ReduceMin(dfloat, vx_min);
+    float x_max = hw::ReduceMax(dfloat, vx_max);
+    float y_min = hw::ReduceMin(dfloat, vy_min);
+    float y_max = hw::ReduceMax(dfloat, vy_max);
+
+    return __BoundsCenter(x_min, x_max, y_min, y_max);
+}
+
+// Sorts all planes of the cluster by slope. keys and scratch must hold the padded cluster size,
+// scratch vector aligned. Returns the same dot product sum as the packed version.
+inline float __SortBySlope(ClusterView& cluster, std::pair<float, float>& center, uint64_t* keys,
+                           float* scratch) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr hw::ScalableTag<int32_t> di;
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr int N = hw::Lanes(d);
+
+    const size_t padded = hwy::RoundUpTo(cluster.size, N);
+    const auto vcx = hw::Set(dfloat, center.first);
+    const auto vcy = hw::Set(dfloat, center.second);
+
+    auto vdot = hw::Zero(dfloat);
+
+    // (slope << 32 | index)
+    for (size_t i = 0; i < padded; i += N) {
+        const auto vdx = hw::Load(dfloat, cluster.x + i) - vcx;
+        const auto vdy = hw::Load(dfloat, cluster.y + i) - vcy;
+
+        vdot = hw::MulAdd(vdx, hw::Load(dfloat, cluster.gx + i), vdot);
+        vdot = hw::MulAdd(vdy, hw::Load(dfloat, cluster.gy + i), vdot);
+
+        const auto vslope = __PseudoAngle(vdx, vdy);
+        hw::StoreInterleaved2(hw::Iota(d, i), vslope, d, reinterpret_cast<uint32_t*>(keys + i));
+    }
+
+    // Padding keys stay in place and keep pointing at the padding
+    __SortKeys(keys, cluster.size);
+
+    for (float* plane : {cluster.x, cluster.y, cluster.gx, cluster.gy}) {
+        for (size_t i = 0; i < padded; i += N) {
+            V32 vindex, _discard;
+            hw::LoadInterleaved2(d, reinterpret_cast<const uint32_t*>(keys + i), vindex, _discard);
+            hw::Store(hw::GatherIndex(dfloat, plane, hw::BitCast(di, vindex)), dfloat, scratch + i);
         }
+        std::copy(scratch, scratch + padded, plane);
     }
 
-    // from apriltag, I don't quite understand the point, but carry over anyway
-    // added benefit of not having to check for divide by 0 errors in slope
-    // calculations
-    // add some noise to (cx,cy) so that pixels get a more diverse set
-    // of theta estimates. This will help us remove more points.
-    // (Only helps a small amount. The actual noise values here don't
-    // matter much at all, but we want them [-1, 1]. (XXX with
-    // fixed-point, should range be bigger?)
-    float cx = (x_min + x_max) * 0.5 + 0.6118;    // 0.05118;
-    float cy = (y_min + y_max) * 0.5 + -0.68581;  //-0.028581;
+    return hw::ReduceSum(dfloat, vdot);
+}
 
-    return {cx, cy};
+// Per cluster inputs of __FilterClusters, one lane per cluster. Planes are vector aligned and
+// padded to whole vectors, bounds are in the doubled coordinates of GradientPoint.
+struct ClusterFilterInput {
+    float* count;
+    float* width;
+    float* height;
+    float* dot;
+    size_t size;
+};
+
+// Write the indices of the clusters that pass params to selected and return how many did.
+// selected must hold input.size rounded up to whole vectors.
+inline size_t __FilterClusters(ClusterFilterInput const& input, FitQuadsParams const& params,
+                               float max_points, uint32_t* selected) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr hw::RebindToUnsigned<decltype(dfloat)> d;
+    constexpr int N = hw::Lanes(dfloat);
+
+    // The kernels load whole vectors of points, so smaller clusters are never fit
+    const auto vmin_points =
+            hw::Set(dfloat, static_cast<float>(std::max<size_t>(params.min_cluster_points, N)));
+    const auto vmax_points = hw::Set(dfloat, max_points);
+    // Doubled coordinates, so the area is 4 times larger
+    const auto vmin_area =
+            hw::Set(dfloat, 4.0f * 0.95f * params.min_tag_width * params.min_tag_width);
+    const auto vmax_aspect = hw::Set(dfloat, params.max_aspect_ratio);
+    const auto vzero = hw::Zero(dfloat);
+
+    size_t selected_size = 0;
+
+    for (size_t i = 0; i < input.size; i += N) {
+        const auto vcount = hw::Load(dfloat, input.count + i);
+        const auto vwidth = hw::Load(dfloat, input.width + i);
+        const auto vheight = hw::Load(dfloat, input.height + i);
+        const auto vdot = hw::Load(dfloat, input.dot + i);
+
+        auto mkeep = hw::FirstN(dfloat, input.size - i);
+        mkeep = hw::And(mkeep, hw::Ge(vcount, vmin_points));
+        mkeep = hw::And(mkeep, hw::Le(vcount, vmax_points));
+        mkeep = hw::And(mkeep, hw::Ge(vwidth * vheight, vmin_area));
+
+        const auto vlong = hw::Max(vwidth, vheight);
+        const auto vshort = hw::Min(vwidth, vheight);
+        mkeep = hw::And(mkeep, hw::Le(vlong, vshort * vmax_aspect));
+
+        if (!params.reversed_border) mkeep = hw::AndNot(hw::Lt(vdot, vzero), mkeep);
+        if (!params.normal_border) mkeep = hw::AndNot(hw::Gt(vdot, vzero), mkeep);
+
+        selected_size += hw::CompressStore(hw::Iota(d, i), hw::RebindMask(d, mkeep), d,
+                                           selected + selected_size);
+    }
+
+    return selected_size;
 }
 
 }  // namespace HWY_NAMESPACE
@@ -322,25 +503,330 @@ HWY_AFTER_NAMESPACE();
 
 class FitQuads {
    public:
-    static void Perform(GradientClusterHash& hash, cv::Size size) {
-        for (auto vit = hash.cbegin(); vit != hash.cend(); vit++) {
-            ClusterStore cluster = vit->second;
-
-            // Remove clusters that are too small, or larger than the outline of the view. A typical
-            // point along an edge is added two times (because it has 2 unique neighbors). The
-            // maximum perimeter is 2w+2h.
-            if (cluster.size() < 24 || cluster.size() > 2 * (size.width * 2 + size.height * 2)) {
+    // Clusters are filtered on the statistics gathered during clustering, only the survivors
+    // are sorted. All routes replace the contents of quads with the quads that were found. With
+    // the grayscale frame the line fits are weighted by its gradient as in apriltag, which gives
+    // more accurate corners at the cost of a few gathers per point. Buffers are kept per thread
+    // between calls, after the first frames nothing is allocated.
+    static void Perform(GradientClusterHash& hash, cv::Size size, std::vector<Quad>& quads,
+                        FitQuadsParams const& params = {}, const cv::Mat1b* gray = nullptr) {
+        Scratch& scratch = LocalScratch();
+        scratch.Begin(gray);
+
+        SelectClusters(hash, size, params, scratch);
+        if (params.batched_sort && !params.ordered_clusters) {
+            SortBatched(scratch);
+            for (size_t i = 0; i < scratch.clusters.size(); i++) {
+                FitSorted(scratch.clusters[i]->points, scratch.dots[i], params, scratch);
+            }
+        } else {
+            for (GradientCluster* cluster : scratch.clusters) {
+                FitQuad(*cluster, params, scratch);
+            }
+        }
+
+        quads.clear();
+        Assemble(params, scratch, quads);
+    }
+
+    // Parallel version. Cluster sizes vary by 100x, so the survivors are fit largest first on
+    // the work stealing queues of pool. Every thread has its own buffers and candidates, which
+    // it assembles into its own quads before they are merged, so the order of quads differs
+    // from the serial version.
+    static void Perform(GradientClusterHash& hash, cv::Size size, std::vector<Quad>& quads,
+                        ThreadPool& pool, FitQuadsParams const& params = {},
+                        const cv::Mat1b* gray = nullptr) {
+        std::vector<Scratch>& scratches = PoolScratch(pool.NumThreads());
+        for (Scratch& scratch : scratches) {
+            scratch.Begin(gray);
+        }
+
+        Scratch& first = scratches[0];
+        SelectClusters(hash, size, params, first);
+        std::vector<GradientCluster*>& clusters = first.clusters;
+        std::sort(clusters.begin(), clusters.end(), [](GradientCluster* a, GradientCluster* b) {
+            return a->points.size() > b->points.size();
+        });
+
+        pool.RunStealing(clusters.size(), [&](size_t task, size_t thread) {
+            FitQuad(*clusters[task], params, scratches[thread]);
+        });
+
+        pool.Run(pool.NumThreads(), [&](size_t task, size_t) {
+            Assemble(params, scratches[task], scratches[task].quads);
+        });
+
+        quads.clear();
+        for (size_t thread = 0; thread < pool.NumThreads(); thread++) {
+            quads.insert(quads.end(), scratches[thread].quads.begin(),
+                         scratches[thread].quads.end());
+        }
+    }
+
+    // Hashmap free route, points is a sorted (key << 32 | point) buffer such as
+    // GradientClusterArray or HalideGradientClusters, with one span per cluster. Works in place,
+    // on return each span is in slope order with the slope in the upper 32 bits. There are no
+    // clustering statistics here, so the border direction is checked after the sort.
+    static void Perform(uint64_t* points, std::vector<ClusterSpan> const& spans, cv::Size size,
+                        std::vector<Quad>& quads, FitQuadsParams const& params = {},
+                        const cv::Mat1b* gray = nullptr) {
+        Scratch& scratch = LocalScratch();
+        scratch.Begin(gray);
+
+        for (auto const& span : spans) {
+            if (!IsCandidate(span.length, size, params)) {
+                continue;
+            }
+
+            FitQuad(points + span.offset, span.length, params, scratch);
+        }
+
+        quads.clear();
+        Assemble(params, scratch, quads);
+    }
+
+    // Structure of arrays route, see ClusterSoA. On return each cluster is in slope order.
+    static void Perform(ClusterSoA& soa, cv::Size size, std::vector<Quad>& quads,
+                        FitQuadsParams const& params = {}, const cv::Mat1b* gray = nullptr) {
+        constexpr hw::ScalableTag<float> dfloat;
+
+        Scratch& scratch = LocalScratch();
+        scratch.Begin(gray);
+
+        for (size_t i = 0; i < soa.Count(); i++) {
+            ClusterView cluster = soa.Cluster(i);
+            if (!IsCandidate(cluster.size, size, params)) {
+                continue;
+            }
+
+            const size_t padded = hwy::RoundUpTo(cluster.size, hw::Lanes(dfloat));
+            scratch.arena.Reset();
+            uint64_t* keys = scratch.arena.Allocate<uint64_t>(padded);
+            float* sort_scratch = scratch.arena.Allocate<float>(padded);
+
+            auto center = HWY_NAMESPACE::__FindCenterPoint(cluster);
+            float dot = HWY_NAMESPACE::__SortBySlope(cluster, center, keys, sort_scratch);
+            if (!IsBorderAccepted(dot, params)) {
                 continue;
             }
 
-            FitQuad(cluster);
+            LineFitMoments moments = scratch.line_fit.Get(cluster.size);
+            HWY_NAMESPACE::__ComputeLineFitMoments(cluster, moments, scratch.Weights());
+            AddCandidate(moments, dot < 0, params, scratch);
         }
+
+        quads.clear();
+        Assemble(params, scratch, quads);
     }
 
    private:
-    static void FitQuad(ClusterStore& cluster) {
-        auto center = HWY_NAMESPACE::__FindCenterPoint(cluster);
-        HWY_NAMESPACE::__SortBySlope(cluster, center);
+    // Buffers of one thread, kept across calls so they only grow
+    struct Scratch {
+        // Forget the results of the previous call
+        void Begin(const cv::Mat1b* gray) {
+            weighted = gray != nullptr;
+            if (gray) {
+                image = {gray->data, gray->step, gray->cols, gray->rows};
+            }
+
+            candidates.Clear();
+            clusters.clear();
+            quads.clear();
+        }
+
+        const GrayImage* Weights() const {
+            return weighted ? &image : nullptr;
+        }
+
+        bool weighted = false;
+        GrayImage image = {};
+
+        // Sort keys and the cluster filter planes, reset for every cluster
+        ScratchArena arena;
+        LineFitScratch line_fit;
+        QuadCorners corners;
+        QuadCandidates candidates;
+        std::vector<GradientCluster*> clusters;
+
+        // Dot product sums of the clusters with the batched sort
+        std::vector<float> dots;
+
+        // Output of one thread in the parallel version
+        std::vector<Quad> quads;
+    };
+
+    static Scratch& LocalScratch() {
+        thread_local Scratch scratch;
+        return scratch;
+    }
+
+    // One per pool thread, owned by the calling thread so pools of different callers don't
+    // share buffers
+    static std::vector<Scratch>& PoolScratch(size_t threads) {
+        thread_local std::vector<Scratch> scratches;
+        if (scratches.size() < threads) {
+            scratches.resize(threads);
+        }
+        return scratches;
+    }
+
+    // Run the vectorized early rejection on the statistics of every cluster, the survivors are
+    // left in scratch.clusters
+    static void SelectClusters(GradientClusterHash& hash, cv::Size size,
+                               FitQuadsParams const& params, Scratch& scratch) {
+        constexpr hw::ScalableTag<float> dfloat;
+
+        const size_t padded = hwy::RoundUpTo(hash.size(), hw::Lanes(dfloat));
+        scratch.arena.Reset();
+        float* count = scratch.arena.Allocate<float>(padded);
+        float* width = scratch.arena.Allocate<float>(padded);
+        float* height = scratch.arena.Allocate<float>(padded);
+        float* dot = scratch.arena.Allocate<float>(padded);
+        uint32_t* selected = scratch.arena.Allocate<uint32_t>(padded);
+
+        std::vector<GradientCluster*>& clusters = scratch.clusters;
+        clusters.clear();
+
+        for (auto vit = hash.begin(); vit != hash.end(); vit++) {
+            GradientCluster& cluster = vit->second;
+            const ClusterStats& stats = cluster.stats;
+            const size_t i = clusters.size();
+
+            auto center = HWY_NAMESPACE::__FindCenterPoint(stats);
+            count[i] = static_cast<float>(cluster.points.size());
+            width[i] = static_cast<float>(stats.x_max - stats.x_min);
+            height[i] = static_cast<float>(stats.y_max - stats.y_min);
+            dot[i] = stats.Dot(center.first, center.second);
+
+            clusters.push_back(&cluster);
+        }
+
+        HWY_NAMESPACE::ClusterFilterInput input{count, width, height, dot, clusters.size()};
+        const size_t selected_size =
+                HWY_NAMESPACE::__FilterClusters(input, params, MaxPoints(size), selected);
+
+        // In place, selected is in increasing order
+        for (size_t i = 0; i < selected_size; i++) {
+            clusters[i] = clusters[selected[i]];
+        }
+        clusters.resize(selected_size);
+    }
+
+    // Clusters larger than the outline of the view are rejected. A typical point along an edge
+    // is added two times (because it has 2 unique neighbors). The maximum perimeter is 2w+2h.
+    static float MaxPoints(cv::Size size) {
+        return 2.0f * (size.width * 2 + size.height * 2);
+    }
+
+    // At least a vector of points, __FindCenterPoint and __ForEachSlope load whole vectors
+    static bool IsCandidate(size_t points, cv::Size size, FitQuadsParams const& params) {
+        constexpr size_t N = hw::Lanes(hw::ScalableTag<uint32_t>());
+        return points >= std::max<size_t>(params.min_cluster_points, N) &&
+               points <= MaxPoints(size);
+    }
+
+    // As in apriltag, a negative dot product means a reversed border
+    static bool IsBorderAccepted(float dot, FitQuadsParams const& params) {
+        return (params.reversed_border || dot >= 0) && (params.normal_border || dot <= 0);
+    }
+
+    // Find the corners of a sorted cluster and queue the four lines between them for Assemble
+    static void AddCandidate(LineFitMoments const& moments, bool reversed_border,
+                             FitQuadsParams const& params, Scratch& scratch) {
+        std::array<uint32_t, 4> indices;
+        if (!scratch.corners.Find(moments, params.max_nmaxima, params.max_line_fit_mse,
+                                  params.cos_critical_rad, indices)) {
+            return;
+        }
+
+        std::array<LineFit, 4> lines;
+        for (int i = 0; i < 4; i++) {
+            lines[i] = FitLine(moments, indices[i], indices[(i + 1) & 3]);
+            if (lines[i].mse > params.max_line_fit_mse) {
+                return;
+            }
+        }
+
+        scratch.candidates.Add(lines, reversed_border);
+    }
+
+    // Geometric checks of all candidates at once, the survivors are appended to quads
+    static void Assemble(FitQuadsParams const& params, Scratch& scratch,
+                         std::vector<Quad>& quads) {
+        HWY_NAMESPACE::__AssembleQuads(scratch.candidates, params.min_tag_width,
+                                       params.cos_critical_rad, quads);
+    }
+
+    static void FitQuad(GradientCluster& cluster, FitQuadsParams const& params,
+                        Scratch& scratch) {
+        auto center = HWY_NAMESPACE::__FindCenterPoint(cluster.stats);
+        if (params.ordered_clusters) {
+            FitSorted(cluster.points, cluster.stats.Dot(center.first, center.second), params,
+                      scratch);
+            return;
+        }
+
+        scratch.arena.Reset();
+        float dot = HWY_NAMESPACE::__SortBySlope(cluster.points, center, scratch.arena);
+        FitSorted(cluster.points, dot, params, scratch);
+    }
+
+    // Points already in slope order
+    static void FitSorted(ClusterStore const& points, float dot, FitQuadsParams const& params,
+                          Scratch& scratch) {
+        LineFitMoments moments = scratch.line_fit.Get(points.size());
+        HWY_NAMESPACE::__ComputeLineFitMoments(points.data(), points.size(), moments,
+                                               scratch.Weights());
+        AddCandidate(moments, dot < 0, params, scratch);
+    }
+
+    // Sort every selected cluster by slope with one VQSort over the whole frame. The keys are
+    // ordered by cluster first, so each cluster comes out as one contiguous run that is copied
+    // back to its points. Amortizes the per call overhead of sorting hundreds of small clusters.
+    static void SortBatched(Scratch& scratch) {
+        std::vector<GradientCluster*> const& clusters = scratch.clusters;
+
+        size_t total = 0;
+        for (GradientCluster* cluster : clusters) {
+            total += cluster->points.size();
+        }
+
+        scratch.arena.Reset();
+        hwy::uint128_t* keys = scratch.arena.Allocate<hwy::uint128_t>(total);
+        scratch.dots.resize(clusters.size());
+
+        size_t offset = 0;
+        for (size_t i = 0; i < clusters.size(); i++) {
+            ClusterStore const& points = clusters[i]->points;
+            auto center = HWY_NAMESPACE::__FindCenterPoint(clusters[i]->stats);
+            scratch.dots[i] = HWY_NAMESPACE::__CalculateBatchedSlopes(
+                    points.data(), points.size(), center, static_cast<uint32_t>(i), keys + offset);
+            offset += points.size();
+        }
+
+        hw::VQSortStatic(keys, total, hwy::SortAscending{});
+
+        offset = 0;
+        for (GradientCluster* cluster : clusters) {
+            ClusterStore& points = cluster->points;
+            for (size_t i = 0; i < points.size(); i++) {
+                points[i] = static_cast<uint32_t>(keys[offset + i].lo);
+            }
+            offset += points.size();
+        }
+    }
+
+    static void FitQuad(uint64_t* points, size_t size, FitQuadsParams const& params,
+                        Scratch& scratch) {
+        auto center = HWY_NAMESPACE::__FindCenterPoint(points, size);
+        float dot = HWY_NAMESPACE::__SortBySlope(points, size, center);
+        if (!IsBorderAccepted(dot, params)) {
+            return;
+        }
+
+        LineFitMoments moments = scratch.line_fit.Get(size);
+        HWY_NAMESPACE::__ComputeLineFitMoments(points, size, moments, scratch.Weights());
+        AddCandidate(moments, dot < 0, params, scratch);
     }
 };
 
@@ -3,9 +3,23 @@
 #define EMH_EXT
 
 #include <fmt/format.h>
+
+// clang-format off
+
 #include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+#define VQSORT_ONLY_STATIC 1
+#include <hwy/contrib/sort/vqsort-inl.h>
+#include <hwy/contrib/sort/order.h>
+
+// clang-format on
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
 #include <new>
 #include <opencv2/core.hpp>
 #include <string>
@@ -13,6 +27,8 @@
 
 #include "gradient_point.h"
 #include "simdtag/highway_utils.h"
+#include "simdtag/packed_binary_image.h"
+#include "simdtag/thread_pool.h"
 #include "third_party/emhash/hash_table5.hpp"
 
 namespace hw = hwy::HWY_NAMESPACE;
@@ -20,7 +36,268 @@ namespace hw = hwy::HWY_NAMESPACE;
 namespace simdtag {
 
 using ClusterStore = std::vector<uint32_t>;
-using GradientClusterHash = emhash5::HashMap<uint32_t, ClusterStore>;
+
+// Bounding box and raw first and second moments of a cluster, in the doubled coordinates of
+// GradientPoint. Accumulated as points are inserted while they are still in registers, so
+// FitQuads doesn't need extra passes over the points. Integer sums are exact. The gradient sums
+// give the border direction dot product for any center without touching the points again.
+struct ClusterStats {
+    uint32_t x_min = UINT32_MAX;
+    uint32_t x_max = 0;
+    uint32_t y_min = UINT32_MAX;
+    uint32_t y_max = 0;
+    int64_t mx = 0;
+    int64_t my = 0;
+    int64_t mxx = 0;
+    int64_t mxy = 0;
+    int64_t myy = 0;
+    int64_t gx = 0;
+    int64_t gy = 0;
+    int64_t xgx = 0;
+    int64_t ygy = 0;
+
+    void Add(uint32_t point) {
+        const uint32_t x = point >> GradientPoint::kXShift;
+        const uint32_t y = (point >> GradientPoint::kYShift) & GradientPoint::kCoordMask;
+
+        // Gradient as in apriltag, direction signed by black to white
+        const int sign = (point & 1) ? 1 : -1;
+        const int dx = static_cast<int>((point >> GradientPoint::kDxShift) & 0x3) - 1;
+        const int dy = static_cast<int>((point >> GradientPoint::kDyShift) & 0x3) - 1;
+
+        x_min = std::min(x_min, x);
+        x_max = std::max(x_max, x);
+        y_min = std::min(y_min, y);
+        y_max = std::max(y_max, y);
+
+        mx += x;
+        my += y;
+        mxx += static_cast<int64_t>(x) * x;
+        mxy += static_cast<int64_t>(x) * y;
+        myy += static_cast<int64_t>(y) * y;
+
+        gx += sign * dx;
+        gy += sign * dy;
+        xgx += static_cast<int64_t>(x) * sign * dx;
+        ygy += static_cast<int64_t>(y) * sign * dy;
+    }
+
+    // Sum over the points of (p - center) . gradient. The moments grow with the cluster and
+    // mostly cancel, so they are combined in double and only the result is rounded.
+    float Dot(float cx, float cy) const {
+        return static_cast<float>(static_cast<double>(xgx) - static_cast<double>(cx) * gx +
+                                  static_cast<double>(ygy) - static_cast<double>(cy) * gy);
+    }
+};
+
+struct GradientCluster {
+    ClusterStore points;
+    ClusterStats stats;
+
+    void Add(uint32_t point) {
+        points.push_back(point);
+        stats.Add(point);
+    }
+};
+
+using GradientClusterHash = emhash5::HashMap<uint32_t, GradientCluster>;
+
+// Contiguous run of points sharing the same hash within a sorted gradient point buffer
+struct ClusterSpan {
+    uint32_t offset;
+    uint32_t length;
+};
+
+inline void __InsertGradientPoint(GradientClusterHash& hashmap, uint32_t hash, uint32_t value) {
+    GradientCluster* bucket = hashmap.try_get(hash);
+    if (bucket == nullptr) {
+        GradientCluster tmp;
+        tmp.Add(value);
+        hashmap.insert_unique(hash, std::move(tmp));
+    } else {
+        bucket->Add(value);
+    }
+}
+
+// Alternative to GradientClusterHash. Every gradient point is appended to one flat buffer as
+// (hash << 32 | GradientPoint), the buffer is then sorted so that each cluster ends up as a
+// contiguous span. Trades the per-point hash lookup for a single vectorized sort.
+class GradientClusterArray {
+   public:
+    GradientClusterArray(size_t capacity = 1 << 16) {
+        Reserve(capacity);
+    }
+
+    void Clear() {
+        size_ = 0;
+        spans_.clear();
+    }
+
+    // Grow the buffer (keeping its contents) so that at least count points fit
+    void Reserve(size_t count) {
+        if (count <= capacity_) return;
+
+        size_t capacity = std::max(count, capacity_ * 2);
+        auto points = hwy::AllocateAligned<uint64_t>(capacity);
+        if (size_) std::copy(points_.get(), points_.get() + size_, points.get());
+
+        points_ = std::move(points);
+        capacity_ = capacity;
+    }
+
+    // Make room for count more points past the end of the buffer
+    void EnsureFree(size_t count) {
+        if (size_ + count > capacity_) [[unlikely]] {
+            Reserve(size_ + count);
+        }
+    }
+
+    uint64_t* Data() {
+        return points_.get();
+    }
+
+    uint64_t* End() {
+        return points_.get() + size_;
+    }
+
+    void Advance(size_t count) {
+        size_ += count;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Only valid after the buffer has been sorted
+    void BuildSpans();
+
+    std::vector<ClusterSpan>& Spans() {
+        return spans_;
+    }
+
+   private:
+    hwy::AlignedFreeUniquePtr<uint64_t[]> points_;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    std::vector<ClusterSpan> spans_;
+};
+
+// Alternative to GradientClusterHash that does no hashing at all. After DisjointSet::Flatten
+// labels are dense in [1, n_labels), so the (min, max) label pair of a point can be found exactly
+// in a small per-label adjacency list. Once all points are in, they are scattered into a CSR
+// layout with one span per label pair. Unlike the hash, unrelated edges never share a cluster.
+class LabelClusterStore {
+   public:
+    LabelClusterStore(size_t capacity = 1 << 16) {
+        pending_.reserve(capacity);
+    }
+
+    // Must be called before each frame, label_count as returned by BMRS::LabelCount()
+    void Reset(size_t label_count) {
+        heads_.assign(label_count + 1, kNoEdge);
+        edges_.clear();
+        pending_.clear();
+        spans_.clear();
+        last_pair_ = kNoPair;
+    }
+
+    // Exact cluster id of a label pair, a new cluster is created the first time a pair is seen
+    uint32_t ClusterId(uint32_t label_min, uint32_t label_max) {
+        uint64_t pair = static_cast<uint64_t>(label_min) << 32 | label_max;
+
+        // Neighboring edge pixels almost always belong to the same pair
+        if (pair == last_pair_) return last_id_;
+
+        assert(label_min < heads_.size());
+        uint32_t id = heads_[label_min];
+        while (id != kNoEdge && edges_[id].label_max != label_max) {
+            id = edges_[id].next;
+        }
+
+        if (id == kNoEdge) {
+            id = edges_.size();
+            edges_.push_back({label_min, label_max, heads_[label_min], 0});
+            heads_[label_min] = id;
+        }
+
+        last_pair_ = pair;
+        last_id_ = id;
+        return id;
+    }
+
+    void Append(uint32_t id, uint32_t value) {
+        edges_[id].count++;
+        pending_.push_back(static_cast<uint64_t>(id) << 32 | value);
+    }
+
+    // Counting sort of the pending points by cluster id into (id << 32 | GradientPoint), the same
+    // layout as GradientClusterArray so both can be consumed as spans
+    void Finalize() {
+        size_t size = pending_.size();
+        if (size > capacity_) {
+            points_ = hwy::AllocateAligned<uint64_t>(size);
+            capacity_ = size;
+        }
+
+        spans_.resize(edges_.size());
+        uint32_t offset = 0;
+        for (size_t i = 0; i < edges_.size(); i++) {
+            spans_[i] = {offset, edges_[i].count};
+            offset += edges_[i].count;
+        }
+
+        cursor_.resize(spans_.size());
+        for (size_t i = 0; i < spans_.size(); i++) {
+            cursor_[i] = spans_[i].offset;
+        }
+
+        uint64_t* points = points_.get();
+        for (uint64_t value : pending_) {
+            points[cursor_[value >> 32]++] = value;
+        }
+    }
+
+    uint64_t* Data() {
+        return points_.get();
+    }
+
+    size_t Size() const {
+        return pending_.size();
+    }
+
+    std::vector<ClusterSpan>& Spans() {
+        return spans_;
+    }
+
+    // Returns {min label, max label} of a cluster
+    std::pair<uint32_t, uint32_t> Labels(uint32_t id) const {
+        return {edges_[id].label_min, edges_[id].label_max};
+    }
+
+   private:
+    static constexpr uint32_t kNoEdge = 0xFFFFFFFFu;
+    static constexpr uint64_t kNoPair = 0xFFFFFFFFFFFFFFFFull;
+
+    // One node of the adjacency list of label_min, the node index doubles as the cluster id
+    struct Edge {
+        uint32_t label_min;
+        uint32_t label_max;
+        uint32_t next;
+        uint32_t count;
+    };
+
+    std::vector<uint32_t> heads_;
+    std::vector<Edge> edges_;
+    std::vector<uint64_t> pending_;
+    std::vector<uint32_t> cursor_;
+    std::vector<ClusterSpan> spans_;
+
+    hwy::AlignedFreeUniquePtr<uint64_t[]> points_;
+    size_t capacity_ = 0;
+
+    uint64_t last_pair_ = kNoPair;
+    uint32_t last_id_ = 0;
+};
 
 HWY_BEFORE_NAMESPACE();
 namespace HWY_NAMESPACE {
@@ -35,30 +312,34 @@ inline V64 __SimpleHash(const V64& v64) {
     return hw::ShiftRight<32>(v64 * vscale);
 }
 
-// Calculate hash for 32-bit label neighbors, reads N labels from each buffer where N
-// is the number of SIMD lanes. Returns a vector with the hashes.
-inline V32 __CalculateHashes(const uint32_t* labels_A, const uint32_t* labels_B) {
+// Hash a pair of labels, vmin must hold the smaller label of each pair. Returns a vector with
+// the hashes.
+inline V32 __HashLabelPair(const V32& vmin, const V32& vmax) {
     constexpr hw::ScalableTag<uint32_t> d32;
     constexpr hw::ScalableTag<uint64_t> d64;
 
-    // Do initial calculation as 32-bit
-    const auto vrep0 = hw::LoadU(d32, labels_A);
-    const auto vrep1 = hw::LoadU(d32, labels_B);
-
-    const auto vrepmin = hw::Min(vrep0, vrep1);
-    const auto vrepmax = hw::Max(vrep0, vrep1);
-
     // Convert to 64-bit, hash, then back to 32-bit
-    const auto vrepmin_64_u = hw::PromoteUpperTo(d64, vrepmin);
-    const auto vrepmin_64_l = hw::PromoteLowerTo(d64, vrepmin);
-    const auto vrepmax_64_u = hw::PromoteUpperTo(d64, vrepmax);
-    const auto vrepmax_64_l = hw::PromoteLowerTo(d64, vrepmax);
+    const auto vrepmin_64_u = hw::PromoteUpperTo(d64, vmin);
+    const auto vrepmin_64_l = hw::PromoteLowerTo(d64, vmin);
+    const auto vrepmax_64_u = hw::PromoteUpperTo(d64, vmax);
+    const auto vrepmax_64_l = hw::PromoteLowerTo(d64, vmax);
     const auto vrep_u = __SimpleHash(hw::ShiftLeft<32>(vrepmin_64_u) | vrepmax_64_u);
     const auto vrep_l = __SimpleHash(hw::ShiftLeft<32>(vrepmin_64_l) | vrepmax_64_l);
 
     return hw::OrderedTruncate2To(d32, vrep_l, vrep_u);
 }
 
+// Calculate hash for 32-bit label neighbors, reads N labels from each buffer where N
+// is the number of SIMD lanes. Returns a vector with the hashes.
+inline V32 __CalculateHashes(const uint32_t* labels_A, const uint32_t* labels_B) {
+    constexpr hw::ScalableTag<uint32_t> d32;
+
+    const auto vrep0 = hw::LoadU(d32, labels_A);
+    const auto vrep1 = hw::LoadU(d32, labels_B);
+
+    return __HashLabelPair(hw::Min(vrep0, vrep1), hw::Max(vrep0, vrep1));
+}
+
 // Generate a sequence from START to START + #Lanes
 // Type is derived from the D typed passed in
 template <int START = 0, class D>
@@ -69,8 +350,29 @@ constexpr auto GenerateSequence(D d) {
     return result;
 }
 
+// Pack gradient points from x and y already doubled, v0/v1 are the pixels on either side
 // Restricted to 32bit lane size output
-// TODO: Refactor SIMD 32-bit gradient point creation by moving it to gradient_point.h
+template <int DX, int DY>
+    requires(DX == 1 && DY == 0) || (DY == 1 && (DX >= -1 || DX <= 1))
+inline V32 __PackGradientValue(const V32& vx2, const V32& vy2, const V32& v0, const V32& v1) {
+    constexpr hw::ScalableTag<uint32_t> d;
+
+    // Bits, see GradientPoint for the layout
+    constexpr uint32_t dxy_mask = static_cast<uint32_t>((DX + 1) << GradientPoint::kDxShift |
+                                                        (DY + 1) << GradientPoint::kDyShift);
+
+    // 2 * x + dx, 13 bits total, so largest image is 4096 x 4096
+    const auto vcoord_mask = hw::Set(d, GradientPoint::kCoordMask);
+    const auto vpx = (vx2 + hw::Set(d, DX)) & vcoord_mask;
+    const auto vpy = (vy2 + hw::Set(d, DY)) & vcoord_mask;
+
+    const auto vblack_to_white = hw::IfThenElseZero(v1 > v0, hw::Set(d, 1));
+    const auto vpx_mask = hw::ShiftLeft<GradientPoint::kXShift>(vpx);
+    const auto vpy_mask = hw::ShiftLeft<GradientPoint::kYShift>(vpy);
+
+    return vpx_mask | vpy_mask | hw::Set(d, dxy_mask) | vblack_to_white;
+}
+
 template <int DX, int DY>
     requires(DX == 1 && DY == 0) || (DY == 1 && (DX >= -1 || DX <= 1))
 inline V32 __CalculateValue(const uint8_t* img_A, const uint8_t* img_B, int x, int y) {
@@ -80,26 +382,15 @@ inline V32 __CalculateValue(const uint8_t* img_A, const uint8_t* img_B, int x, i
 
     constexpr auto kSequenceBuffer = GenerateSequence(d);
 
-    // Bits
-    constexpr uint32_t dxy_mask = static_cast<uint32_t>(((DX + 1) << 2) + (DY + 1)) << 4;
-
+    // x is x + (i) for simd width, y is y + 0 or 1
     const auto vSequenceX = hw::LoadU(d, kSequenceBuffer.data());
-
-    // 2 * x + dx & 0x0FFF x is x + (i) for simd width
-    // 12 bits total, 2x that, so largert image is 2047 x 2047
-    const auto vpx = (hw::ShiftLeft<1>(Set(d, x) + vSequenceX) + Set(d, DX)) & Set(d, 0x0FFF);
-
-    // 2 * y + dy & 0x0FFF y is y + 0 or 1
-    const auto vpy = (hw::ShiftLeft<1>(Set(d, y)) + Set(d, DY)) & Set(d, 0x0FFF);
+    const auto vx2 = hw::ShiftLeft<1>(Set(d, x) + vSequenceX);
+    const auto vy2 = hw::ShiftLeft<1>(Set(d, y));
 
     const auto v0 = hw::PromoteTo(d, LoadU(d8, img_A));
     const auto v1 = hw::PromoteTo(d, LoadU(d8, img_B));
 
-    const auto vblack_to_white = hw::IfThenElseZero(v1 > v0, hw::Set(d, 1));
-    const auto vpx_mask = hw::ShiftLeft<20>(vpx);
-    const auto vpy_mask = hw::ShiftLeft<8>(vpy);
-
-    return vpx_mask | vpy_mask | hw::Set(d, dxy_mask) | vblack_to_white;
+    return __PackGradientValue<DX, DY>(vx2, vy2, v0, v1);
 }
 
 // Create a bitwise mask for lanes which are valid
@@ -116,9 +407,6 @@ inline auto __CalculateMask(const uint8_t* img_A, const uint8_t* img_B, const ui
     constexpr int N = hw::Lanes(d);
     constexpr hw::FixedTag<uint8_t, N> d8;
 
-    // Small buffer for intermediate calculations
-    alignas(64) static uint32_t rep_buffer[N];
-
     // Load image into 32bit lanes
     const auto v0 = hw::PromoteTo(d, LoadU(d8, img_A));
     const auto v1 = hw::PromoteTo(d, LoadU(d8, img_B));
@@ -133,6 +421,7 @@ inline auto __CalculateMask(const uint8_t* img_A, const uint8_t* img_B, const ui
     // TODO: It may end up faster to just eat the cost of not calculating CCL label counts at all,
     // remove it from the CCL algo as well, then filter these out based on bucket size after
     // gradient clusters.
+    // alignas(64) uint32_t rep_buffer[N];
     // for (int i = 0; i < N; i++) {
     //     rep_buffer[i] =
     //             (ccl.GetLabelCount(labels_A[i]) > 24) && (ccl.GetLabelCount(labels_B[i]) > 24) ?
@@ -145,136 +434,311 @@ inline auto __CalculateMask(const uint8_t* img_A, const uint8_t* img_B, const ui
     return mres;
 }
 
-// Return number of uint64_t written to output
-template <int DX, int DY>
-    requires(DX == 1 && DY == 0) || (DY == 1 && (DX >= -1 || DX <= 1))
-inline auto __CalculateAndStoreGradientVector(const uint8_t* img, const uint8_t* img_row2,
-                                              const uint32_t* labels, const uint32_t* labels_row2,
-                                              int row, int col, int img_width,
-                                              GradientClusterHash& hashmap) {
+// Insert cnt compacted gradient points into the hash map, keyed by the hash of their label pair
+inline void __StoreGradientPoints(const uint32_t* labels_min, const uint32_t* labels_max,
+                                  const uint32_t* values, int cnt, GradientClusterHash& hashmap) {
     constexpr hw::ScalableTag<uint32_t> d;
-    constexpr hw::ScalableTag<uint64_t> d64;
     constexpr int N = hw::Lanes(d);
-    constexpr int N64 = hw::Lanes(d64);
-
-    // First pointer is always img or labels, but second pointer depends on DX and DY
-    // DY selects between row1 and row2. DX can simply be added to that
-    const uint8_t* image_B;
-    const uint32_t* labels_B;
-    if constexpr (DY == 0) {
-        image_B = img;
-        labels_B = labels;
-    } else {
-        image_B = img_row2;
-        labels_B = labels_row2;
+
+    // Caller buffers are padded to a multiple of N, so hashing past cnt is harmless
+    alignas(64) uint32_t hash_buf[N];
+    for (int i = 0; i < cnt; i += N) {
+        const auto vhash =
+                __HashLabelPair(hw::LoadU(d, labels_min + i), hw::LoadU(d, labels_max + i));
+        hw::Store(vhash, d, hash_buf);
+
+        const int lanes = std::min(N, cnt - i);
+        for (int j = 0; j < lanes; j++) {
+            __InsertGradientPoint(hashmap, hash_buf[j], values[i + j]);
+        }
     }
+}
+
+// Append cnt compacted gradient points to the flat buffer as (hash << 32 | GradientPoint)
+inline void __StoreGradientPoints(const uint32_t* labels_min, const uint32_t* labels_max,
+                                  const uint32_t* values, int cnt, GradientClusterArray& array) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr int N = hw::Lanes(d);
 
-    // Actual calculations
-    const auto vvalues = HWY_NAMESPACE::__CalculateValue<DX, DY>(img, image_B + DX, col, row);
-    const auto vhash = HWY_NAMESPACE::__CalculateHashes(labels, labels_B + DX);
-    auto mask = HWY_NAMESPACE::__CalculateMask(img, image_B + DX, labels, labels_B + DX,
-                                               img_width - col);
+    // Interleaved stores write whole vectors, leave room for the overhang
+    array.EnsureFree(cnt + N);
+    uint32_t* out = reinterpret_cast<uint32_t*>(array.End());
 
-    // Dedup, only for <-1, 1> case
-    if constexpr (DX == -1 && DY == 1) {
-        // From frc971/orin/apriltag.cc but reworded
-        // We search the following 4 neighbors.
-        //      ________
-        //      | x | 0 |
-        //  -------------
-        //  | 3 | 2 | 1 |
-        //  -------------
-        //
-        // If connection between block x and block 1 has the same IDs as the connection between
-        // blocks 0 and 2, we will have a duplicate entry. This may not be so intuitive at first.
-        // The easiest way to see it is this is the exact same point. It may look like they be
-        // merged, since the gradient direction could be different. However that is not actually the
-        // case, since this duplicate can only happen in two cases. All other cases will be filered
-        // out. Apriltag comment says it a bit more clearly (Also thanks Austin)
-
-        // Checking 1, 1 on the previous x, y, and -1, 1 on the current
-        // x, y result in duplicate points in the final list.  Only
-        // check the potential duplicate if adding this one won't
-        // create a duplicate.
-
-        // The cases are
-        //       id(x) == id(0) and id(2) == id(1),
-        //    or id(x) == id(2) and id(0) == id(1).
-        // We need to pick a single element to _not_ add. We could choose block 1, however that
-        // would make handling across the last edge harder. Insead, don't add block 3. In that case
-        // it becomes
-        //       id(x-1) == id(x) and id(2) == id(3),
-        //    or id(x-1) == id(3) and id(x) == id(2).
-        const auto v_idxm1 = hw::LoadU(d, labels - 1);
-        const auto v_idx = hw::LoadU(d, labels);
-        const auto v_id2 = hw::LoadU(d, labels_row2);
-        const auto v_id3 = hw::LoadU(d, labels_row2 - 1);
-
-        const auto mdup1 = hw::And(v_idxm1 == v_idx, v_id2 == v_id3);
-        const auto mdup2 = hw::And(v_idxm1 == v_id3, v_idx == v_id2);
-        const auto mdup = hw::Or(mdup1, mdup2);
-        mask = hw::AndNot(mdup, mask);
-    }
-
-    uint32_t hash_buf[N];
-    uint32_t value_buf[N];
-    int cnt = hw::CompressStore(vhash, mask, d, hash_buf);
-    hw::CompressStore(vvalues, mask, d, value_buf);
+    for (int i = 0; i < cnt; i += N) {
+        const auto vhash =
+                __HashLabelPair(hw::LoadU(d, labels_min + i), hw::LoadU(d, labels_max + i));
+        hw::StoreInterleaved2(hw::LoadU(d, values + i), vhash, d, out + 2 * i);
+    }
 
+    array.Advance(cnt);
+}
+
+// Look up the exact cluster of each compacted point by its label pair, no hashing involved
+inline void __StoreGradientPoints(const uint32_t* labels_min, const uint32_t* labels_max,
+                                  const uint32_t* values, int cnt, LabelClusterStore& store) {
     for (int i = 0; i < cnt; i++) {
-        ClusterStore* bucket = hashmap.try_get(hash_buf[i]);
-        if (bucket == nullptr) {
-            ClusterStore tmp;
-            tmp.push_back(value_buf[i]);
-            hashmap.insert_unique(hash_buf[i], tmp);
-        } else {
-            bucket->push_back(value_buf[i]);
+        store.Append(store.ClusterId(labels_min[i], labels_max[i]), values[i]);
+    }
+}
+
+// Split a buffer of (key << 32 | point) sorted by key into one span per key. Compares every
+// key with its predecessor N at a time, only the (rare) boundaries are handled per lane.
+inline void __FindClusterSpans(const uint64_t* points, size_t size,
+                               std::vector<ClusterSpan>& spans) {
+    constexpr hw::ScalableTag<uint64_t> d;
+    constexpr int N = hw::Lanes(d);
+
+    spans.clear();
+    if (size == 0) return;
+
+    alignas(64) uint64_t starts[N];
+    size_t start = 0;
+    auto add_span = [&](size_t end) {
+        spans.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(end - start)});
+        start = end;
+    };
+
+    size_t i = 1;
+    for (; i + N <= size; i += N) {
+        const auto vkey = hw::ShiftRight<32>(hw::LoadU(d, points + i));
+        const auto vprev = hw::ShiftRight<32>(hw::LoadU(d, points + i - 1));
+        const auto mboundary = vkey != vprev;
+        if (hw::AllFalse(d, mboundary)) continue;
+
+        size_t cnt = hw::CompressStore(hw::Iota(d, i), mboundary, d, starts);
+        for (size_t j = 0; j < cnt; j++) {
+            add_span(starts[j]);
         }
     }
 
-    return cnt;
+    for (; i < size; i++) {
+        if ((points[i] >> 32) != (points[i - 1] >> 32)) add_span(i);
+    }
+
+    add_span(size);
+}
+
+// All four forward gradient directions (1,0), (0,1), (1,1) and (-1,1) of the N pixels starting
+// at col. The 2 x (N + 2) image and label neighborhood is loaded once and shared by every
+// direction, the accepted points of all directions are compacted into one stream and handed to
+// the store in a single call. Returns number of gradient points written to the store.
+template <class StoreT>
+inline int __CalculateAndStoreGradientVectors(const uint8_t* img, const uint8_t* img_row2,
+                                              const uint32_t* labels, const uint32_t* labels_row2,
+                                              int row, int col, int img_width, StoreT& store) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr int N = hw::Lanes(d);
+    constexpr hw::FixedTag<uint8_t, N> d8;
+
+    constexpr auto kSequenceBuffer = GenerateSequence(d);
+
+    // Neighborhood, suffix is the column offset
+    const auto vimg0 = hw::PromoteTo(d, hw::LoadU(d8, img));
+    const auto vimg1 = hw::PromoteTo(d, hw::LoadU(d8, img + 1));
+    const auto vimg2_m1 = hw::PromoteTo(d, hw::LoadU(d8, img_row2 - 1));
+    const auto vimg2_0 = hw::PromoteTo(d, hw::LoadU(d8, img_row2));
+    const auto vimg2_1 = hw::PromoteTo(d, hw::LoadU(d8, img_row2 + 1));
+
+    const auto vlabels_m1 = hw::LoadU(d, labels - 1);
+    const auto vlabels0 = hw::LoadU(d, labels);
+    const auto vlabels1 = hw::LoadU(d, labels + 1);
+    const auto vlabels2_m1 = hw::LoadU(d, labels_row2 - 1);
+    const auto vlabels2_0 = hw::LoadU(d, labels_row2);
+    const auto vlabels2_1 = hw::LoadU(d, labels_row2 + 1);
+
+    const auto vx2 = hw::ShiftLeft<1>(hw::Set(d, col) + hw::LoadU(d, kSequenceBuffer.data()));
+    const auto vy2 = hw::Set(d, 2 * row);
+
+    // Last column has no (1, y) neighbor, as in apriltag it is skipped for every direction
+    const auto vsum = hw::Set(d, 255);
+    const auto mvalid = hw::And(vimg0 != hw::Set(d, 127), hw::FirstN(d, img_width - 1 - col));
+
+    // Dedup, only for <-1, 1> case
+    // From frc971/orin/apriltag.cc but reworded
+    // We search the following 4 neighbors.
+    //      ________
+    //      | x | 0 |
+    //  -------------
+    //  | 3 | 2 | 1 |
+    //  -------------
+    //
+    // If connection between block x and block 1 has the same IDs as the connection between
+    // blocks 0 and 2, we will have a duplicate entry. This may not be so intuitive at first.
+    // The easiest way to see it is this is the exact same point. It may look like they be
+    // merged, since the gradient direction could be different. However that is not actually the
+    // case, since this duplicate can only happen in two cases. All other cases will be filered
+    // out. Apriltag comment says it a bit more clearly (Also thanks Austin)
+
+    // Checking 1, 1 on the previous x, y, and -1, 1 on the current
+    // x, y result in duplicate points in the final list.  Only
+    // check the potential duplicate if adding this one won't
+    // create a duplicate.
+
+    // The cases are
+    //       id(x) == id(0) and id(2) == id(1),
+    //    or id(x) == id(2) and id(0) == id(1).
+    // We need to pick a single element to _not_ add. We could choose block 1, however that
+    // would make handling across the last edge harder. Insead, don't add block 3. In that case
+    // it becomes
+    //       id(x-1) == id(x) and id(2) == id(3),
+    //    or id(x-1) == id(3) and id(x) == id(2).
+    const auto mdup1 = hw::And(vlabels_m1 == vlabels0, vlabels2_0 == vlabels2_m1);
+    const auto mdup2 = hw::And(vlabels_m1 == vlabels2_m1, vlabels0 == vlabels2_0);
+    const auto mdup = hw::Or(mdup1, mdup2);
+
+    // Hashing is left to the store, it is cheaper to do on the compacted lanes
+    alignas(64) uint32_t min_buf[4 * N];
+    alignas(64) uint32_t max_buf[4 * N];
+    alignas(64) uint32_t value_buf[4 * N];
+    size_t cnt = 0;
+
+    auto compact = [&](const auto& mask, const V32& value, const V32& labels_B) {
+        hw::CompressStore(hw::Min(vlabels0, labels_B), mask, d, min_buf + cnt);
+        hw::CompressStore(hw::Max(vlabels0, labels_B), mask, d, max_buf + cnt);
+        cnt += hw::CompressStore(value, mask, d, value_buf + cnt);
+    };
+
+    compact(hw::And(mvalid, (vimg0 + vimg1) == vsum),
+            __PackGradientValue<1, 0>(vx2, vy2, vimg0, vimg1), vlabels1);
+    compact(hw::And(mvalid, (vimg0 + vimg2_0) == vsum),
+            __PackGradientValue<0, 1>(vx2, vy2, vimg0, vimg2_0), vlabels2_0);
+    compact(hw::And(mvalid, (vimg0 + vimg2_1) == vsum),
+            __PackGradientValue<1, 1>(vx2, vy2, vimg0, vimg2_1), vlabels2_1);
+    compact(hw::AndNot(mdup, hw::And(mvalid, (vimg0 + vimg2_m1) == vsum)),
+            __PackGradientValue<-1, 1>(vx2, vy2, vimg0, vimg2_m1), vlabels2_m1);
+
+    __StoreGradientPoints(min_buf, max_buf, value_buf, static_cast<int>(cnt), store);
+
+    return static_cast<int>(cnt);
 }
 
 }  // namespace HWY_NAMESPACE
 HWY_AFTER_NAMESPACE();
 
+inline void GradientClusterArray::BuildSpans() {
+    HWY_NAMESPACE::__FindClusterSpans(points_.get(), size_, spans_);
+}
+
+// Flag every pixel of row r that has a black/white transition to any of its four forward
+// neighbors (1,0), (0,1), (1,1) and (-1,1). white/black are the 255 and 0 planes of the
+// threshold image, so this is exactly the pixels __CalculateMask would accept (before dedup).
+// Works on 64 pixels at a time, neighbor columns are reached with a one bit shift that carries
+// in from the adjacent word.
+inline void __CalculateEdgeBits(uint64_t* __restrict dst, const uint64_t* white0,
+                                const uint64_t* black0, const uint64_t* white1,
+                                const uint64_t* black1, size_t words) {
+    // Pixel x + 1 moved into bit x
+    auto next = [words](const uint64_t* row, size_t j) {
+        uint64_t carry = (j + 1 < words) ? row[j + 1] << 63 : 0;
+        return (row[j] >> 1) | carry;
+    };
+
+    // Pixel x - 1 moved into bit x
+    auto prev = [](const uint64_t* row, size_t j) {
+        uint64_t carry = (j > 0) ? row[j - 1] >> 63 : 0;
+        return (row[j] << 1) | carry;
+    };
+
+    for (size_t j = 0; j < words; j++) {
+        uint64_t white_neighbors = next(white0, j) | white1[j] | next(white1, j) | prev(white1, j);
+        uint64_t black_neighbors = next(black0, j) | black1[j] | next(black1, j) | prev(black1, j);
+        dst[j] = (white0[j] & black_neighbors) | (black0[j] & white_neighbors);
+    }
+}
+
 class GradientClusters {
    private:
     int points_;
     cv::Size size_;
 
+    // Threshold polarity planes and the edge pixels derived from them, only used by PerformSparse
+    PackedBinaryImage white_;
+    PackedBinaryImage black_;
+    PackedBinaryImage edges_;
+
    public:
-    GradientClusters(cv::Size size) : size_(size) {
+    GradientClusters(cv::Size size)
+        : size_(size),
+          white_{size.height, size.width},
+          black_{size.height, size.width},
+          edges_{size.height, size.width} {
+        assert(size.width <= GradientPoint::kMaxImageSize);
+        assert(size.height <= GradientPoint::kMaxImageSize);
     }
 
     void Perform(cv::Mat1b& input, cv::Mat1i& labels, GradientClusterHash& hash) {
-        constexpr hw::ScalableTag<uint32_t> d;
-        constexpr int N = hw::Lanes(d);
         hash.clear();
-        int cnt = 0;
+        points_ = PerformRows(input, labels, 0, input.rows - 1, hash);
+    }
 
-        for (int r = 0; r < input.rows - 1; r++) {
-            uint32_t* pLabels_start = labels.ptr<uint32_t>(r);
-            uint32_t* pLabels_next_start = labels.ptr<uint32_t>(r + 1);
-            uint8_t* pimg_start = input.ptr<uint8_t>(r);
-            uint8_t* pimg_next_start = input.ptr<uint8_t>(r + 1);
+    // Sort based clustering, on return array.Spans() holds one span per cluster
+    void Perform(cv::Mat1b& input, cv::Mat1i& labels, GradientClusterArray& array) {
+        array.Clear();
+        points_ = PerformRows(input, labels, 0, input.rows - 1, array);
 
-            for (int c = 1; c < input.cols - 1; c += N) {
-                uint32_t* pLabels = pLabels_start + c;
-                uint32_t* pLabels_next = pLabels_next_start + c;
-                uint8_t* pimg = pimg_start + c;
-                uint8_t* pimg_next = pimg_next_start + c;
-                cnt += HWY_NAMESPACE::__CalculateAndStoreGradientVector<1, 0>(
-                        pimg, pimg_next, pLabels, pLabels_next, r, c, input.cols, hash);
-                cnt += HWY_NAMESPACE::__CalculateAndStoreGradientVector<0, 1>(
-                        pimg, pimg_next, pLabels, pLabels_next, r, c, input.cols, hash);
-                cnt += HWY_NAMESPACE::__CalculateAndStoreGradientVector<1, 1>(
-                        pimg, pimg_next, pLabels, pLabels_next, r, c, input.cols, hash);
-                cnt += HWY_NAMESPACE::__CalculateAndStoreGradientVector<-1, 1>(
-                        pimg, pimg_next, pLabels, pLabels_next, r, c, input.cols, hash);
+        hw::VQSortStatic(array.Data(), array.Size(), hwy::SortAscending{});
+        array.BuildSpans();
+    }
+
+    // Same clusters as Perform, but driven by a packed edge bitmap so only pixels on a black/white
+    // boundary are visited. Typically only a few percent of the frame, the rest is skipped 64
+    // pixels at a time. Border columns are excluded, as in apriltag.
+    void PerformSparse(cv::Mat1b& input, cv::Mat1i& labels, GradientClusterHash& hash) {
+        hash.clear();
+        BuildEdgeBits(input);
+        points_ = PerformEdgeRows(input, labels, 0, input.rows - 1, hash);
+    }
+
+    // Multi-threaded Perform. Rows are split into bands, each band is clustered by one thread
+    // into its own flat buffer and scattered by hash range into one slice per partition. Every
+    // partition is then assembled into its own hash by exactly one thread, so there is no locking
+    // and a given cluster only ever exists in one partition. Clusters come out identical to the
+    // single threaded Perform, the partitions can be consumed independently (e.g. by FitQuads).
+    void Perform(cv::Mat1b& input, cv::Mat1i& labels, ThreadPool& pool,
+                 std::vector<GradientClusterHash>& partitions) {
+        const size_t num_partitions = pool.NumThreads();
+        // More bands than threads to even out rows with lots of edges
+        const size_t num_bands = pool.NumThreads() * 4;
+        const int rows = input.rows - 1;
+
+        partitions.resize(num_partitions);
+        bands_.resize(num_bands);
+
+        pool.Run(num_bands, [&](size_t band_idx, size_t) {
+            Band& band = bands_[band_idx];
+            int row_begin = rows * band_idx / num_bands;
+            int row_end = rows * (band_idx + 1) / num_bands;
+
+            band.points.Clear();
+            band.count = PerformRows(input, labels, row_begin, row_end, band.points);
+            band.Partition(num_partitions);
+        });
+
+        pool.Run(num_partitions, [&](size_t partition, size_t) {
+            GradientClusterHash& hash = partitions[partition];
+            hash.clear();
+
+            // Bands are visited in row order, so points land in the same order as Perform
+            for (Band& band : bands_) {
+                for (uint32_t i = band.offsets[partition]; i < band.offsets[partition + 1]; i++) {
+                    uint64_t point = band.partitioned[i];
+                    __InsertGradientPoint(hash, point >> 32, static_cast<uint32_t>(point));
+                }
             }
+        });
+
+        points_ = 0;
+        for (Band& band : bands_) {
+            points_ += band.count;
         }
-        points_ = cnt;
+    }
+
+    // Hash free clustering, label_count as returned by BMRS::LabelCount(). On return
+    // store.Spans() holds one span per label pair, indexed by cluster id.
+    void Perform(cv::Mat1b& input, cv::Mat1i& labels, LabelClusterStore& store, int label_count) {
+        store.Reset(label_count);
+        points_ = PerformRows(input, labels, 0, input.rows - 1, store);
+        store.Finalize();
     }
 
 #if 0
@@ -296,7 +760,7 @@ class GradientClusters {
         cv::Mat1b result = cv::Mat::zeros(size_, CV_8UC1);
 
         for (auto vit = hash.cbegin(); vit != hash.cend(); vit++) {
-            ClusterStore cluster = vit->second;
+            const ClusterStore& cluster = vit->second.points;
             for (auto it = cluster.cbegin(); it != cluster.end(); it++) {
                 GradientPoint p(*it);
                 int y = (int)p.GetY();
@@ -318,6 +782,152 @@ class GradientClusters {
     int Size() {
         return points_;
     }
+
+   private:
+    // Per thread partial store of the multi-threaded Perform
+    struct Band {
+        GradientClusterArray points;
+        std::vector<uint64_t> partitioned;
+        std::vector<uint32_t> offsets;
+        int count;
+
+        // Stable counting sort of the (hash << 32 | GradientPoint) points into hash ranges,
+        // partition p ends up in partitioned[offsets[p], offsets[p + 1])
+        void Partition(size_t num_partitions) {
+            const uint64_t* data = points.Data();
+            const size_t size = points.Size();
+            auto partition_of = [num_partitions](uint64_t point) {
+                return ((point >> 32) * num_partitions) >> 32;
+            };
+
+            offsets.assign(num_partitions + 1, 0);
+            for (size_t i = 0; i < size; i++) {
+                offsets[partition_of(data[i]) + 1]++;
+            }
+            for (size_t p = 0; p < num_partitions; p++) {
+                offsets[p + 1] += offsets[p];
+            }
+
+            std::vector<uint32_t> cursor{offsets.begin(), offsets.end() - 1};
+            partitioned.resize(size);
+            for (size_t i = 0; i < size; i++) {
+                partitioned[cursor[partition_of(data[i])]++] = data[i];
+            }
+        }
+    };
+
+    std::vector<Band> bands_;
+
+    // Gradient points between rows [row_begin, row_end) and the row below each of them
+    template <class StoreT>
+    int PerformRows(cv::Mat1b& input, cv::Mat1i& labels, int row_begin, int row_end,
+                    StoreT& store) {
+        constexpr hw::ScalableTag<uint32_t> d;
+        constexpr int N = hw::Lanes(d);
+        int cnt = 0;
+
+        for (int r = row_begin; r < row_end; r++) {
+            uint32_t* pLabels_start = labels.ptr<uint32_t>(r);
+            uint32_t* pLabels_next_start = labels.ptr<uint32_t>(r + 1);
+            uint8_t* pimg_start = input.ptr<uint8_t>(r);
+            uint8_t* pimg_next_start = input.ptr<uint8_t>(r + 1);
+
+            for (int c = 1; c < input.cols - 1; c += N) {
+                uint32_t* pLabels = pLabels_start + c;
+                uint32_t* pLabels_next = pLabels_next_start + c;
+                uint8_t* pimg = pimg_start + c;
+                uint8_t* pimg_next = pimg_next_start + c;
+                cnt += HWY_NAMESPACE::__CalculateAndStoreGradientVectors(
+                        pimg, pimg_next, pLabels, pLabels_next, r, c, input.cols, store);
+            }
+        }
+
+        return cnt;
+    }
+
+    void BuildEdgeBits(cv::Mat1b& input) {
+        white_.UpdateFromMask<255>(input);
+        black_.UpdateFromMask<0>(input);
+
+        size_t words = white_.DoubleWordWidth();
+        for (int r = 0; r < input.rows - 1; r++) {
+            __CalculateEdgeBits(edges_[r], white_[r], black_[r], white_[r + 1], black_[r + 1],
+                                words);
+        }
+    }
+
+    // Sparse counterpart of PerformRows, requires BuildEdgeBits to have been called
+    template <class StoreT>
+    int PerformEdgeRows(cv::Mat1b& input, cv::Mat1i& labels, int row_begin, int row_end,
+                        StoreT& store) {
+        constexpr hw::ScalableTag<uint32_t> d;
+        constexpr int N = hw::Lanes(d);
+
+        // Each pixel adds at most 4 points, flush once the batch could overflow. Sized in whole
+        // vectors since stores read the batch N lanes at a time.
+        constexpr int kBatch = 64;
+        alignas(64) uint32_t min_buf[kBatch + 4 * N];
+        alignas(64) uint32_t max_buf[kBatch + 4 * N];
+        alignas(64) uint32_t value_buf[kBatch + 4 * N];
+        int batch = 0;
+        int cnt = 0;
+
+        const size_t words = edges_.DoubleWordWidth();
+        const int last_col = input.cols - 2;
+
+        for (int r = row_begin; r < row_end; r++) {
+            const uint32_t* labels0 = labels.ptr<uint32_t>(r);
+            const uint32_t* labels1 = labels.ptr<uint32_t>(r + 1);
+            const uint8_t* img0 = input.ptr<uint8_t>(r);
+            const uint8_t* img1 = input.ptr<uint8_t>(r + 1);
+            const uint64_t* edge_row = edges_[r];
+
+            for (size_t j = 0; j < words; j++) {
+                uint64_t bits = edge_row[j];
+
+                // Skip the first column, the last one is handled by the bound check below
+                if (j == 0) bits &= ~1ull;
+
+                while (bits) {
+                    const int x = j * 64 + std::countr_zero(bits);
+                    bits &= bits - 1;
+                    if (x > last_col) break;
+
+                    auto add = [&](int dx, int dy, const uint8_t* img_B, const uint32_t* labels_B) {
+                        const uint8_t v0 = img0[x];
+                        const uint8_t v1 = img_B[x + dx];
+                        if (v0 == 127 || v0 + v1 != 255) return;
+
+                        const uint32_t rep0 = labels0[x];
+                        const uint32_t rep1 = labels_B[x + dx];
+                        min_buf[batch] = std::min(rep0, rep1);
+                        max_buf[batch] = std::max(rep0, rep1);
+                        value_buf[batch] = GradientPoint::Pack(x, r, dx, dy, v1 > v0);
+                        batch++;
+                    };
+
+                    add(1, 0, img0, labels0);
+                    add(0, 1, img1, labels1);
+                    add(1, 1, img1, labels1);
+
+                    // Same dedup as the dense path, see __CalculateAndStoreGradientVectors
+                    const bool dup1 = labels0[x - 1] == labels0[x] && labels1[x] == labels1[x - 1];
+                    const bool dup2 = labels0[x - 1] == labels1[x - 1] && labels0[x] == labels1[x];
+                    if (!dup1 && !dup2) add(-1, 1, img1, labels1);
+
+                    if (batch >= kBatch) {
+                        HWY_NAMESPACE::__StoreGradientPoints(min_buf, max_buf, value_buf, batch,
+                                                             store);
+                        cnt += batch;
+                        batch = 0;
+                    }
+                }
+            }
+        }
+
+        HWY_NAMESPACE::__StoreGradientPoints(min_buf, max_buf, value_buf, batch, store);
+        return cnt + batch;
+    }
 };
 
 }  // namespace simdtag
@@ -6,47 +6,58 @@
 #include <cstdint>
 #include <string>
 
-namespace simdtag {
-
-#if 0
-HWY_BEFORE_NAMESPACE();
-namespace HWY_NAMESPACE {
-
-class GradientPoint {
-    using GradientPointV32 = hw::VFromD<ScalableTag<uint32_t>>;
-    constexpr hw::ScalableTag<uint32_t> d_;
+namespace hw = hwy::HWY_NAMESPACE;
 
-    GradientPoint
-};
-
-}  // namespace HWY_NAMESPACE
-HWY_AFTER_NAMESPACE();
-#endif
+namespace simdtag {
 
 class GradientPoint {
    public:
+    // Bit layout, shared with the SIMD paths in gradient_clusters.h and fit_quads.h
+    //   [19, 32) 2 * x + dx
+    //   [ 6, 19) 2 * y + dy
+    //   [ 4,  6) dx + 1
+    //   [ 2,  4) dy + 1
+    //   [ 0,  1) black to white
+    // 13 bits per doubled coordinate, so images up to 4096 x 4096 (4K, 2448x2048, ...)
+    static constexpr int kXShift = 19;
+    static constexpr int kYShift = 6;
+    static constexpr int kDxShift = 4;
+    static constexpr int kDyShift = 2;
+    static constexpr uint32_t kCoordMask = 0x1FFF;
+    static constexpr uint32_t kDirMask = 0x3;
+    static constexpr int kMaxImageSize = (kCoordMask + 1) / 2;
+
     GradientPoint(uint32_t value) : value_(value) {
     }
 
     GradientPoint() : value_(0) {
     }
 
+    // Same packing as the SIMD path in gradient_clusters.h. (x, y) is the first pixel, (dx, dy)
+    // the direction to its neighbor, black_to_white is set when the neighbor is brighter.
+    static uint32_t Pack(int x, int y, int dx, int dy, bool black_to_white) {
+        uint32_t px = (2 * x + dx) & kCoordMask;
+        uint32_t py = (2 * y + dy) & kCoordMask;
+        uint32_t dxy = (dx + 1) << kDxShift | (dy + 1) << kDyShift;
+        return px << kXShift | py << kYShift | dxy | static_cast<uint32_t>(black_to_white);
+    }
+
     void SetX(int x) {
-        value_ = (value_ & 0x000FFFFFu) | ((x * 2) << 20);
+        value_ = (value_ & ~(kCoordMask << kXShift)) | ((x * 2) << kXShift);
     }
 
     void SetY(int y) {
-        value_ = (value_ & 0xFFF000FFu) | ((y * 2) << 8);
+        value_ = (value_ & ~(kCoordMask << kYShift)) | ((y * 2) << kYShift);
     }
 
     // dx and dy must be in range [-1, 1]
     void SetDxDy(int dx, int dy) {
-        value_ &= ~0xF0;
+        value_ &= ~(kDirMask << kDxShift | kDirMask << kDyShift);
 
         dx += 1;
         dy += 1;
 
-        value_ |= (dx << 6 | dy << 4);
+        value_ |= (dx << kDxShift | dy << kDyShift);
     }
 
     void SetBlackToWhite(int v0, int v1) {
@@ -55,27 +66,27 @@ class GradientPoint {
     }
 
     float GetX() const {
-        return static_cast<float>(value_ >> 20) / 2.0f;
+        return static_cast<float>(value_ >> kXShift) / 2.0f;
     }
 
     float GetY() const {
-        return static_cast<float>((value_ & 0x000FFF00u) >> 8) / 2.0f;
+        return static_cast<float>((value_ >> kYShift) & kCoordMask) / 2.0f;
     }
 
     int GetIntX() const {
-        return static_cast<float>(value_ >> 20) / 2.0f;
+        return static_cast<float>(value_ >> kXShift) / 2.0f;
     }
 
     int GetIntY() const {
-        return static_cast<float>((value_ & 0x000FFF00u) >> 8) / 2.0f;
+        return static_cast<float>((value_ >> kYShift) & kCoordMask) / 2.0f;
     }
 
     int GetDx() const {
-        return ((value_ >> 6) & 0x3) - 1;
+        return ((value_ >> kDxShift) & kDirMask) - 1;
     }
 
     int GetDy() const {
-        return ((value_ >> 4) & 0x3) - 1;
+        return ((value_ >> kDyShift) & kDirMask) - 1;
     }
 
     bool GetBlackToWhite() const {
@@ -97,4 +108,56 @@ class GradientPoint {
     uint32_t value_;
 };
 
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+using V32 = hw::VFromD<hw::ScalableTag<uint32_t>>;
+using VI32 = hw::VFromD<hw::ScalableTag<int32_t>>;
+
+// Vectorized GradientPoint getters, coordinates are left doubled (2 * x + dx) as stored
+inline V32 __GetXVector(const V32& vvalue) {
+    return hw::ShiftRight<GradientPoint::kXShift>(vvalue);
+}
+
+inline V32 __GetYVector(const V32& vvalue) {
+    hw::DFromV<V32> d;
+    return hw::ShiftRight<GradientPoint::kYShift>(vvalue) & hw::Set(d, GradientPoint::kCoordMask);
+}
+
+// Gradient as in apriltag, dx * (v1 - v0) with the magnitude normalized to 1. The direction is
+// stored with a +1 bias in two bits, the sign comes from the black to white bit.
+template <int SHIFT>
+inline VI32 __GetGradientVector(const V32& vvalue) {
+    hw::DFromV<V32> d;
+    hw::RebindToSigned<decltype(d)> di;
+    const auto vmask = hw::Set(d, GradientPoint::kDirMask);
+    const auto vdir = hw::BitCast(di, hw::ShiftRight<SHIFT>(vvalue) & vmask) - hw::Set(di, 1);
+    const auto mblack_to_white = hw::RebindMask(di, (vvalue & hw::Set(d, 1)) != hw::Zero(d));
+    return hw::IfThenElse(mblack_to_white, vdir, hw::Neg(vdir));
+}
+
+inline VI32 __GetGxVector(const V32& vvalue) {
+    return __GetGradientVector<GradientPoint::kDxShift>(vvalue);
+}
+
+inline VI32 __GetGyVector(const V32& vvalue) {
+    return __GetGradientVector<GradientPoint::kDyShift>(vvalue);
+}
+
+// Points of a cluster, either a ClusterStore or the low 32 bits of a (key << 32 | point) buffer
+inline V32 __LoadPoints(const uint32_t* points) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    return hw::LoadU(d, points);
+}
+
+inline V32 __LoadPoints(const uint64_t* points) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    V32 vpoints, _discard;
+    hw::LoadInterleaved2(d, reinterpret_cast<const uint32_t*>(points), vpoints, _discard);
+    return vpoints;
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
 }  // namespace simdtag
@@ -2,13 +2,14 @@
 
 #include <fmt/format.h>
 
+#include <algorithm>
 #include <array>
-#include <new>
 #include <opencv2/core.hpp>
 #include <string>
 #include <vector>
 
 #include "HalideBuffer.h"
+#include "gradient_clusters.h"
 #include "halide_gradient_clusters.h"
 #include "simdtag/highway_utils.h"
 
@@ -42,35 +43,41 @@ inline int __CopyIf(uint64_t* __restrict dst, const uint64_t* __restrict src, si
     size_t idx = 0;
     if (count >= N) {
         for (; idx <= count - N; idx += N) {
-            auto v = Load(d, src + idx);
+            auto v = LoadU(d, src + idx);
             ptr += CompressBlendedStore(v, v != hw::Zero(d), d, ptr);
         }
     }
 
+    // Tail, planes are not a multiple of N in general
+    for (; idx < count; idx++) {
+        if (src[idx] != 0) *ptr++ = src[idx];
+    }
+
     return (int)(ptr - dst);
 }
 
 }  // namespace HWY_NAMESPACE
 HWY_AFTER_NAMESPACE();
 
+// The generator is run on tiles of kTileRows rows. Each tile is compacted into points_ straight
+// away, so the only full size buffer is the compacted output and the tile stays in L2.
 class HalideGradientClusters {
    private:
+    static constexpr int kTileRows = 8;
+
     // TODO: This will be a planar layout, experiment with interleaved and linear
-    Halide::Runtime::Buffer<uint64_t> sparse_gradient_points_;
-    uint64_t* compressed_gradient_points_;
-    int points_;
+    Halide::Runtime::Buffer<uint64_t> tile_;
+    GradientClusterArray points_;
     cv::Size size_;
 
    public:
-    HalideGradientClusters(cv::Size size)
-        : sparse_gradient_points_{size.width, size.height, 4}, size_(size) {
-        compressed_gradient_points_ =
-                new (std::align_val_t(64)) uint64_t[size.width * size.height * 4];
+    HalideGradientClusters(cv::Size size) : tile_{size.width, kTileRows, 4}, size_(size) {
     }
 
     void Print(int cols = 4) {
-        for (int i = 0; i < points_; i++) {
-            uint64_t val = compressed_gradient_points_[i];
+        const uint64_t* points = points_.Data();
+        for (size_t i = 0; i < points_.Size(); i++) {
+            uint64_t val = points[i];
             uint32_t hash = val >> 32;
             GradientPoint p{static_cast<uint32_t>(val)};
             fmt::print("{} - x:{} y:{} ", hash, p.GetX(), p.GetY());
@@ -84,8 +91,9 @@ class HalideGradientClusters {
     cv::Mat1b Draw() {
         cv::Mat1b result = cv::Mat::zeros(size_, CV_8UC1);
 
-        for (int i = 0; i < points_; i++) {
-            GradientPoint p{static_cast<uint32_t>(compressed_gradient_points_[i])};
+        const uint64_t* points = points_.Data();
+        for (size_t i = 0; i < points_.Size(); i++) {
+            GradientPoint p{static_cast<uint32_t>(points[i])};
             int y = (int)p.GetY();
             int x = (int)p.GetX();
             if (y < 0 || y >= size_.height || x < 0 || x >= size_.width) {
@@ -109,22 +117,35 @@ class HalideGradientClusters {
         Halide::Runtime::Buffer<int> halide_labels = Halide::Runtime::Buffer<int>::make_interleaved(
                 (int*)labels.data, labels.cols, labels.rows, labels.channels());
 
-        int error =
-                halide_gradient_clusters(halide_threshold, halide_labels, sparse_gradient_points_);
+        points_.Clear();
 
-        size_t double_words = sparse_gradient_points_.size_in_bytes() / 8;
+        for (int y = 0; y < input.rows; y += kTileRows) {
+            const int rows = std::min(kTileRows, input.rows - y);
 
-        int cnt = HWY_NAMESPACE::__CopyIf(compressed_gradient_points_,
-                                          sparse_gradient_points_.data(), double_words);
+            // Only the region covered by the output buffer is computed
+            auto tile = tile_.cropped(1, 0, rows);
+            tile.set_min(0, y, 0);
 
-        hw::VQSortStatic(compressed_gradient_points_, cnt, hwy::SortDescending{});
+            int error = halide_gradient_clusters(halide_threshold, halide_labels, tile);
+
+            [[unlikely]]
+            if (error) {
+                fmt::println("Halide returned an error: {}", error);
+                return;
+            }
 
-        [[unlikely]]
-        if (error) {
-            fmt::println("Halide returned an error: %d\n", error);
-            return;
+            // Planes are kTileRows apart, the last tile only fills the start of each one
+            const size_t plane_size = static_cast<size_t>(input.cols) * rows;
+            points_.EnsureFree(plane_size * 4);
+            for (int c = 0; c < 4; c++) {
+                int cnt = HWY_NAMESPACE::__CopyIf(points_.End(), &tile(0, y, c), plane_size);
+                points_.Advance(cnt);
+            }
         }
 
+        hw::VQSortStatic(points_.Data(), points_.Size(), hwy::SortDescending{});
+        points_.BuildSpans();
+
         // for (auto& k : hash_map_) {
         //     fmt::print("{}: ", k.first);
 
@@ -149,11 +170,16 @@ class HalideGradientClusters {
     }
 
     int Size() {
-        return points_;
+        return points_.Size();
     }
 
     uint64_t* GetBuffer() {
-        return compressed_gradient_points_;
+        return points_.Data();
+    }
+
+    // One span per cluster of GetBuffer(), see FitQuads::Perform
+    std::vector<ClusterSpan>& Spans() {
+        return points_.Spans();
     }
 };
 
@@ -1,6 +1,8 @@
 #include "Halide.h"
+#include "gradient_point.h"
 
 using namespace Halide;
+using simdtag::GradientPoint;
 
 extern "C" HALIDE_EXPORT_SYMBOL int32_t __HashMapInsert(void* hashmap, uint32_t hash,
                                                         uint32_t value, int x, int y, int c);
@@ -42,29 +44,43 @@ class GradientClusters : public Halide::Generator<GradientClusters> {
         Func clamped_input = BoundaryConditions::repeat_edge(input);
         Func clamped_labels = BoundaryConditions::repeat_edge(labels);
 
+        // Same as GradientClusters, border columns and the last row produce no points
+        Expr in_bounds = x >= 1 && x < input.dim(0).extent() - 1 && y < input.dim(1).extent() - 1;
+
+        Expr id_x = clamped_labels(x, y, 0);
+        Expr id_xm1 = clamped_labels(x - 1, y, 0);
+        Expr id_2 = clamped_labels(x, y + 1, 0);
+        Expr id_3 = clamped_labels(x - 1, y + 1, 0);
+        Expr duplicate = (id_xm1 == id_x && id_2 == id_3) || (id_xm1 == id_3 && id_x == id_2);
+
+        // (hash << 32 | GradientPoint), see GradientPoint for the layout of the lower 32 bits
+        const int kCoordMask = static_cast<int>(GradientPoint::kCoordMask);
 #define DO_CONN(dx, dy, EXPR_NUM)                                                                  \
     Expr value_##EXPR_NUM;                                                                         \
     {                                                                                              \
-        Expr rep0 = cast<uint64_t>(clamped_labels(x, y, 0));                                       \
-        Expr rep1 = cast<uint64_t>(clamped_labels(x + dx, y + dy, 0));                             \
-        Expr v0 = cast<uint64_t>(clamped_input(x, y, 0));                                          \
-        Expr v1 = cast<uint64_t>(clamped_input(x + dx, y + dy, 0));                                \
+        Expr rep0 = cast<uint64_t>(cast<uint32_t>(clamped_labels(x, y, 0)));                       \
+        Expr rep1 = cast<uint64_t>(cast<uint32_t>(clamped_labels(x + dx, y + dy, 0)));             \
+        Expr v0 = cast<int32_t>(clamped_input(x, y, 0));                                           \
+        Expr v1 = cast<int32_t>(clamped_input(x + dx, y + dy, 0));                                 \
         Expr black_to_white = select(v1 > v0, Expr((uint64_t)1), Expr((uint64_t)0));               \
                                                                                                    \
-        Expr hash_value_caldidate1 = rep0 << 32 | rep1;                                            \
-        Expr hash_value_caldidate2 = rep0 | rep1 << 32;                                            \
-        Expr hash_value =                                                                          \
-                (Expr((uint64_t)2654435761) * min(hash_value_caldidate1, hash_value_caldidate2)) & \
-                Expr((uint64_t)0xFFFFFFFF);                                                        \
-        Expr value_expr = hash_value | cast<uint64_t>(x) << 14 | cast<uint64_t>(y) << 3 |          \
-                          EXPR_NUM << 1 | black_to_white;                                          \
-        value_##EXPR_NUM = select(v0 + v1 == 255, value_expr, cast<uint64_t>(0));                  \
+        Expr hash_key = min(rep0, rep1) << 32 | max(rep0, rep1);                                   \
+        Expr hash_value = (hash_key * Expr((uint64_t)2654435761)) >> 32;                           \
+        Expr px = cast<uint64_t>((2 * x + dx) & kCoordMask);                                       \
+        Expr py = cast<uint64_t>((2 * y + dy) & kCoordMask);                                       \
+        Expr dxy = Expr((uint64_t)((dx + 1) << GradientPoint::kDxShift |                           \
+                                   (dy + 1) << GradientPoint::kDyShift));                          \
+        Expr value_expr = hash_value << 32 | px << GradientPoint::kXShift |                        \
+                          py << GradientPoint::kYShift | dxy | black_to_white;                     \
+        Expr valid = in_bounds && v0 != 127 && v0 + v1 == 255;                                     \
+        value_##EXPR_NUM = select(valid, value_expr, cast<uint64_t>(0));                           \
     }
         DO_CONN(1, 0, 0);
         DO_CONN(1, 1, 1);
         DO_CONN(0, 1, 2);
         DO_CONN(-1, 1, 3);
 #undef DO_CONN
+        value_3 = select(duplicate, cast<uint64_t>(0), value_3);
         gradient_clusters(x, y, c) = mux(c, {value_0, value_1, value_2, value_3});
     }
 
@@ -72,7 +88,8 @@ class GradientClusters : public Halide::Generator<GradientClusters> {
         if (using_autoscheduler()) {
             input.set_estimates({{640, 1600}, {480, 1200}, {1, 1}});
             labels.set_estimates({{640, 1600}, {480, 1200}, {1, 1}});
-            gradient_clusters.set_estimates({{640, 1600}, {480, 1200}, {4, 4}});
+            // Called per row tile by HalideGradientClusters, see kTileRows
+            gradient_clusters.set_estimates({{0, 1600}, {0, 8}, {0, 4}});
             //  output.set_estimates({{640 * 480 * 4, 1200 * 1600 * 4}});
         } else {
             // auto pipeline = get_pipeline();
@@ -0,0 +1,123 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+
+#include "quad.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// Row major 3x3 homography from tag coordinates to pixels. Tag coordinates span [-1, 1] from
+// the outer corners of the black border with y down, h[2][2] is 1 as in apriltag.
+struct Homography {
+    double h[3][3];
+
+    std::pair<double, double> Project(double x, double y) const {
+        const double xx = h[0][0] * x + h[0][1] * y + h[0][2];
+        const double yy = h[1][0] * x + h[1][1] * y + h[1][2];
+        const double zz = h[2][0] * x + h[2][1] * y + h[2][2];
+        return {xx / zz, yy / zz};
+    }
+
+    // Turned by rotation quarters in tag coordinates, H * R as apriltag does with the rotation
+    // of the decoded code
+    Homography Rotated(int rotation) const {
+        static constexpr double kCos[4] = {1, 0, -1, 0};
+        static constexpr double kSin[4] = {0, 1, 0, -1};
+        const double c = kCos[rotation & 3];
+        const double s = kSin[rotation & 3];
+
+        Homography out = *this;
+        for (int row = 0; row < 3; row++) {
+            out.h[row][0] = c * h[row][0] + s * h[row][1];
+            out.h[row][1] = c * h[row][1] - s * h[row][0];
+        }
+        return out;
+    }
+};
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Homographies of quads [0, count) as 9 planes of stride doubles, element (row, col) in plane
+// 3 * row + col, one quad per lane. Tag corner (-1, -1) maps to p[0], (1, -1) to p[1], (1, 1)
+// to p[2] and (-1, 1) to p[3], the correspondences of apriltag quad_update_homographies.
+//
+// apriltag solves the 8x8 system of homography_compute2 with pivoting for every quad. The square
+// to quad mapping has a closed form (Heckbert, "Fundamentals of Texture Mapping"), which is the
+// same homography without any branches, composed here with the map from [-1, 1] to [0, 1].
+// stride must be a multiple of the vector width, padding lanes repeat the last quad.
+inline void __QuadHomographies(const Quad* quads, size_t count, double* planes, size_t stride) {
+    constexpr hw::ScalableTag<double> d;
+    constexpr int N = hw::Lanes(d);
+    assert(stride % N == 0 && stride >= count);
+
+    const auto vhalf = hw::Set(d, 0.5);
+    const auto vone = hw::Set(d, 1.0);
+
+    for (size_t i = 0; i < count; i += N) {
+        HWY_ALIGN double corners[8][N];
+        for (int lane = 0; lane < N; lane++) {
+            Quad const& quad = quads[std::min(i + lane, count - 1)];
+            for (int k = 0; k < 4; k++) {
+                corners[2 * k][lane] = quad.p[k][0];
+                corners[2 * k + 1][lane] = quad.p[k][1];
+            }
+        }
+
+        const auto x0 = hw::Load(d, corners[0]);
+        const auto y0 = hw::Load(d, corners[1]);
+        const auto x1 = hw::Load(d, corners[2]);
+        const auto y1 = hw::Load(d, corners[3]);
+        const auto x2 = hw::Load(d, corners[4]);
+        const auto y2 = hw::Load(d, corners[5]);
+        const auto x3 = hw::Load(d, corners[6]);
+        const auto y3 = hw::Load(d, corners[7]);
+
+        // Unit square to quad
+        const auto sx = x0 - x1 + x2 - x3;
+        const auto sy = y0 - y1 + y2 - y3;
+        const auto dx1 = x1 - x2;
+        const auto dx2 = x3 - x2;
+        const auto dy1 = y1 - y2;
+        const auto dy2 = y3 - y2;
+        const auto den = hw::MulSub(dx1, dy2, dx2 * dy1);
+        const auto g = hw::MulSub(sx, dy2, dx2 * sy) / den;
+        const auto h = hw::MulSub(dx1, sy, sx * dy1) / den;
+
+        const auto a = hw::MulAdd(g, x1, x1 - x0);
+        const auto b = hw::MulAdd(h, x3, x3 - x0);
+        const auto e = hw::MulAdd(g, y1, y1 - y0);
+        const auto f = hw::MulAdd(h, y3, y3 - y0);
+
+        // Times the [-1, 1] to [0, 1] scaling, normalized so the last element is 1
+        const auto vinv = vone / hw::MulAdd(g + h, vhalf, vone);
+        const auto vscale = vhalf * vinv;
+
+        double* out = planes + i;
+        hw::Store(a * vscale, d, out);
+        hw::Store(b * vscale, d, out + stride);
+        hw::Store(hw::MulAdd(a + b, vhalf, x0) * vinv, d, out + 2 * stride);
+        hw::Store(e * vscale, d, out + 3 * stride);
+        hw::Store(f * vscale, d, out + 4 * stride);
+        hw::Store(hw::MulAdd(e + f, vhalf, y0) * vinv, d, out + 5 * stride);
+        hw::Store(g * vscale, d, out + 6 * stride);
+        hw::Store(h * vscale, d, out + 7 * stride);
+        hw::Store(vone, d, out + 8 * stride);
+    }
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+}  // namespace simdtag
@@ -0,0 +1,302 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "cluster_soa.h"
+#include "gradient_point.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// Inclusive prefix sums of the weighted moments of a slope sorted cluster, as in apriltag
+// compute_lfps. Coordinates are in pixels with the +0.5 pixel center bias. Doubles because the
+// second moments of a large cluster lose too much in float. Planes are vector aligned and padded
+// to whole vectors, the padding repeats the total.
+struct LineFitMoments {
+    double* mx;
+    double* my;
+    double* mxx;
+    double* mxy;
+    double* myy;
+    double* w;
+    size_t size;
+};
+
+// Grayscale frame the clusters came from, to weight the line fits by the image gradient
+struct GrayImage {
+    const uint8_t* data;
+    size_t stride;
+    int width;
+    int height;
+};
+
+// Reusable planes for LineFitMoments, one per thread. Only grows, so after the largest cluster of
+// the first frame there are no more allocations.
+class LineFitScratch {
+   public:
+    LineFitMoments Get(size_t size) {
+        constexpr hw::ScalableTag<float> dfloat;
+        const size_t padded = hwy::RoundUpTo(std::max<size_t>(size, 1), hw::Lanes(dfloat));
+
+        if (padded > capacity_) {
+            buffer_ = hwy::AllocateAligned<double>(padded * kPlanes);
+            capacity_ = padded;
+        }
+
+        double* p = buffer_.get();
+        return {p,
+                p + padded,
+                p + 2 * padded,
+                p + 3 * padded,
+                p + 4 * padded,
+                p + 5 * padded,
+                size};
+    }
+
+   private:
+    static constexpr size_t kPlanes = 6;
+
+    hwy::AlignedFreeUniquePtr<double[]> buffer_;
+    size_t capacity_ = 0;
+};
+
+struct LineFit {
+    // Centroid and unit normal
+    double ex, ey;
+    double nx, ny;
+    // Sum of squared errors and mean squared error
+    double err;
+    double mse;
+};
+
+// Line through n points from their weighted sums mx = sum w * x, ..., mxx = sum w * x^2, ... and
+// the total weight w
+inline LineFit FitLine(double mx, double my, double mxx, double mxy, double myy, double w,
+                       size_t n) {
+    const double ex = mx / w;
+    const double ey = my / w;
+    const double cxx = mxx / w - ex * ex;
+    const double cxy = mxy / w - ex * ey;
+    const double cyy = myy / w - ey * ey;
+
+    // The smallest eigenvalue of the covariance is the error along the normal
+    const double root = std::sqrt((cxx - cyy) * (cxx - cyy) + 4 * cxy * cxy);
+    const double eig_small = 0.5 * (cxx + cyy - root);
+    const double eig = 0.5 * (cxx + cyy + root);
+
+    // Normal from whichever row of (C - eig * I) is better conditioned
+    double nx1 = cxx - eig;
+    double ny1 = cxy;
+    double nx2 = cxy;
+    double ny2 = cyy - eig;
+    double m1 = nx1 * nx1 + ny1 * ny1;
+    double m2 = nx2 * nx2 + ny2 * ny2;
+
+    LineFit fit{ex, ey, 0, 0, n * eig_small, eig_small};
+    const double length = std::sqrt(std::max(m1, m2));
+    if (length >= 1e-12) {
+        fit.nx = (m1 > m2 ? nx1 : nx2) / length;
+        fit.ny = (m1 > m2 ? ny1 : ny2) / length;
+    }
+
+    return fit;
+}
+
+// Line through the points [i0, i1] of the moments, inclusive and wrapping around the end when
+// i0 > i1. Port of apriltag fit_line, O(1) for any segment.
+inline LineFit FitLine(LineFitMoments const& m, size_t i0, size_t i1) {
+    assert(i0 != i1);
+    assert(i0 < m.size && i1 < m.size);
+
+    double mx, my, mxx, mxy, myy, w;
+    size_t n;
+
+    if (i0 < i1) {
+        n = i1 - i0 + 1;
+        mx = m.mx[i1];
+        my = m.my[i1];
+        mxx = m.mxx[i1];
+        mxy = m.mxy[i1];
+        myy = m.myy[i1];
+        w = m.w[i1];
+
+        if (i0 > 0) {
+            mx -= m.mx[i0 - 1];
+            my -= m.my[i0 - 1];
+            mxx -= m.mxx[i0 - 1];
+            mxy -= m.mxy[i0 - 1];
+            myy -= m.myy[i0 - 1];
+            w -= m.w[i0 - 1];
+        }
+    } else {
+        // i0 > i1, e.g. [15, 2]. Wrap around.
+        const size_t last = m.size - 1;
+        n = m.size - i0 + i1 + 1;
+        mx = m.mx[last] - m.mx[i0 - 1] + m.mx[i1];
+        my = m.my[last] - m.my[i0 - 1] + m.my[i1];
+        mxx = m.mxx[last] - m.mxx[i0 - 1] + m.mxx[i1];
+        mxy = m.mxy[last] - m.mxy[i0 - 1] + m.mxy[i1];
+        myy = m.myy[last] - m.myy[i0 - 1] + m.myy[i1];
+        w = m.w[last] - m.w[i0 - 1] + m.w[i1];
+    }
+
+    return FitLine(mx, my, mxx, mxy, myy, w, n);
+}
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// apriltag weight of the points at pixel coordinates (x, y), sqrt(gx^2 + gy^2) + 1 with the
+// central difference gradient of the grayscale image, or 1 on the image border. The bytes are
+// gathered as 32-bit words at byte offsets, below the pixel for the last row so the reads stay
+// inside the image.
+inline auto __GradientWeights(hw::VFromD<hw::ScalableTag<float>> vx,
+                              hw::VFromD<hw::ScalableTag<float>> vy, GrayImage const& image) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr hw::RebindToSigned<decltype(dfloat)> di;
+    constexpr hw::RebindToUnsigned<decltype(dfloat)> du;
+
+    const auto vix = hw::ConvertTo(di, vx);
+    const auto viy = hw::ConvertTo(di, vy);
+    const auto vone = hw::Set(di, 1);
+    const auto vstride = hw::Set(di, static_cast<int32_t>(image.stride));
+    const auto vbyte = hw::Set(di, 0xFF);
+
+    auto mvalid = hw::And(hw::Gt(vix, hw::Zero(di)), hw::Lt(vix + vone, hw::Set(di, image.width)));
+    mvalid = hw::And(mvalid, hw::Gt(viy, hw::Zero(di)));
+    mvalid = hw::And(mvalid, hw::Lt(viy + vone, hw::Set(di, image.height)));
+
+    // Border lanes read an inner pixel and are set to 1 at the end
+    const auto vcenter = hw::IfThenElse(mvalid, hw::MulAdd(viy, vstride, vix), vstride + vone);
+
+    const int32_t* base = reinterpret_cast<const int32_t*>(image.data);
+    const auto vleft = hw::GatherOffset(di, base, vcenter - vone) & vbyte;
+    const auto vright = hw::GatherOffset(di, base, vcenter + vone) & vbyte;
+    const auto vup = hw::GatherOffset(di, base, vcenter - vstride) & vbyte;
+    const auto vdown_word = hw::GatherOffset(di, base, vcenter + vstride - hw::Set(di, 3));
+    const auto vdown = hw::BitCast(di, hw::ShiftRight<24>(hw::BitCast(du, vdown_word)));
+
+    const auto vgx = hw::ConvertTo(dfloat, vright - vleft);
+    const auto vgy = hw::ConvertTo(dfloat, vdown - vup);
+    const auto vweight = hw::Sqrt(hw::MulAdd(vgx, vgx, vgy * vgy)) + hw::Set(dfloat, 1.0f);
+
+    return hw::IfThenElse(hw::RebindMask(dfloat, mvalid), vweight, hw::Set(dfloat, 1.0f));
+}
+
+// Shared by the point formats, load(i, vx, vy) gives the doubled coordinates of the points
+// [i, i + N) as floats and must not read past size itself. Each float vector is widened to two
+// double vectors, prefix summed in log2(N) slides and offset by the running total. Points are
+// weighted by the image gradient when there is an image, as in apriltag, otherwise by 1.
+template <class LoadFunction>
+inline void __ComputePrefixMoments(size_t size, LoadFunction const& load, const GrayImage* image,
+                                   LineFitMoments& out) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr hw::Half<decltype(dfloat)> dhalf;
+    constexpr hw::ScalableTag<double> ddouble;
+    constexpr int N = hw::Lanes(dfloat);
+    constexpr int ND = hw::Lanes(ddouble);
+
+    const auto vhalf = hw::Set(dfloat, 0.5f);
+
+    auto cmx = hw::Zero(ddouble);
+    auto cmy = hw::Zero(ddouble);
+    auto cmxx = hw::Zero(ddouble);
+    auto cmxy = hw::Zero(ddouble);
+    auto cmyy = hw::Zero(ddouble);
+    auto cw = hw::Zero(ddouble);
+
+    auto prefix = [&](auto v, auto& carry, double* plane) {
+        for (int shift = 1; shift < ND; shift *= 2) {
+            v = v + hw::SlideUpLanes(ddouble, v, shift);
+        }
+        v = v + carry;
+        hw::Store(v, ddouble, plane);
+        carry = hw::Set(ddouble, hw::ExtractLane(v, ND - 1));
+    };
+
+    auto moments = [&](auto vx, auto vy, auto vw, size_t j) {
+        const auto vwx = vw * vx;
+        const auto vwy = vw * vy;
+
+        prefix(vwx, cmx, out.mx + j);
+        prefix(vwy, cmy, out.my + j);
+        prefix(vwx * vx, cmxx, out.mxx + j);
+        prefix(vwx * vy, cmxy, out.mxy + j);
+        prefix(vwy * vy, cmyy, out.myy + j);
+        prefix(vw, cw, out.w + j);
+    };
+
+    for (size_t i = 0; i < size; i += N) {
+        hw::VFromD<decltype(dfloat)> vx2, vy2;
+        load(i, vx2, vy2);
+
+        // Pixel centers, lanes past the end get no weight so the padding repeats the total
+        const auto vx = hw::MulAdd(vx2, vhalf, vhalf);
+        const auto vy = hw::MulAdd(vy2, vhalf, vhalf);
+        const auto vweight = image ? __GradientWeights(vx, vy, *image) : hw::Set(dfloat, 1.0f);
+        const auto vw = hw::IfThenElseZero(hw::FirstN(dfloat, size - i), vweight);
+
+        moments(hw::PromoteTo(ddouble, hw::LowerHalf(dhalf, vx)),
+                hw::PromoteTo(ddouble, hw::LowerHalf(dhalf, vy)),
+                hw::PromoteTo(ddouble, hw::LowerHalf(dhalf, vw)), i);
+        moments(hw::PromoteTo(ddouble, hw::UpperHalf(dhalf, vx)),
+                hw::PromoteTo(ddouble, hw::UpperHalf(dhalf, vy)),
+                hw::PromoteTo(ddouble, hw::UpperHalf(dhalf, vw)), i + ND);
+    }
+}
+
+// From slope sorted packed points, either a ClusterStore or a (slope << 32 | point) span
+template <class T>
+inline void __ComputeLineFitMoments(const T* points, size_t size, LineFitMoments& out,
+                                    const GrayImage* image = nullptr) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr int N = hw::Lanes(dfloat);
+
+    auto load = [&](size_t i, auto& vx2, auto& vy2) {
+        auto decode = [&](const T* p) {
+            const auto va = __LoadPoints(p);
+            vx2 = hw::ConvertTo(dfloat, __GetXVector(va));
+            vy2 = hw::ConvertTo(dfloat, __GetYVector(va));
+        };
+
+        if (i + N <= size) {
+            decode(points + i);
+        } else {
+            T tail[N] = {};
+            std::copy(points + i, points + size, tail);
+            decode(tail);
+        }
+    };
+
+    __ComputePrefixMoments(size, load, image, out);
+}
+
+// From a slope sorted ClusterView, the planes are already padded
+inline void __ComputeLineFitMoments(ClusterView const& cluster, LineFitMoments& out,
+                                    const GrayImage* image = nullptr) {
+    constexpr hw::ScalableTag<float> dfloat;
+
+    auto load = [&](size_t i, auto& vx2, auto& vy2) {
+        vx2 = hw::Load(dfloat, cluster.x + i);
+        vy2 = hw::Load(dfloat, cluster.y + i);
+    };
+
+    __ComputePrefixMoments(cluster.size, load, image, out);
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+}  // namespace simdtag
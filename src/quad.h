@@ -0,0 +1,202 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "line_fit.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// A quad found by FitQuads, same layout as the apriltag quad before decoding
+struct Quad {
+    // Corners in pixels, in slope order around the cluster center. As in apriltag corner i is
+    // where line i meets line i + 1.
+    float p[4][2];
+
+    // The border is white inside black, see FitQuadsParams
+    bool reversed_border;
+};
+
+// Batch of four line fits per candidate quad, kept as structure of arrays so the geometric
+// checks run with one quad per lane. Planes only grow, keep one per thread.
+class QuadCandidates {
+   public:
+    // Fields of each line, see LineFit
+    enum Field { kEx, kEy, kNx, kNy, kFields };
+
+    void Clear() {
+        size_ = 0;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Lines in slope order, each fit between two neighboring corner points of the cluster
+    void Add(std::array<LineFit, 4> const& lines, bool reversed_border) {
+        if (size_ == capacity_) [[unlikely]] {
+            Reserve(std::max<size_t>(capacity_ * 2, 64));
+        }
+
+        for (int line = 0; line < 4; line++) {
+            MutablePlane(line, kEx)[size_] = lines[line].ex;
+            MutablePlane(line, kEy)[size_] = lines[line].ey;
+            MutablePlane(line, kNx)[size_] = lines[line].nx;
+            MutablePlane(line, kNy)[size_] = lines[line].ny;
+        }
+        reversed_border_[size_] = reversed_border;
+        size_++;
+    }
+
+    const double* Plane(int line, Field field) const {
+        return planes_.get() + (line * kFields + field) * capacity_;
+    }
+
+    bool ReversedBorder(size_t i) const {
+        return reversed_border_[i];
+    }
+
+   private:
+    double* MutablePlane(int line, Field field) {
+        return planes_.get() + (line * kFields + field) * capacity_;
+    }
+
+    // Capacity stays a multiple of the vector width so whole vectors can be loaded from every
+    // plane, the lanes past Size() are masked off
+    void Reserve(size_t count) {
+        constexpr hw::ScalableTag<double> d;
+        count = hwy::RoundUpTo(count, hw::Lanes(d));
+
+        auto grown = hwy::AllocateAligned<double>(count * kPlanes);
+        std::fill(grown.get(), grown.get() + count * kPlanes, 0.0);
+        for (size_t plane = 0; plane < kPlanes && size_; plane++) {
+            std::copy(planes_.get() + plane * capacity_, planes_.get() + plane * capacity_ + size_,
+                      grown.get() + plane * count);
+        }
+
+        planes_ = std::move(grown);
+        reversed_border_.resize(count);
+        capacity_ = count;
+    }
+
+    static constexpr size_t kPlanes = 4 * kFields;
+
+    hwy::AlignedFreeUniquePtr<double[]> planes_;
+    std::vector<uint8_t> reversed_border_;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Port of the end of apriltag fit_quad, one candidate per lane. Intersects neighboring lines into
+// corners, then rejects quads that are nearly parallel, smaller than 0.95 * min_tag_width^2,
+// have a corner sharper or flatter than cos_critical_rad, or are not convex. Survivors are
+// appended to quads.
+inline void __AssembleQuads(QuadCandidates const& candidates, double min_tag_width,
+                            double cos_critical_rad, std::vector<Quad>& quads) {
+    constexpr hw::ScalableTag<double> d;
+    constexpr hw::RebindToUnsigned<decltype(d)> du;
+    constexpr int N = hw::Lanes(d);
+
+    using Field = QuadCandidates::Field;
+
+    const auto vmin_det = hw::Set(d, 0.001);
+    const auto vmin_area = hw::Set(d, 0.95 * min_tag_width * min_tag_width);
+    const auto vcos_critical = hw::Set(d, cos_critical_rad);
+    const auto vhalf = hw::Set(d, 0.5);
+
+    HWY_ALIGN double corners[8][N];
+    HWY_ALIGN uint64_t selected[N];
+
+    for (size_t i = 0; i < candidates.Size(); i += N) {
+        auto mvalid = hw::FirstN(d, candidates.Size() - i);
+
+        auto load = [&](int line, Field field) {
+            return hw::Load(d, candidates.Plane(line & 3, field) + i);
+        };
+
+        // Solve p0 + l0 * u0 = p1 + l1 * u1 for neighboring lines, u is the normal rotated by
+        // 90 degrees
+        for (int line = 0; line < 4; line++) {
+            const auto va00 = load(line, Field::kNy);
+            const auto va01 = hw::Neg(load(line + 1, Field::kNy));
+            const auto va10 = hw::Neg(load(line, Field::kNx));
+            const auto va11 = load(line + 1, Field::kNx);
+            const auto vb0 = load(line + 1, Field::kEx) - load(line, Field::kEx);
+            const auto vb1 = load(line + 1, Field::kEy) - load(line, Field::kEy);
+
+            const auto vdet = va00 * va11 - va10 * va01;
+            mvalid = hw::And(mvalid, hw::Ge(hw::Abs(vdet), vmin_det));
+
+            const auto vl0 = (va11 * vb0 - va01 * vb1) / vdet;
+            hw::Store(hw::MulAdd(vl0, va00, load(line, Field::kEx)), d, corners[2 * line]);
+            hw::Store(hw::MulAdd(vl0, va10, load(line, Field::kEy)), d, corners[2 * line + 1]);
+        }
+
+        auto x = [&](int corner) { return hw::Load(d, corners[2 * (corner & 3)]); };
+        auto y = [&](int corner) { return hw::Load(d, corners[2 * (corner & 3) + 1]); };
+        auto length = [&](int a, int b) {
+            const auto vdx = x(b) - x(a);
+            const auto vdy = y(b) - y(a);
+            return hw::Sqrt(hw::MulAdd(vdx, vdx, vdy * vdy));
+        };
+
+        // Heron's formula for the triangles (0, 1, 2) and (2, 3, 0), as in apriltag. A NaN
+        // area from a degenerate triangle fails the comparison.
+        auto triangle = [&](int a, int b, int c) {
+            const auto vla = length(a, b);
+            const auto vlb = length(b, c);
+            const auto vlc = length(c, a);
+            const auto vp = (vla + vlb + vlc) * vhalf;
+            return hw::Sqrt(vp * (vp - vla) * (vp - vlb) * (vp - vlc));
+        };
+
+        const auto varea = triangle(0, 1, 2) + triangle(2, 3, 0);
+        mvalid = hw::And(mvalid, hw::Ge(varea, vmin_area));
+
+        // The cumulative angle change must be 2 pi, every turn the same way and not too sharp
+        for (int corner = 0; corner < 4; corner++) {
+            const auto vdx1 = x(corner + 1) - x(corner);
+            const auto vdy1 = y(corner + 1) - y(corner);
+            const auto vdx2 = x(corner + 2) - x(corner + 1);
+            const auto vdy2 = y(corner + 2) - y(corner + 1);
+
+            const auto vnorm = hw::Sqrt(hw::MulAdd(vdx1, vdx1, vdy1 * vdy1) *
+                                        hw::MulAdd(vdx2, vdx2, vdy2 * vdy2));
+            const auto vcos = hw::MulAdd(vdx1, vdx2, vdy1 * vdy2) / vnorm;
+
+            mvalid = hw::And(mvalid, hw::Le(hw::Abs(vcos), vcos_critical));
+            mvalid = hw::And(mvalid, hw::Ge(vdx1 * vdy2, vdy1 * vdx2));
+        }
+
+        const size_t count = hw::CompressStore(hw::Iota(du, 0), hw::RebindMask(du, mvalid), du,
+                                               selected);
+        for (size_t j = 0; j < count; j++) {
+            const size_t lane = selected[j];
+            Quad& quad = quads.emplace_back();
+            for (int corner = 0; corner < 4; corner++) {
+                quad.p[corner][0] = static_cast<float>(corners[2 * corner][lane]);
+                quad.p[corner][1] = static_cast<float>(corners[2 * corner + 1][lane]);
+            }
+            quad.reversed_border = candidates.ReversedBorder(i + lane);
+        }
+    }
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+}  // namespace simdtag
@@ -0,0 +1,267 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "line_fit.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// errors[i] is the line fit error of the 2 * ksz + 1 points centered on i, wrapping around the
+// cluster. The points whose window doesn't wrap are done with unaligned loads of the prefix
+// moments, the few near the ends with FitLine.
+inline void __SegmentErrors(LineFitMoments const& m, size_t ksz, double* errors) {
+    constexpr hw::ScalableTag<double> d;
+    constexpr int N = hw::Lanes(d);
+
+    const size_t size = m.size;
+    const auto vn = hw::Set(d, static_cast<double>(2 * ksz + 1));
+    const auto vhalf = hw::Set(d, 0.5);
+    const auto vfour = hw::Set(d, 4.0);
+
+    auto scalar = [&](size_t i) {
+        errors[i] = FitLine(m, (i + size - ksz) % size, (i + ksz) % size).err;
+    };
+
+    size_t i = 0;
+    for (; i <= ksz; i++) {
+        scalar(i);
+    }
+
+    for (; i + N + ksz <= size; i += N) {
+        auto segment = [&](const double* plane) {
+            return hw::LoadU(d, plane + i + ksz) - hw::LoadU(d, plane + i - ksz - 1);
+        };
+
+        const auto vw = segment(m.w);
+        const auto vex = segment(m.mx) / vw;
+        const auto vey = segment(m.my) / vw;
+        const auto vcxx = segment(m.mxx) / vw - vex * vex;
+        const auto vcxy = segment(m.mxy) / vw - vex * vey;
+        const auto vcyy = segment(m.myy) / vw - vey * vey;
+
+        const auto vdiff = vcxx - vcyy;
+        const auto vroot = hw::Sqrt(hw::MulAdd(vdiff, vdiff, vfour * vcxy * vcxy));
+        const auto veig_small = vhalf * (vcxx + vcyy - vroot);
+
+        hw::StoreU(vn * veig_small, d, errors + i);
+    }
+
+    for (; i < size; i++) {
+        scalar(i);
+    }
+}
+
+// Circular convolution of errors with filter, which has an odd length. errors holds size values
+// after filter_size / 2 values of room on each side, which are filled with the wrapped values
+// here. out gets one value of wrapped padding on each side for __ErrorMaxima.
+inline void __SmoothErrors(double* errors, size_t size, const double* filter, size_t filter_size,
+                           double* out) {
+    constexpr hw::ScalableTag<double> d;
+    constexpr int N = hw::Lanes(d);
+
+    const size_t half = filter_size / 2;
+    std::copy(errors + size, errors + size + half, errors);
+    std::copy(errors + half, errors + 2 * half, errors + half + size);
+
+    for (size_t i = 0; i < size; i += N) {
+        auto vacc = hw::Zero(d);
+        for (size_t t = 0; t < filter_size; t++) {
+            vacc = hw::MulAdd(hw::LoadU(d, errors + i + t), hw::Set(d, filter[t]), vacc);
+        }
+        hw::StoreU(vacc, d, out + 1 + i);
+    }
+
+    out[0] = out[size];
+    out[size + 1] = out[1];
+}
+
+// Compact the indices and values of the strict local maxima of the padded errors from
+// __SmoothErrors, returns how many there are
+inline size_t __ErrorMaxima(const double* errors, size_t size, uint64_t* maxima,
+                            double* maxima_errors) {
+    constexpr hw::ScalableTag<double> d;
+    constexpr hw::RebindToUnsigned<decltype(d)> du;
+    constexpr int N = hw::Lanes(d);
+
+    size_t count = 0;
+    for (size_t i = 0; i < size; i += N) {
+        const auto vprev = hw::LoadU(d, errors + i);
+        const auto verr = hw::LoadU(d, errors + i + 1);
+        const auto vnext = hw::LoadU(d, errors + i + 2);
+
+        auto mmax = hw::And(hw::FirstN(d, size - i), hw::Gt(verr, vprev));
+        mmax = hw::And(mmax, hw::Gt(verr, vnext));
+
+        hw::CompressStore(verr, mmax, d, maxima_errors + count);
+        count += hw::CompressStore(hw::Iota(du, i), hw::RebindMask(du, mmax), du, maxima + count);
+    }
+
+    return count;
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// Port of apriltag quad_segment_maxima. Corners are where a line fit over a window of the slope
+// sorted cluster is worst, the best four of those maxima are picked by the total line fit error.
+// Buffers are kept between clusters, use one per thread.
+class QuadCorners {
+   public:
+    QuadCorners() {
+        // XXX Tunable, as in apriltag. With sigma = 1 and cutoff = 0.05 the filter has 7 taps.
+        constexpr double sigma = 1;
+        constexpr double cutoff = 0.05;
+
+        int half = static_cast<int>(std::sqrt(-std::log(cutoff) * 2 * sigma * sigma)) + 1;
+        for (int j = -half; j <= half; j++) {
+            filter_.push_back(std::exp(-j * j / (2 * sigma * sigma)));
+        }
+    }
+
+    // Indices into the cluster of the four corners in slope order, false if there is no good
+    // enough quad
+    bool Find(LineFitMoments const& moments, size_t max_nmaxima, double max_line_fit_mse,
+              double cos_critical_rad, std::array<uint32_t, 4>& indices) {
+        const size_t size = moments.size;
+
+        // How many points on either side of a point are fit
+        const size_t ksz = std::min<size_t>(20, size / 12);
+        if (ksz < 2) {
+            return false;
+        }
+
+        Reserve(size);
+
+        const size_t half = filter_.size() / 2;
+        HWY_NAMESPACE::__SegmentErrors(moments, ksz, errors_.get() + half);
+        HWY_NAMESPACE::__SmoothErrors(errors_.get(), size, filter_.data(), filter_.size(),
+                                      smoothed_.get());
+        size_t nmaxima = HWY_NAMESPACE::__ErrorMaxima(smoothed_.get(), size, maxima_.get(),
+                                                      maxima_errors_.get());
+        if (nmaxima < 4) {
+            return false;
+        }
+
+        // Only keep the best handful of maxima
+        if (nmaxima > max_nmaxima) {
+            thresholds_.assign(maxima_errors_.get(), maxima_errors_.get() + nmaxima);
+            std::nth_element(thresholds_.begin(), thresholds_.begin() + max_nmaxima,
+                             thresholds_.end(), std::greater<double>{});
+            const double threshold = thresholds_[max_nmaxima];
+
+            size_t out = 0;
+            for (size_t in = 0; in < nmaxima; in++) {
+                if (maxima_errors_[in] > threshold) {
+                    maxima_[out++] = maxima_[in];
+                }
+            }
+            nmaxima = out;
+
+            if (nmaxima < 4) {
+                return false;
+            }
+        }
+
+        // Every segment between two maxima is fit once up front, apriltag refits the inner ones
+        // for every combination. fits_[a * n + b] runs from maxima a to b, wrapping when a > b.
+        fits_.resize(nmaxima * nmaxima);
+        for (size_t a = 0; a < nmaxima; a++) {
+            for (size_t b = 0; b < nmaxima; b++) {
+                if (a != b) {
+                    fits_[a * nmaxima + b] = FitLine(moments, maxima_[a], maxima_[b]);
+                }
+            }
+        }
+
+        auto fit = [&](size_t a, size_t b) -> LineFit const& { return fits_[a * nmaxima + b]; };
+
+        double best_error = HUGE_VAL;
+
+        for (size_t m0 = 0; m0 < nmaxima - 3; m0++) {
+            for (size_t m1 = m0 + 1; m1 < nmaxima - 2; m1++) {
+                LineFit const& f01 = fit(m0, m1);
+                if (f01.mse > max_line_fit_mse) continue;
+
+                for (size_t m2 = m1 + 1; m2 < nmaxima - 1; m2++) {
+                    LineFit const& f12 = fit(m1, m2);
+                    if (f12.mse > max_line_fit_mse) continue;
+
+                    // Disallow quads where the angle is less than a critical value
+                    if (std::abs(f01.nx * f12.nx + f01.ny * f12.ny) > cos_critical_rad) continue;
+
+                    // Errors only add up, so this branch can't beat the best any more
+                    const double partial = f01.err + f12.err;
+                    if (partial >= best_error) continue;
+
+                    for (size_t m3 = m2 + 1; m3 < nmaxima; m3++) {
+                        LineFit const& f23 = fit(m2, m3);
+                        if (f23.mse > max_line_fit_mse) continue;
+
+                        LineFit const& f30 = fit(m3, m0);
+                        if (f30.mse > max_line_fit_mse) continue;
+
+                        const double err = partial + f23.err + f30.err;
+                        if (err < best_error) {
+                            best_error = err;
+                            indices = {static_cast<uint32_t>(maxima_[m0]),
+                                       static_cast<uint32_t>(maxima_[m1]),
+                                       static_cast<uint32_t>(maxima_[m2]),
+                                       static_cast<uint32_t>(maxima_[m3])};
+                        }
+                    }
+                }
+            }
+        }
+
+        if (best_error == HUGE_VAL) {
+            return false;
+        }
+
+        return best_error / size < max_line_fit_mse;
+    }
+
+   private:
+    void Reserve(size_t size) {
+        constexpr hw::ScalableTag<double> d;
+        const size_t padded = hwy::RoundUpTo(size, hw::Lanes(d)) + filter_.size() + 2;
+
+        if (padded <= capacity_) return;
+
+        errors_ = hwy::AllocateAligned<double>(padded);
+        smoothed_ = hwy::AllocateAligned<double>(padded);
+        maxima_ = hwy::AllocateAligned<uint64_t>(padded);
+        maxima_errors_ = hwy::AllocateAligned<double>(padded);
+        capacity_ = padded;
+    }
+
+    std::vector<double> filter_;
+
+    // errors_ and smoothed_ have wrapped padding on both sides
+    hwy::AlignedFreeUniquePtr<double[]> errors_;
+    hwy::AlignedFreeUniquePtr<double[]> smoothed_;
+    hwy::AlignedFreeUniquePtr<uint64_t[]> maxima_;
+    hwy::AlignedFreeUniquePtr<double[]> maxima_errors_;
+    size_t capacity_ = 0;
+
+    std::vector<double> thresholds_;
+    std::vector<LineFit> fits_;
+};
+
+}  // namespace simdtag
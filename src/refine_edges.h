@@ -0,0 +1,252 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "line_fit.h"
+#include "quad.h"
+#include "tag_decoder.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+struct EdgeRefinerParams {
+    // How far the edge is searched for to both sides of the fitted line, in pixels. apriltag
+    // searches quad_decimate + 1 and simdtag does not decimate.
+    float search_range = 2.0f;
+};
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// The search of apriltag refine_edges for one sample point per lane. From (x0, y0) the gray
+// image is read along the normal (nx, ny), which points to the white side of the edge, in
+// quarter pixel steps n of [-range, range]. The gradient at n is the bilinear sample at n + 1
+// less the one at n - 1 and steps where it is backwards or reads outside of the image are
+// skipped. Writes the mean of n weighted by the squared gradient to offsets, NaN where nothing
+// was found. Samples n + 1 and n - 1 are 8 steps apart on the same profile, so every point of
+// the profile is gathered once and the last 8 are kept. count is a multiple of N.
+inline void __EdgeOffsets(const float* x0, const float* y0, const float* nx, const float* ny,
+                          size_t count, float range, GrayImage const& image, float* offsets) {
+    constexpr hw::ScalableTag<float> d;
+    constexpr int N = hw::Lanes(d);
+    constexpr int kLag = 8;
+    assert(count % N == 0);
+
+    const int steps = static_cast<int>(8.0f * range) + 1;
+    const auto vnan = hw::NaN(d);
+
+    HWY_ALIGN float profile[kLag][N];
+    for (size_t i = 0; i < count; i += N) {
+        const auto vx0 = hw::Load(d, x0 + i);
+        const auto vy0 = hw::Load(d, y0 + i);
+        const auto vnx = hw::Load(d, nx + i);
+        const auto vny = hw::Load(d, ny + i);
+
+        auto vmoment = hw::Zero(d);
+        auto vweight = hw::Zero(d);
+        for (int j = 0; j < steps + kLag; j++) {
+            // Offset n + 1 of step j - kLag
+            const auto vn = hw::Set(d, -range - 1.0f + 0.25f * j);
+
+            hw::Mask<decltype(d)> mvalid;
+            auto vgray = __SampleBilinear(hw::MulAdd(vn, vnx, vx0), hw::MulAdd(vn, vny, vy0),
+                                          image, mvalid);
+            vgray = hw::IfThenElse(mvalid, vgray, vnan);
+
+            if (j >= kLag) {
+                // NaN fails the comparison, so does a step outside of the image
+                const auto vinner = hw::Load(d, profile[j % kLag]);
+                const auto vgradient = vgray - vinner;
+                const auto vw = hw::IfThenElseZero(hw::Ge(vgray, vinner), vgradient * vgradient);
+                vmoment = hw::MulAdd(vw, hw::Set(d, -range + 0.25f * (j - kLag)), vmoment);
+                vweight = vweight + vw;
+            }
+            hw::Store(vgray, d, profile[j % kLag]);
+        }
+
+        const auto mfound = hw::Gt(vweight, hw::Zero(d));
+        hw::Store(hw::IfThenElse(mfound, vmoment / vweight, vnan), d, offsets + i);
+    }
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// Moves the corners of fitted quads onto the edges of the black border with sub-pixel accuracy,
+// the apriltag refine_edges step that runs before decoding. Each edge is sampled at evenly spaced
+// points, which are laid out in planes for all edges of all quads of the frame and searched
+// along their normals in one kernel with one point per float lane. The lines are then refit
+// through the points that were found and intersected into the new corners. Keep one refiner per
+// thread, the planes only grow.
+class EdgeRefiner {
+   public:
+    explicit EdgeRefiner(EdgeRefinerParams const& params = {}) : params_(params) {}
+
+    // Refine the quads found in gray in place. Corners stay where they are when the neighboring
+    // lines are close to parallel, and an edge without a response keeps its line.
+    void Refine(cv::Mat1b const& gray, std::vector<Quad>& quads) {
+        constexpr hw::ScalableTag<float> d;
+        constexpr int N = hw::Lanes(d);
+
+        if (quads.empty()) return;
+
+        // As in apriltag, 16 points per edge or one every 8 pixels on larger tags
+        edges_.clear();
+        size_t count = 0;
+        for (Quad const& quad : quads) {
+            for (int edge = 0; edge < 4; edge++) {
+                const float* a = quad.p[edge];
+                const float* b = quad.p[(edge + 1) & 3];
+                const double length = std::hypot(b[0] - a[0], b[1] - a[1]);
+
+                Edge& sampled = edges_.emplace_back();
+                sampled.first = count;
+                sampled.samples = std::max(16, static_cast<int>(length / 8));
+                sampled.nx = (b[1] - a[1]) / length;
+                sampled.ny = (a[0] - b[0]) / length;
+                if (quad.reversed_border) {
+                    sampled.nx = -sampled.nx;
+                    sampled.ny = -sampled.ny;
+                }
+                count += sampled.samples;
+            }
+        }
+
+        const size_t padded = hwy::RoundUpTo(count, N);
+        Reserve(padded);
+
+        // Points along each edge, not right at the corners which are the least reliable
+        float* x0 = Plane(kX0);
+        float* y0 = Plane(kY0);
+        float* nx = Plane(kNx);
+        float* ny = Plane(kNy);
+        for (size_t q = 0; q < quads.size(); q++) {
+            for (int edge = 0; edge < 4; edge++) {
+                Edge const& sampled = edges_[4 * q + edge];
+                const float* a = quads[q].p[edge];
+                const float* b = quads[q].p[(edge + 1) & 3];
+
+                for (int s = 0; s < sampled.samples; s++) {
+                    const size_t i = sampled.first + s;
+                    const double alpha = (1.0 + s) / (sampled.samples + 1);
+                    x0[i] = alpha * a[0] + (1 - alpha) * b[0];
+                    y0[i] = alpha * a[1] + (1 - alpha) * b[1];
+                    nx[i] = sampled.nx;
+                    ny[i] = sampled.ny;
+                }
+            }
+        }
+
+        // The padding lanes stay at (0, 0), which the bilinear sampler rejects
+        for (int plane = kX0; plane <= kNy; plane++) {
+            std::fill(Plane(plane) + count, Plane(plane) + padded, 0.0f);
+        }
+
+        const GrayImage image{gray.ptr<uint8_t>(0), gray.step[0], gray.cols, gray.rows};
+        HWY_NAMESPACE::__EdgeOffsets(x0, y0, nx, ny, padded, params_.search_range, image,
+                                     Plane(kOffset));
+
+        for (size_t q = 0; q < quads.size(); q++) {
+            Quad& quad = quads[q];
+
+            LineFit lines[4];
+            for (int edge = 0; edge < 4; edge++) {
+                lines[edge] = FitEdge(quad, edge, edges_[4 * q + edge]);
+            }
+
+            // Line i runs from corner i to corner i + 1, so lines i and i + 1 meet at corner i + 1
+            for (int i = 0; i < 4; i++) {
+                LineFit const& l0 = lines[i];
+                LineFit const& l1 = lines[(i + 1) & 3];
+
+                const double a00 = l0.ny;
+                const double a01 = -l1.ny;
+                const double a10 = -l0.nx;
+                const double a11 = l1.nx;
+                const double b0 = l1.ex - l0.ex;
+                const double b1 = l1.ey - l0.ey;
+
+                const double det = a00 * a11 - a10 * a01;
+                if (std::abs(det) > 0.001) {
+                    const double l = (a11 * b0 - a01 * b1) / det;
+                    quad.p[(i + 1) & 3][0] = static_cast<float>(l0.ex + l * a00);
+                    quad.p[(i + 1) & 3][1] = static_cast<float>(l0.ey + l * a10);
+                }
+            }
+        }
+    }
+
+   private:
+    struct Edge {
+        size_t first;
+        int samples;
+        float nx;
+        float ny;
+    };
+
+    enum Field { kX0, kY0, kNx, kNy, kOffset, kFields };
+
+    float* Plane(int field) {
+        return planes_.get() + field * capacity_;
+    }
+
+    void Reserve(size_t count) {
+        if (count > capacity_) {
+            planes_ = hwy::AllocateAligned<float>(count * kFields);
+            capacity_ = count;
+        }
+    }
+
+    // Line through the points found along an edge, the line between its corners when there are
+    // fewer than two
+    LineFit FitEdge(Quad const& quad, int edge, Edge const& sampled) {
+        const float* x0 = Plane(kX0);
+        const float* y0 = Plane(kY0);
+        const float* offsets = Plane(kOffset);
+
+        double mx = 0, my = 0, mxx = 0, mxy = 0, myy = 0;
+        size_t n = 0;
+        for (int s = 0; s < sampled.samples; s++) {
+            const size_t i = sampled.first + s;
+            if (std::isnan(offsets[i])) continue;
+
+            const double x = x0[i] + offsets[i] * sampled.nx;
+            const double y = y0[i] + offsets[i] * sampled.ny;
+            mx += x;
+            my += y;
+            mxx += x * x;
+            mxy += x * y;
+            myy += y * y;
+            n++;
+        }
+
+        if (n < 2) {
+            const float* a = quad.p[edge];
+            const float* b = quad.p[(edge + 1) & 3];
+            return LineFit{0.5 * (a[0] + b[0]), 0.5 * (a[1] + b[1]), sampled.nx, sampled.ny, 0, 0};
+        }
+        return FitLine(mx, my, mxx, mxy, myy, n, n);
+    }
+
+    EdgeRefinerParams params_;
+    std::vector<Edge> edges_;
+
+    // kFields planes of capacity_ floats, one sample point per element
+    hwy::AlignedFreeUniquePtr<float[]> planes_;
+    size_t capacity_ = 0;
+};
+
+}  // namespace simdtag
@@ -0,0 +1,294 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "fit_quads.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Returns a mask of the lanes where labels and neighbors differ, N labels from each
+inline auto __LabelChanges(const uint32_t* labels, const uint32_t* neighbors) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    return hw::LoadU(d, labels) != hw::LoadU(d, neighbors);
+}
+
+// Set the threshold pixels of every label that is not kept to the unknown gray 127, so no
+// gradient points are made for them. keep holds one 0 or 1 per label.
+inline void __PruneRow(uint8_t* threshold, const uint32_t* labels, const uint32_t* keep,
+                       int width) {
+    constexpr hw::ScalableTag<uint32_t> d;
+    constexpr hw::RebindToSigned<decltype(d)> di;
+    constexpr int N = hw::Lanes(d);
+    constexpr hw::FixedTag<uint8_t, N> d8;
+
+    const auto vgray = hw::Set(d, 127);
+
+    int x = 0;
+    for (; x + N <= width; x += N) {
+        const auto vlabels = hw::BitCast(di, hw::LoadU(d, labels + x));
+        const auto vkeep = hw::BitCast(
+                d, hw::GatherIndex(di, reinterpret_cast<const int32_t*>(keep), vlabels));
+        const auto mprune = vkeep == hw::Zero(d);
+        if (hw::AllFalse(d, mprune)) continue;
+
+        const auto vpixels = hw::PromoteTo(d, hw::LoadU(d8, threshold + x));
+        hw::StoreU(hw::DemoteTo(d8, hw::IfThenElse(mprune, vgray, vpixels)), d8, threshold + x);
+    }
+
+    for (; x < width; x++) {
+        if (!keep[labels[x]]) threshold[x] = 127;
+    }
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// Region adjacency graph of the black and white components of the BMRS label image, with the
+// shared boundary length of every adjacent pair. Used to drop components that can't be part of a
+// tag border before any gradient points are made. A normal tag border is a black ring enclosed by
+// a single white component with white holes for the data bits, a reversed border the same with
+// the colors swapped.
+//
+// Containment is decided from bounding boxes, which is exact for the enclosing component of a
+// ring: a neighbor whose box lies strictly inside a region's box is in one of its holes, every
+// other neighbor is outside of it.
+class RegionGraph {
+   public:
+    struct Region {
+        uint32_t x_min;
+        uint32_t x_max;
+        uint32_t y_min;
+        uint32_t y_max;
+        bool black;
+        bool touches_border;
+
+        // Strictly inside the bounding box of other
+        bool InsideOf(Region const& other) const {
+            return x_min > other.x_min && x_max < other.x_max && y_min > other.y_min &&
+                   y_max < other.y_max;
+        }
+    };
+
+    struct Edge {
+        uint32_t label_min;
+        uint32_t label_max;
+        uint32_t next;
+        uint32_t length;
+    };
+
+    // threshold holds 0, 127 or 255 as from AdaptiveThreshold, label_count as returned by
+    // BMRS::LabelCount()
+    void Build(cv::Mat1b const& threshold, cv::Mat1i const& labels, int label_count) {
+        constexpr hw::ScalableTag<uint32_t> d;
+        constexpr int N = hw::Lanes(d);
+
+        regions_.assign(label_count + 1, Region{UINT32_MAX, 0, UINT32_MAX, 0, false, false});
+        heads_.assign(label_count + 1, kNoEdge);
+        edges_.clear();
+        last_pair_ = kNoPair;
+
+        const int width = threshold.cols;
+        const int height = threshold.rows;
+
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = threshold.ptr<uint8_t>(y);
+            const uint32_t* label_row = labels.ptr<uint32_t>(y);
+            const uint32_t* label_below = y + 1 < height ? labels.ptr<uint32_t>(y + 1) : nullptr;
+
+            // The extremes of a region are always next to another label or the image border,
+            // so the bounding boxes only need the pixels where the label changes
+            auto change = [&](int x, int nx, int ny, uint32_t neighbor) {
+                AddPixel(x, y, label_row[x], row[x] == 0);
+                AddPixel(nx, ny, neighbor, threshold(ny, nx) == 0);
+                AddBoundary(label_row[x], neighbor);
+            };
+
+            for (int x : {0, width - 1}) {
+                AddPixel(x, y, label_row[x], row[x] == 0);
+                regions_[label_row[x]].touches_border = true;
+            }
+            if (y == 0 || y == height - 1) {
+                for (int x = 0; x < width; x++) {
+                    AddPixel(x, y, label_row[x], row[x] == 0);
+                    regions_[label_row[x]].touches_border = true;
+                }
+            }
+
+            // Horizontal neighbors, whole vectors of equal labels are skipped
+            int x = 0;
+            for (; x + N + 1 <= width; x += N) {
+                if (hw::AllFalse(d, HWY_NAMESPACE::__LabelChanges(label_row + x,
+                                                                  label_row + x + 1))) {
+                    continue;
+                }
+                for (int j = x; j < x + N; j++) {
+                    if (label_row[j] != label_row[j + 1]) change(j, j + 1, y, label_row[j + 1]);
+                }
+            }
+            for (; x + 1 < width; x++) {
+                if (label_row[x] != label_row[x + 1]) change(x, x + 1, y, label_row[x + 1]);
+            }
+
+            if (label_below == nullptr) continue;
+
+            // Vertical neighbors
+            x = 0;
+            for (; x + N <= width; x += N) {
+                if (hw::AllFalse(d, HWY_NAMESPACE::__LabelChanges(label_row + x,
+                                                                  label_below + x))) {
+                    continue;
+                }
+                for (int j = x; j < x + N; j++) {
+                    if (label_row[j] != label_below[j]) change(j, j, y + 1, label_below[j]);
+                }
+            }
+            for (; x < width; x++) {
+                if (label_row[x] != label_below[x]) change(x, x, y + 1, label_below[x]);
+            }
+        }
+    }
+
+    // Mark the components of every possible tag border as kept, returns how many borders were
+    // found. A border must be enclosed by a single region of the other color, have at least
+    // one hole and share at least min_cluster_points / 2 pixels of outline with the enclosing
+    // region, the same bound FitQuads puts on the cluster.
+    size_t SelectTagBorders(FitQuadsParams const& params) {
+        const size_t count = regions_.size();
+        outer_.assign(count, kNoEdge);
+        outer_count_.assign(count, 0);
+        holes_.assign(count, 0);
+        keep_.assign(count, 0);
+
+        for (uint32_t id = 0; id < edges_.size(); id++) {
+            Edge const& edge = edges_[id];
+            Classify(edge.label_min, edge.label_max, id);
+            Classify(edge.label_max, edge.label_min, id);
+        }
+
+        const uint32_t min_boundary = params.min_cluster_points / 2;
+
+        size_t borders = 0;
+        for (uint32_t label = 1; label < count; label++) {
+            Region const& region = regions_[label];
+            const bool wanted = region.black ? params.normal_border : params.reversed_border;
+            if (!wanted || region.touches_border || outer_count_[label] != 1 ||
+                holes_[label] == 0) {
+                continue;
+            }
+
+            Edge const& outer = edges_[outer_[label]];
+            if (outer.length < min_boundary) {
+                continue;
+            }
+
+            keep_[outer.label_min] = 1;
+            keep_[outer.label_max] = 1;
+            borders++;
+        }
+
+        return borders;
+    }
+
+    // Set every pixel of threshold outside the kept components to the unknown gray, after
+    // SelectTagBorders. GradientClusters then only makes points along possible tag borders.
+    void Prune(cv::Mat1b& threshold, cv::Mat1i const& labels) const {
+        assert(keep_.size() == regions_.size());
+
+        for (int y = 0; y < threshold.rows; y++) {
+            HWY_NAMESPACE::__PruneRow(threshold.ptr<uint8_t>(y), labels.ptr<uint32_t>(y),
+                                      keep_.data(), threshold.cols);
+        }
+    }
+
+    Region const& GetRegion(uint32_t label) const {
+        return regions_[label];
+    }
+
+    std::vector<Edge> const& Edges() const {
+        return edges_;
+    }
+
+    bool IsKept(uint32_t label) const {
+        return keep_[label];
+    }
+
+   private:
+    static constexpr uint32_t kNoEdge = 0xFFFFFFFFu;
+    static constexpr uint64_t kNoPair = 0xFFFFFFFFFFFFFFFFull;
+
+    void AddPixel(int x, int y, uint32_t label, bool black) {
+        Region& region = regions_[label];
+        region.x_min = std::min<uint32_t>(region.x_min, x);
+        region.x_max = std::max<uint32_t>(region.x_max, x);
+        region.y_min = std::min<uint32_t>(region.y_min, y);
+        region.y_max = std::max<uint32_t>(region.y_max, y);
+        region.black = black;
+    }
+
+    // One more pixel of shared outline, same adjacency lists as LabelClusterStore. Label 0 is
+    // the unknown gray and never has edges.
+    void AddBoundary(uint32_t a, uint32_t b) {
+        if (a == 0 || b == 0) return;
+
+        const uint32_t label_min = std::min(a, b);
+        const uint32_t label_max = std::max(a, b);
+        const uint64_t pair = static_cast<uint64_t>(label_min) << 32 | label_max;
+
+        if (pair != last_pair_) {
+            uint32_t id = heads_[label_min];
+            while (id != kNoEdge && edges_[id].label_max != label_max) {
+                id = edges_[id].next;
+            }
+
+            if (id == kNoEdge) {
+                id = edges_.size();
+                edges_.push_back({label_min, label_max, heads_[label_min], 0});
+                heads_[label_min] = id;
+            }
+
+            last_pair_ = pair;
+            last_id_ = id;
+        }
+
+        edges_[last_id_].length++;
+    }
+
+    // Neighbor is either in a hole of label or one of the regions around it
+    void Classify(uint32_t label, uint32_t neighbor, uint32_t edge) {
+        if (regions_[neighbor].InsideOf(regions_[label])) {
+            holes_[label]++;
+        } else {
+            outer_count_[label]++;
+            outer_[label] = edge;
+        }
+    }
+
+    std::vector<Region> regions_;
+    std::vector<uint32_t> heads_;
+    std::vector<Edge> edges_;
+    uint64_t last_pair_ = kNoPair;
+    uint32_t last_id_ = 0;
+
+    // Per label results of SelectTagBorders, keep_ is 32 bits for the gather in Prune
+    std::vector<uint32_t> outer_;
+    std::vector<uint32_t> outer_count_;
+    std::vector<uint32_t> holes_;
+    std::vector<uint32_t> keep_;
+};
+
+}  // namespace simdtag
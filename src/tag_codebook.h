@@ -0,0 +1,91 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+
+// clang-format on
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+#include "tag_family.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// Entries per rotation of a codebook, padded to the widest vector of 64-bit lanes
+constexpr size_t CodebookStride(size_t ncodes) {
+    return (ncodes + 7) / 8 * 8;
+}
+
+// Padding entry, at least 64 - nbits bits away from any code so it never matches
+inline constexpr uint64_t kNoCode = ~uint64_t{0};
+
+// The codes of a family as read with each of the four rotations: entry rotation * stride + id is
+// the code id turned back by rotation quarters, so a code read from an image turned rotation
+// quarters past upright matches it exactly. out holds 4 * CodebookStride(codes.size()) entries.
+constexpr void FillCodebook(std::span<const uint64_t> codes, int nbits, std::span<uint64_t> out) {
+    const size_t stride = CodebookStride(codes.size());
+    for (auto& entry : out) {
+        entry = kNoCode;
+    }
+
+    for (size_t id = 0; id < codes.size(); id++) {
+        uint64_t code = codes[id];
+        for (int rotation = 0; rotation < 4; rotation++) {
+            out[((4 - rotation) & 3) * stride + id] = code;
+            code = Rotate90(code, nbits);
+        }
+    }
+}
+
+// Rotation expanded codebook built at compile time, see FillCodebook. Replaces the apriltag
+// quick decode table, which is built at startup with every code within the Hamming threshold.
+template <size_t kCodes>
+constexpr auto MakeCodebook(const uint64_t (&codes)[kCodes], int nbits) {
+    std::array<uint64_t, 4 * CodebookStride(kCodes)> codebook{};
+    FillCodebook(codes, nbits, codebook);
+    return codebook;
+}
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Closest entry of a codebook to code by Hamming distance, the lowest index on ties. Every entry
+// is compared with XOR and popcount, N at a time, so the latency doesn't depend on the code.
+// Returns the index and the distance.
+inline std::pair<size_t, int> __MatchCode(std::span<const uint64_t> codebook, uint64_t code) {
+    constexpr hw::ScalableTag<uint64_t> d;
+    constexpr int N = hw::Lanes(d);
+    assert(codebook.size() % N == 0);
+
+    const auto vcode = hw::Set(d, code);
+    const auto vstep = hw::Set(d, N);
+    auto vindex = hw::Iota(d, 0);
+    auto vbest = hw::Set(d, 65);
+    auto vbest_index = hw::Zero(d);
+
+    for (size_t i = 0; i < codebook.size(); i += N) {
+        const auto vdistance = hw::PopulationCount(hw::LoadU(d, codebook.data() + i) ^ vcode);
+        const auto mbetter = hw::Lt(vdistance, vbest);
+        vbest = hw::IfThenElse(mbetter, vdistance, vbest);
+        vbest_index = hw::IfThenElse(mbetter, vindex, vbest_index);
+        vindex = vindex + vstep;
+    }
+
+    const auto vmin = hw::MinOfLanes(d, vbest);
+    const auto vcandidates = hw::IfThenElse(hw::Eq(vbest, vmin), vbest_index, hw::Set(d, kNoCode));
+    const auto vfirst = hw::MinOfLanes(d, vcandidates);
+    return {hw::GetLane(vfirst), static_cast<int>(hw::GetLane(vmin))};
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+}  // namespace simdtag
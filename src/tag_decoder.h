@@ -0,0 +1,510 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+#include <hwy/aligned_allocator.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <opencv2/core.hpp>
+#include <tuple>
+#include <vector>
+
+#include "homography.h"
+#include "line_fit.h"
+#include "quad.h"
+#include "tag_codebook.h"
+#include "tag_family.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// A decoded tag, the fields of apriltag_detection_t
+struct Detection {
+    const TagFamily* family;
+    int id;
+    int hamming;
+
+    // How far the bits were from the threshold on average, lower is less certain
+    float decision_margin;
+
+    // Rotated so that the code reads upright, as apriltag
+    Homography H;
+
+    // Center and corners in pixels. As in apriltag the corners are at tag coordinates (-1, 1),
+    // (1, 1), (1, -1) and (-1, -1).
+    double c[2];
+    double p[4][2];
+};
+
+struct TagDecoderParams {
+    // Most bit errors accepted for a code, apriltag's bits_corrected
+    int max_hamming = 2;
+
+    // Weight of the laplacian added to the bit values before they are read
+    float decode_sharpening = 0.25f;
+};
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// Pixel at the truncated coordinates, how apriltag samples the gray model. mvalid is set for the
+// lanes inside of the image, the others read the first pixel. Bytes are gathered as 32-bit words
+// at byte offsets, from below for the last three bytes of the image so the reads stay inside.
+inline auto __SampleNearest(hw::VFromD<hw::ScalableTag<float>> vpx,
+                            hw::VFromD<hw::ScalableTag<float>> vpy, GrayImage const& image,
+                            hw::MFromD<hw::ScalableTag<float>>& mvalid) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr hw::RebindToSigned<decltype(dfloat)> di;
+    constexpr hw::RebindToUnsigned<decltype(dfloat)> du;
+
+    // (int)px >= 0 for px > -1, NaN lanes of a degenerate homography fail every compare
+    const auto vminus_one = hw::Set(dfloat, -1.0f);
+    mvalid = hw::And(hw::Gt(vpx, vminus_one), hw::Lt(vpx, hw::Set(dfloat, image.width)));
+    mvalid = hw::And(mvalid, hw::Gt(vpy, vminus_one));
+    mvalid = hw::And(mvalid, hw::Lt(vpy, hw::Set(dfloat, image.height)));
+
+    const auto vstride = hw::Set(di, static_cast<int32_t>(image.stride));
+    const auto voffset = hw::IfThenElseZero(
+            hw::RebindMask(di, mvalid),
+            hw::MulAdd(hw::ConvertTo(di, vpy), vstride, hw::ConvertTo(di, vpx)));
+
+    const int32_t last = (image.height - 1) * image.stride + image.width - 1;
+    const auto mtail = hw::Gt(voffset, hw::Set(di, last - 3));
+    const auto vword = hw::GatherOffset(di, reinterpret_cast<const int32_t*>(image.data),
+                                        hw::IfThenElse(mtail, voffset - hw::Set(di, 3), voffset));
+    const auto vshift = hw::BitCast(du, hw::IfThenElseZero(mtail, hw::Set(di, 24)));
+    const auto vpixel = hw::Shr(hw::BitCast(du, vword), vshift) & hw::Set(du, 0xFF);
+
+    return hw::ConvertTo(dfloat, hw::BitCast(di, vpixel));
+}
+
+// apriltag value_for_pixel, the bilinear interpolation between the four pixel centers around
+// (px, py), in 8-bit fixed point weights. mvalid is set for the lanes with all four pixels in the
+// image. The top pair is gathered as one word at its offset and the bottom pair as one word
+// ending at it, so neither read leaves the image.
+inline auto __SampleBilinear(hw::VFromD<hw::ScalableTag<float>> vpx,
+                             hw::VFromD<hw::ScalableTag<float>> vpy, GrayImage const& image,
+                             hw::MFromD<hw::ScalableTag<float>>& mvalid) {
+    constexpr hw::ScalableTag<float> dfloat;
+    constexpr hw::RebindToSigned<decltype(dfloat)> di;
+    constexpr hw::RebindToUnsigned<decltype(dfloat)> du;
+
+    const auto vhalf = hw::Set(dfloat, 0.5f);
+    const auto vx = vpx - vhalf;
+    const auto vy = vpy - vhalf;
+    const auto vfloor_x = hw::Floor(vx);
+    const auto vfloor_y = hw::Floor(vy);
+
+    // apriltag takes ceil for the second pixel, which only differs with a weight of 0
+    mvalid = hw::And(hw::Ge(vx, hw::Zero(dfloat)), hw::Lt(vx, hw::Set(dfloat, image.width - 1)));
+    mvalid = hw::And(mvalid, hw::Ge(vy, hw::Zero(dfloat)));
+    mvalid = hw::And(mvalid, hw::Lt(vy, hw::Set(dfloat, image.height - 1)));
+
+    const auto vfixed = hw::Set(dfloat, 256.0f);
+    const auto vwx = hw::NearestInt((vx - vfloor_x) * vfixed);
+    const auto vwy = hw::NearestInt((vy - vfloor_y) * vfixed);
+
+    const auto vstride = hw::Set(di, static_cast<int32_t>(image.stride));
+    const auto voffset = hw::IfThenElseZero(
+            hw::RebindMask(di, mvalid),
+            hw::MulAdd(hw::ConvertTo(di, vfloor_y), vstride, hw::ConvertTo(di, vfloor_x)));
+
+    const int32_t* base = reinterpret_cast<const int32_t*>(image.data);
+    const auto vtop = hw::BitCast(du, hw::GatherOffset(di, base, voffset));
+    const auto vbottom =
+            hw::BitCast(du, hw::GatherOffset(di, base, voffset + vstride - hw::Set(di, 2)));
+
+    const auto vbyte = hw::Set(du, 0xFF);
+    const auto p00 = hw::BitCast(di, vtop & vbyte);
+    const auto p01 = hw::BitCast(di, hw::ShiftRight<8>(vtop) & vbyte);
+    const auto p10 = hw::BitCast(di, hw::ShiftRight<16>(vbottom) & vbyte);
+    const auto p11 = hw::BitCast(di, hw::ShiftRight<24>(vbottom));
+
+    // At most 255 * 256 * 256, no overflow
+    const auto vone = hw::Set(di, 256);
+    const auto vupper = p00 * (vone - vwx) + p01 * vwx;
+    const auto vlower = p10 * (vone - vwx) + p11 * vwx;
+    const auto vsum = vupper * (vone - vwy) + vlower * vwy;
+
+    return hw::ConvertTo(dfloat, vsum) * hw::Set(dfloat, 1.0f / 65536.0f);
+}
+
+// apriltag graymodel, a least squares plane gray = c0 * x + c1 * y + c2 over tag coordinates,
+// one quad per lane
+struct __GrayModel {
+    using V = hw::VFromD<hw::ScalableTag<float>>;
+    using M = hw::MFromD<hw::ScalableTag<float>>;
+
+    V xx, xy, x, yy, y, n, bx, by, b;
+    V c0, c1, c2;
+
+    __GrayModel() {
+        constexpr hw::ScalableTag<float> d;
+        xx = xy = x = yy = y = n = bx = by = b = hw::Zero(d);
+        c0 = c1 = c2 = hw::Zero(d);
+    }
+
+    void Add(float tx, float ty, V gray, M mvalid) {
+        constexpr hw::ScalableTag<float> d;
+        const auto vone = hw::IfThenElseZero(mvalid, hw::Set(d, 1.0f));
+        const auto vgray = hw::IfThenElseZero(mvalid, gray);
+
+        xx = hw::MulAdd(vone, hw::Set(d, tx * tx), xx);
+        xy = hw::MulAdd(vone, hw::Set(d, tx * ty), xy);
+        x = hw::MulAdd(vone, hw::Set(d, tx), x);
+        yy = hw::MulAdd(vone, hw::Set(d, ty * ty), yy);
+        y = hw::MulAdd(vone, hw::Set(d, ty), y);
+        n = n + vone;
+        bx = hw::MulAdd(vgray, hw::Set(d, tx), bx);
+        by = hw::MulAdd(vgray, hw::Set(d, ty), by);
+        b = b + vgray;
+    }
+
+    // The symmetric 3x3 normal equations by their adjugate, apriltag uses a cholesky solve.
+    // Returns the lanes with a solution.
+    M Solve() {
+        constexpr hw::ScalableTag<float> d;
+        const auto i00 = hw::MulSub(yy, n, y * y);
+        const auto i01 = hw::MulSub(x, y, xy * n);
+        const auto i02 = hw::MulSub(xy, y, x * yy);
+        const auto i11 = hw::MulSub(xx, n, x * x);
+        const auto i12 = hw::MulSub(xy, x, xx * y);
+        const auto i22 = hw::MulSub(xx, yy, xy * xy);
+        const auto det = hw::MulAdd(xx, i00, hw::MulAdd(xy, i01, x * i02));
+
+        const auto mvalid = hw::Ne(det, hw::Zero(d));
+        const auto vinv = hw::IfThenElseZero(mvalid, hw::Set(d, 1.0f) / det);
+        c0 = hw::MulAdd(i00, bx, hw::MulAdd(i01, by, i02 * b)) * vinv;
+        c1 = hw::MulAdd(i01, bx, hw::MulAdd(i11, by, i12 * b)) * vinv;
+        c2 = hw::MulAdd(i02, bx, hw::MulAdd(i12, by, i22 * b)) * vinv;
+        return mvalid;
+    }
+
+    V Interpolate(float tx, float ty) const {
+        constexpr hw::ScalableTag<float> d;
+        return hw::MulAdd(c0, hw::Set(d, tx), hw::MulAdd(c1, hw::Set(d, ty), c2));
+    }
+};
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// Reads the codes of fitted quads from the grayscale frame, the apriltag quad_decode stage. Quads
+// are decoded in batches of one quad per float lane: each sample point of the tag is projected
+// through every homography of the batch at once and the pixels gathered together, so the cache
+// misses of the different quads overlap. Keep one decoder per thread, the planes only grow.
+class TagDecoder {
+   public:
+    explicit TagDecoder(TagFamily const& family, TagDecoderParams const& params = {})
+        : family_(family), params_(params) {
+        assert(family.bit_x.size() == static_cast<size_t>(family.nbits));
+        assert(family.bit_y.size() == static_cast<size_t>(family.nbits));
+        // With a one cell border all black samples fall on one point per edge and the gray model
+        // is singular, apriltag special cases it. None of the generated families need it.
+        assert(family.width_at_border > 1);
+        constexpr hw::ScalableTag<float> d;
+
+        // Samples of the gray model, both sides of each edge of the black border. As in apriltag
+        // the corners are counted twice.
+        const float border = family.width_at_border;
+        const struct {
+            float x0, y0, dx, dy;
+            bool white;
+        } patterns[] = {
+                {-0.5f, 0.5f, 0, 1, true},          {0.5f, 0.5f, 0, 1, false},
+                {border + 0.5f, 0.5f, 0, 1, true},  {border - 0.5f, 0.5f, 0, 1, false},
+                {0.5f, -0.5f, 1, 0, true},          {0.5f, 0.5f, 1, 0, false},
+                {0.5f, border + 0.5f, 1, 0, true},  {0.5f, border - 0.5f, 1, 0, false},
+        };
+
+        for (auto const& pattern : patterns) {
+            for (int i = 0; i < family.width_at_border; i++) {
+                border_samples_.push_back({TagCoordinate(pattern.x0 + i * pattern.dx),
+                                           TagCoordinate(pattern.y0 + i * pattern.dy),
+                                           pattern.white});
+            }
+        }
+
+        // Cell of each bit in the total_width grid that gets sharpened
+        const int min_coord = (family.width_at_border - family.total_width) / 2;
+        for (int i = 0; i < family.nbits; i++) {
+            const int bx = family.bit_x[i];
+            const int by = family.bit_y[i];
+            bit_samples_.push_back({TagCoordinate(bx + 0.5f), TagCoordinate(by + 0.5f),
+                                    (by - min_coord) * family.total_width + bx - min_coord});
+        }
+
+        // Families made at runtime get their codebook here
+        if (family.codebook.empty()) {
+            codebook_.resize(4 * CodebookStride(family.codes.size()));
+            FillCodebook(family.codes, family.nbits, codebook_);
+            family_.codebook = codebook_;
+        }
+
+        const size_t cells = family.total_width * family.total_width;
+        values_ = hwy::AllocateAligned<float>(cells * hw::Lanes(d));
+        sharpened_ = hwy::AllocateAligned<float>(cells * hw::Lanes(d));
+    }
+
+    // family_ may point into codebook_, a copy would keep pointing into the original. Moving
+    // the vector keeps its buffer.
+    TagDecoder(TagDecoder const&) = delete;
+    TagDecoder& operator=(TagDecoder const&) = delete;
+    TagDecoder(TagDecoder&&) = default;
+    TagDecoder& operator=(TagDecoder&&) = default;
+
+    // Decode the quads found in gray, for quads with the border polarity of the family.
+    // Detections are replaced.
+    void Decode(cv::Mat1b const& gray, std::vector<Quad> const& quads,
+                std::vector<Detection>& detections) {
+        constexpr hw::ScalableTag<float> d;
+        constexpr int N = hw::Lanes(d);
+
+        detections.clear();
+        if (quads.empty()) return;
+
+        const GrayImage image{gray.ptr<uint8_t>(0), gray.step[0], gray.cols, gray.rows};
+
+        const size_t stride = hwy::RoundUpTo(quads.size(), N);
+        if (stride > capacity_) {
+            homographies_ = hwy::AllocateAligned<double>(9 * stride);
+            capacity_ = stride;
+        }
+        HWY_NAMESPACE::__QuadHomographies(quads.data(), quads.size(), homographies_.get(),
+                                          capacity_);
+
+        for (size_t i = 0; i < quads.size(); i += N) {
+            DecodeBatch(image, quads, i, detections);
+        }
+    }
+
+   private:
+    struct Sample {
+        float x;
+        float y;
+        bool white;
+    };
+
+    struct BitSample {
+        float x;
+        float y;
+        int cell;
+    };
+
+    // Cell coordinate to [-1, 1] over the border
+    float TagCoordinate(float v) const {
+        return 2.0f * (v / family_.width_at_border - 0.5f);
+    }
+
+    void DecodeBatch(GrayImage const& image, std::vector<Quad> const& quads, size_t first,
+                     std::vector<Detection>& detections) {
+        constexpr hw::ScalableTag<float> d;
+        constexpr hw::ScalableTag<double> ddouble;
+        constexpr hw::Rebind<float, decltype(ddouble)> dhalf;
+        constexpr int N = hw::Lanes(d);
+        constexpr int ND = hw::Lanes(ddouble);
+
+        // The homographies of the batch in float, plenty for pixel coordinates
+        HWY_ALIGN float h[9][N];
+        for (int k = 0; k < 9; k++) {
+            for (int j = 0; j < N; j += ND) {
+                const auto v = hw::Load(ddouble, homographies_.get() + k * capacity_ + first + j);
+                hw::Store(hw::DemoteTo(dhalf, v), dhalf, h[k] + j);
+            }
+        }
+
+        const auto h00 = hw::Load(d, h[0]);
+        const auto h01 = hw::Load(d, h[1]);
+        const auto h02 = hw::Load(d, h[2]);
+        const auto h10 = hw::Load(d, h[3]);
+        const auto h11 = hw::Load(d, h[4]);
+        const auto h12 = hw::Load(d, h[5]);
+        const auto h20 = hw::Load(d, h[6]);
+        const auto h21 = hw::Load(d, h[7]);
+        const auto h22 = hw::Load(d, h[8]);
+
+        auto project = [&](float tx, float ty, auto& vpx, auto& vpy) {
+            const auto vtx = hw::Set(d, tx);
+            const auto vty = hw::Set(d, ty);
+            const auto vinv = hw::Set(d, 1.0f) / hw::MulAdd(h20, vtx, hw::MulAdd(h21, vty, h22));
+            vpx = hw::MulAdd(h00, vtx, hw::MulAdd(h01, vty, h02)) * vinv;
+            vpy = hw::MulAdd(h10, vtx, hw::MulAdd(h11, vty, h12)) * vinv;
+        };
+
+        // Gray model fit on the pixels just inside and outside of the border
+        HWY_NAMESPACE::__GrayModel white;
+        HWY_NAMESPACE::__GrayModel black;
+        for (Sample const& sample : border_samples_) {
+            hw::Vec<decltype(d)> vpx, vpy;
+            project(sample.x, sample.y, vpx, vpy);
+
+            hw::Mask<decltype(d)> mvalid;
+            const auto vgray = HWY_NAMESPACE::__SampleNearest(vpx, vpy, image, mvalid);
+            (sample.white ? white : black).Add(sample.x, sample.y, vgray, mvalid);
+        }
+
+        auto mdecode = hw::And(white.Solve(), black.Solve());
+        mdecode = hw::And(mdecode, hw::FirstN(d, quads.size() - first));
+
+        // The border has to have the polarity of the family
+        const auto mnormal = hw::Ge(white.Interpolate(0, 0), black.Interpolate(0, 0));
+        mdecode = hw::And(mdecode, family_.reversed_border ? hw::Not(mnormal) : mnormal);
+        if (hw::AllFalse(d, mdecode)) return;
+
+        // Bit values relative to the local threshold between the two models, 0 when the sample
+        // is outside of the image
+        const size_t cells = family_.total_width * family_.total_width;
+        std::fill(values_.get(), values_.get() + cells * N, 0.0f);
+
+        const auto vhalf = hw::Set(d, 0.5f);
+        for (BitSample const& sample : bit_samples_) {
+            hw::Vec<decltype(d)> vpx, vpy;
+            project(sample.x, sample.y, vpx, vpy);
+
+            hw::Mask<decltype(d)> mvalid;
+            const auto vgray = HWY_NAMESPACE::__SampleBilinear(vpx, vpy, image, mvalid);
+            const auto vblack = black.Interpolate(sample.x, sample.y);
+            const auto vthreshold = (vblack + white.Interpolate(sample.x, sample.y)) * vhalf;
+            hw::Store(hw::IfThenElseZero(mvalid, vgray - vthreshold), d,
+                      values_.get() + sample.cell * N);
+        }
+
+        Sharpen();
+
+        // Read the bits, a value of 0 reads as black as in apriltag
+        const auto vone = hw::Set(d, 1.0f);
+        auto vwhite_score = hw::Zero(d);
+        auto vblack_score = hw::Zero(d);
+        auto vwhite_count = hw::Zero(d);
+        auto vblack_count = hw::Zero(d);
+
+        uint64_t codes[N] = {};
+        for (BitSample const& sample : bit_samples_) {
+            const auto v = hw::Load(d, values_.get() + sample.cell * N);
+            const auto mwhite = hw::Gt(v, hw::Zero(d));
+            vwhite_score = vwhite_score + hw::IfThenElseZero(mwhite, v);
+            vwhite_count = vwhite_count + hw::IfThenElseZero(mwhite, vone);
+            vblack_score = vblack_score - hw::IfThenZeroElse(mwhite, v);
+            vblack_count = vblack_count + hw::IfThenZeroElse(mwhite, vone);
+
+            uint8_t bytes[8] = {};
+            hw::StoreMaskBits(d, mwhite, bytes);
+            uint64_t bits;
+            std::memcpy(&bits, bytes, sizeof(bits));
+            for (int lane = 0; lane < N; lane++) {
+                codes[lane] = codes[lane] << 1 | ((bits >> lane) & 1);
+            }
+        }
+
+        // The lower of the two average scores as in apriltag. With bits of one color only the
+        // other average is NaN there, so fmin returns the one that exists.
+        const auto mwhite_bits = hw::Gt(vwhite_count, hw::Zero(d));
+        const auto mblack_bits = hw::Gt(vblack_count, hw::Zero(d));
+        const auto vwhite_margin = vwhite_score / hw::Max(vwhite_count, vone);
+        const auto vblack_margin = vblack_score / hw::Max(vblack_count, vone);
+        const auto vmargin = hw::IfThenElse(
+                mwhite_bits, hw::IfThenElse(mblack_bits, hw::Min(vwhite_margin, vblack_margin),
+                                            vwhite_margin),
+                vblack_margin);
+
+        HWY_ALIGN float margins[N];
+        hw::Store(vmargin, d, margins);
+
+        uint8_t decode_bytes[8] = {};
+        hw::StoreMaskBits(d, mdecode, decode_bytes);
+        uint64_t decode_bits;
+        std::memcpy(&decode_bits, decode_bytes, sizeof(decode_bits));
+
+        for (int lane = 0; lane < N; lane++) {
+            const size_t index = first + lane;
+            if (!((decode_bits >> lane) & 1) || margins[lane] < 0.0f ||
+                quads[index].reversed_border != family_.reversed_border) {
+                continue;
+            }
+
+            int id, hamming, rotation;
+            if (!Match(codes[lane], id, hamming, rotation)) continue;
+
+            Homography quad_h;
+            for (int k = 0; k < 9; k++) {
+                quad_h.h[k / 3][k % 3] = homographies_[k * capacity_ + index];
+            }
+
+            Detection& detection = detections.emplace_back();
+            detection.family = &family_;
+            detection.id = id;
+            detection.hamming = hamming;
+            detection.decision_margin = margins[lane];
+            detection.H = quad_h.Rotated(rotation);
+
+            std::tie(detection.c[0], detection.c[1]) = detection.H.Project(0, 0);
+            for (int k = 0; k < 4; k++) {
+                const double tx = (k == 1 || k == 2) ? 1 : -1;
+                const double ty = k < 2 ? 1 : -1;
+                std::tie(detection.p[k][0], detection.p[k][1]) = detection.H.Project(tx, ty);
+            }
+        }
+    }
+
+    // apriltag sharpen, the value grid plus decode_sharpening times its laplacian. Every cell
+    // holds one plane of lanes, so the stencil runs on the whole batch at once.
+    void Sharpen() {
+        constexpr hw::ScalableTag<float> d;
+        constexpr int N = hw::Lanes(d);
+        const int size = family_.total_width;
+
+        auto plane = [&](int x, int y) { return values_.get() + (y * size + x) * N; };
+
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                auto v = hw::Load(d, plane(x, y)) * hw::Set(d, 4.0f);
+                if (x > 0) v = v - hw::Load(d, plane(x - 1, y));
+                if (x + 1 < size) v = v - hw::Load(d, plane(x + 1, y));
+                if (y > 0) v = v - hw::Load(d, plane(x, y - 1));
+                if (y + 1 < size) v = v - hw::Load(d, plane(x, y + 1));
+                hw::Store(v, d, sharpened_.get() + (y * size + x) * N);
+            }
+        }
+
+        const auto vsharpening = hw::Set(d, params_.decode_sharpening);
+        for (int i = 0; i < size * size * N; i += N) {
+            const auto v = hw::Load(d, values_.get() + i);
+            hw::Store(hw::MulAdd(hw::Load(d, sharpened_.get() + i), vsharpening, v), d,
+                      values_.get() + i);
+        }
+    }
+
+    // Closest code of the family over the four rotations, within max_hamming
+    bool Match(uint64_t code, int& id, int& hamming, int& rotation) const {
+        const auto [index, distance] = HWY_NAMESPACE::__MatchCode(family_.codebook, code);
+        const size_t stride = family_.codebook.size() / 4;
+        id = index % stride;
+        rotation = index / stride;
+        hamming = distance;
+        return hamming <= params_.max_hamming;
+    }
+
+    TagFamily family_;
+    TagDecoderParams params_;
+    std::vector<uint64_t> codebook_;
+
+    std::vector<Sample> border_samples_;
+    std::vector<BitSample> bit_samples_;
+
+    // 9 planes of capacity_ doubles, see __QuadHomographies
+    hwy::AlignedFreeUniquePtr<double[]> homographies_;
+    size_t capacity_ = 0;
+
+    // One plane of lanes per cell of the total_width grid
+    hwy::AlignedFreeUniquePtr<float[]> values_;
+    hwy::AlignedFreeUniquePtr<float[]> sharpened_;
+};
+
+}  // namespace simdtag
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+namespace simdtag {
+
+// Layout and codebook of a tag family, the same fields as apriltag_family_t. Bit i of a code is
+// the cell at (bit_x[i], bit_y[i]), counted in cells from the outer corner of the black border,
+// and is the (nbits - 1 - i)th bit of the code. Coordinates can be negative for families with
+// data bits outside the border, such as tagStandard41h12. The codebook is the rotation expanded
+// table of tag_codebook.h, the generated families have it built at compile time.
+struct TagFamily {
+    const char* name;
+    std::span<const uint64_t> codes;
+    std::span<const int8_t> bit_x;
+    std::span<const int8_t> bit_y;
+    int nbits;
+    int h;
+    int width_at_border;
+    int total_width;
+    bool reversed_border;
+    std::span<const uint64_t> codebook = {};
+};
+
+// The code of a tag turned by a quarter, as apriltag rotate90. Families with 4k + 1 bits keep
+// the center bit in place.
+constexpr uint64_t Rotate90(uint64_t w, int nbits) {
+    int p = nbits;
+    uint64_t l = 0;
+    if (nbits % 4 == 1) {
+        p = nbits - 1;
+        l = 1;
+    }
+    w = ((w >> l) << (p / 4 + l)) | (w >> (3 * p / 4 + l) << l) | (w & l);
+    return w & ((uint64_t{1} << nbits) - 1);
+}
+
+}  // namespace simdtag
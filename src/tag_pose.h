@@ -0,0 +1,675 @@
+#pragma once
+
+// clang-format off
+
+#include <hwy/highway.h>
+
+// clang-format on
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "tag_decoder.h"
+
+namespace hw = hwy::HWY_NAMESPACE;
+
+namespace simdtag {
+
+// Camera and tag for PoseEstimator, the fields of apriltag_detection_info_t
+struct TagPoseParams {
+    // Edge of the black border, the pose translation has the same unit
+    double tagsize;
+
+    // Camera intrinsics in pixels
+    double fx;
+    double fy;
+    double cx;
+    double cy;
+
+    // Orthogonal iteration steps for each of the two solutions, as apriltag estimate_tag_pose
+    int iterations = 50;
+};
+
+// Pose of the tag in the camera frame as apriltag_pose_t, with the object space error of the
+// solution that was kept
+struct TagPose {
+    double R[3][3];
+    double t[3];
+    double error;
+};
+
+HWY_BEFORE_NAMESPACE();
+namespace HWY_NAMESPACE {
+
+// 3-vectors and 3x3 matrices with one detection per lane, element m[row][col]
+using __VD = hw::VFromD<hw::ScalableTag<double>>;
+
+struct __Vec3 {
+    __VD v[3];
+};
+
+struct __Mat3 {
+    __VD m[3][3];
+};
+
+inline __VD __Dot(__Vec3 const& a, __Vec3 const& b) {
+    return hw::MulAdd(a.v[0], b.v[0], hw::MulAdd(a.v[1], b.v[1], a.v[2] * b.v[2]));
+}
+
+inline __Vec3 __Cross(__Vec3 const& a, __Vec3 const& b) {
+    return {{hw::MulSub(a.v[1], b.v[2], a.v[2] * b.v[1]),
+             hw::MulSub(a.v[2], b.v[0], a.v[0] * b.v[2]),
+             hw::MulSub(a.v[0], b.v[1], a.v[1] * b.v[0])}};
+}
+
+inline __Vec3 __Add(__Vec3 const& a, __Vec3 const& b) {
+    return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2]}};
+}
+
+inline __Vec3 __Sub(__Vec3 const& a, __Vec3 const& b) {
+    return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2]}};
+}
+
+inline __Vec3 __Scale(__Vec3 const& a, __VD s) {
+    return {{a.v[0] * s, a.v[1] * s, a.v[2] * s}};
+}
+
+inline __Vec3 __Normalize(__Vec3 const& a) {
+    return __Scale(a, hw::Set(hw::DFromV<__VD>(), 1.0) / hw::Sqrt(__Dot(a, a)));
+}
+
+inline __Vec3 __Mul(__Mat3 const& m, __Vec3 const& a) {
+    __Vec3 out;
+    for (int row = 0; row < 3; row++) {
+        out.v[row] = hw::MulAdd(m.m[row][0], a.v[0],
+                                hw::MulAdd(m.m[row][1], a.v[1], m.m[row][2] * a.v[2]));
+    }
+    return out;
+}
+
+// m^T a
+inline __Vec3 __MulTransposed(__Mat3 const& m, __Vec3 const& a) {
+    __Vec3 out;
+    for (int col = 0; col < 3; col++) {
+        out.v[col] = hw::MulAdd(m.m[0][col], a.v[0],
+                                hw::MulAdd(m.m[1][col], a.v[1], m.m[2][col] * a.v[2]));
+    }
+    return out;
+}
+
+inline __Mat3 __Mul(__Mat3 const& a, __Mat3 const& b) {
+    __Mat3 out;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            out.m[row][col] = hw::MulAdd(a.m[row][0], b.m[0][col],
+                                         hw::MulAdd(a.m[row][1], b.m[1][col],
+                                                    a.m[row][2] * b.m[2][col]));
+        }
+    }
+    return out;
+}
+
+inline __Mat3 __Transpose(__Mat3 const& a) {
+    __Mat3 out;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            out.m[row][col] = a.m[col][row];
+        }
+    }
+    return out;
+}
+
+// Rotation about z, or about y for the ambiguity, from a cosine and sine
+inline __Mat3 __RotationZ(__VD c, __VD s) {
+    const auto zero = hw::Zero(hw::DFromV<__VD>());
+    const auto one = hw::Set(hw::DFromV<__VD>(), 1.0);
+    return {{{c, hw::Neg(s), zero}, {s, c, zero}, {zero, zero, one}}};
+}
+
+// By the adjugate
+inline __Mat3 __Inverse(__Mat3 const& a) {
+    auto cofactor = [&](int r0, int r1, int c0, int c1) {
+        return hw::MulSub(a.m[r0][c0], a.m[r1][c1], a.m[r0][c1] * a.m[r1][c0]);
+    };
+
+    __Mat3 out;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            // Transposed, rows and columns other than (col, row) in cyclic order keep the sign
+            out.m[row][col] = cofactor((col + 1) % 3, (col + 2) % 3, (row + 1) % 3, (row + 2) % 3);
+        }
+    }
+
+    const auto det = hw::MulAdd(a.m[0][0], out.m[0][0],
+                                hw::MulAdd(a.m[0][1], out.m[1][0], a.m[0][2] * out.m[2][0]));
+    const auto inv = hw::Set(hw::DFromV<__VD>(), 1.0) / det;
+    for (auto& row : out.m) {
+        for (auto& element : row) {
+            element = element * inv;
+        }
+    }
+    return out;
+}
+
+// apriltag calculate_F, the projection onto the line of sight v v^T / v^T v
+inline __Mat3 __LineOfSight(__Vec3 const& v) {
+    const auto inv = hw::Set(hw::DFromV<__VD>(), 1.0) / __Dot(v, v);
+    __Mat3 out;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            out.m[row][col] = v.v[row] * v.v[col] * inv;
+        }
+    }
+    return out;
+}
+
+// (I - F) a, the part of a off the line of sight F
+inline __Vec3 __Reject(__Mat3 const& F, __Vec3 const& a) {
+    return __Sub(a, __Mul(F, a));
+}
+
+// (I - mean F)^-1 * scale
+inline __Mat3 __InverseOffSight(__Mat3 const (&F)[4], double scale) {
+    constexpr hw::ScalableTag<double> d;
+    __Mat3 m;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            const auto sum = F[0].m[row][col] + F[1].m[row][col] + F[2].m[row][col] +
+                             F[3].m[row][col];
+            m.m[row][col] = hw::Set(d, row == col ? 1.0 : 0.0) - sum * hw::Set(d, 0.25);
+        }
+    }
+
+    __Mat3 out = __Inverse(m);
+    for (auto& row : out.m) {
+        for (auto& element : row) {
+            element = element * hw::Set(d, scale);
+        }
+    }
+    return out;
+}
+
+// Closest rotation to [a b a x b]. The SVD based polar decomposition of apriltag reduces to the
+// polar factor of the 3x2 matrix [a b], which has a closed form with the square root of the 2x2
+// matrix S = [a b]^T [a b]: sqrt(S) = (S + sqrt(det S) I) / sqrt(tr S + 2 sqrt(det S)). The third
+// column is the cross product, which is also the sign fix apriltag applies for a negative
+// determinant. Lanes where a and b are parallel or not finite have no unique answer and get
+// fallback instead.
+inline __Mat3 __ClosestRotation(__Vec3 const& a, __Vec3 const& b, __Mat3 const& fallback) {
+    constexpr hw::ScalableTag<double> d;
+
+    const auto aa = __Dot(a, a);
+    const auto ab = __Dot(a, b);
+    const auto bb = __Dot(b, b);
+    const auto delta = hw::Sqrt(hw::Max(hw::MulSub(aa, bb, ab * ab), hw::Zero(d)));
+    const auto tau = hw::Sqrt(aa + bb + delta + delta);
+
+    // [a b] (S + delta I)^-1 * tau, NaN fails the comparison
+    const auto p = aa + delta;
+    const auto r = bb + delta;
+    const auto det = hw::MulSub(p, r, ab * ab);
+    const auto trace = aa + bb;
+    const auto mvalid = hw::Gt(det, trace * trace * hw::Set(d, 1e-12));
+    const auto k = tau / hw::IfThenElse(mvalid, det, hw::Set(d, 1.0));
+    const __Vec3 q1 = __Scale(__Sub(__Scale(a, r), __Scale(b, ab)), k);
+    const __Vec3 q2 = __Scale(__Sub(__Scale(b, p), __Scale(a, ab)), k);
+    const __Vec3 q3 = __Cross(q1, q2);
+
+    __Mat3 out;
+    for (int row = 0; row < 3; row++) {
+        out.m[row][0] = hw::IfThenElse(mvalid, q1.v[row], fallback.m[row][0]);
+        out.m[row][1] = hw::IfThenElse(mvalid, q2.v[row], fallback.m[row][1]);
+        out.m[row][2] = hw::IfThenElse(mvalid, q3.v[row], fallback.m[row][2]);
+    }
+    return out;
+}
+
+// apriltag estimate_pose_for_tag_homography, the pose straight from the homography. h holds the
+// 9 elements row major, the translation is scaled by half the tag size.
+inline void __HomographyPose(__VD const (&h)[9], TagPoseParams const& params, __Mat3& R,
+                             __Vec3& t) {
+    constexpr hw::ScalableTag<double> d;
+
+    // homography_to_pose with the camera looking down -z, hence -fx
+    const auto vfx = hw::Set(d, -1.0 / params.fx);
+    const auto vfy = hw::Set(d, 1.0 / params.fy);
+    const auto vcx = hw::Set(d, params.cx);
+    const auto vcy = hw::Set(d, params.cy);
+
+    const auto r20 = h[6];
+    const auto r21 = h[7];
+    const auto tz = h[8];
+    const auto r00 = hw::NegMulAdd(vcx, r20, h[0]) * vfx;
+    const auto r01 = hw::NegMulAdd(vcx, r21, h[1]) * vfx;
+    const auto tx = hw::NegMulAdd(vcx, tz, h[2]) * vfx;
+    const auto r10 = hw::NegMulAdd(vcy, r20, h[3]) * vfy;
+    const auto r11 = hw::NegMulAdd(vcy, r21, h[4]) * vfy;
+    const auto ty = hw::NegMulAdd(vcy, tz, h[5]) * vfy;
+
+    // Columns of unit length on average, and the tag in front of the camera
+    const __Vec3 c0 = {{r00, r10, r20}};
+    const __Vec3 c1 = {{r01, r11, r21}};
+    auto s = hw::Set(d, 1.0) / hw::Sqrt(hw::Sqrt(__Dot(c0, c0)) * hw::Sqrt(__Dot(c1, c1)));
+    s = hw::IfThenElse(hw::Gt(tz, hw::Zero(d)), hw::Neg(s), s);
+
+    // Facing the camera when the homography is degenerate
+    const __Mat3 facing = __RotationZ(hw::Set(d, 1.0), hw::Zero(d));
+    const __Mat3 rotation = __ClosestRotation(__Scale(c0, s), __Scale(c1, s), facing);
+
+    // Back to the camera looking down +z, diag(1, -1, -1) on the left
+    for (int col = 0; col < 3; col++) {
+        R.m[0][col] = rotation.m[0][col];
+        R.m[1][col] = hw::Neg(rotation.m[1][col]);
+        R.m[2][col] = hw::Neg(rotation.m[2][col]);
+    }
+
+    const auto scale = s * hw::Set(d, params.tagsize / 2.0);
+    t = {{tx * scale, hw::Neg(ty * scale), hw::Neg(tz * scale)}};
+}
+
+// apriltag orthogonal_iteration (Lu, Hager and Mjolsness) on the four tag corners. points are the
+// object points, which have zero mean, F the lines of sight of the image points and m2_scale
+// (I - mean F)^-1 / 4. Updates R and t and returns the object space error of the last step.
+// apriltag runs a fixed number of steps, so every lane runs all of them. A lane keeps its
+// rotation through a step where the cross covariance is degenerate.
+inline __VD __OrthogonalIteration(__Vec3 const (&points)[4], __Mat3 const (&F)[4],
+                                  __Mat3 const& m2_scale, int iterations, __Mat3& R, __Vec3& t) {
+    constexpr hw::ScalableTag<double> d;
+    const auto quarter = hw::Set(d, 0.25);
+
+    auto error = hw::Zero(d);
+    for (int step = 0; step < iterations; step++) {
+        // Translation, sum of (F - I) R p
+        __Vec3 rp[4];
+        __Vec3 m2 = {{hw::Zero(d), hw::Zero(d), hw::Zero(d)}};
+        for (int j = 0; j < 4; j++) {
+            rp[j] = __Mul(R, points[j]);
+            m2 = __Sub(m2, __Reject(F[j], rp[j]));
+        }
+        t = __Mul(m2_scale, m2);
+
+        // Rotation, the z of the points is 0 so the cross covariance only has two columns
+        __Vec3 q[4];
+        __Vec3 q_mean = {{hw::Zero(d), hw::Zero(d), hw::Zero(d)}};
+        for (int j = 0; j < 4; j++) {
+            q[j] = __Mul(F[j], __Add(rp[j], t));
+            q_mean = __Add(q_mean, q[j]);
+        }
+        q_mean = __Scale(q_mean, quarter);
+
+        __Vec3 a = {{hw::Zero(d), hw::Zero(d), hw::Zero(d)}};
+        __Vec3 b = a;
+        for (int j = 0; j < 4; j++) {
+            const __Vec3 centered = __Sub(q[j], q_mean);
+            a = __Add(a, __Scale(centered, points[j].v[0]));
+            b = __Add(b, __Scale(centered, points[j].v[1]));
+        }
+        R = __ClosestRotation(a, b, R);
+
+        error = hw::Zero(d);
+        for (int j = 0; j < 4; j++) {
+            const __Vec3 e = __Reject(F[j], __Add(__Mul(R, points[j]), t));
+            error = error + __Dot(e, e);
+        }
+    }
+    return error;
+}
+
+// First half of apriltag fix_pose_ambiguities (Schweighofer and Pinz). In the frame of R_t, with
+// z along the translation, the error of the rotations R_t^T R_gamma R_beta R_z^T is a rational
+// function of tan(beta / 2) with the numerator coefficients a. beta of the known solution is
+// atan2(sin_beta, cos_beta).
+struct __Ambiguity {
+    __Mat3 R_t;
+    __Mat3 R_z;
+    __Mat3 R_gamma;
+    __VD sin_beta;
+    __VD cos_beta;
+    __VD a[5];
+};
+
+inline __Ambiguity __AmbiguityCoefficients(__Vec3 const (&points)[4], __Vec3 const (&v)[4],
+                                           __Mat3 const& R, __Vec3 const& t) {
+    constexpr hw::ScalableTag<double> d;
+    const auto zero = hw::Zero(d);
+    const auto one = hw::Set(d, 1.0);
+    const auto two = hw::Set(d, 2.0);
+
+    __Ambiguity out;
+
+    // 1. R_t
+    const __Vec3 r3 = __Normalize(t);
+    const __Vec3 ex = {{one, zero, zero}};
+    const __Vec3 r1 = __Normalize(__Sub(ex, __Scale(r3, r3.v[0])));
+    const __Vec3 r2 = __Cross(r3, r1);
+    for (int col = 0; col < 3; col++) {
+        out.R_t.m[0][col] = r1.v[col];
+        out.R_t.m[1][col] = r2.v[col];
+        out.R_t.m[2][col] = r3.v[col];
+    }
+
+    // 2. R_z
+    const __Mat3 r1_prime = __Mul(out.R_t, R);
+    auto r31 = r1_prime.m[2][0];
+    auto r32 = r1_prime.m[2][1];
+    auto hypotenuse = hw::Sqrt(hw::MulAdd(r31, r31, r32 * r32));
+    const auto mflat = hw::Lt(hypotenuse, hw::Set(d, 1e-100));
+    r31 = hw::IfThenElse(mflat, one, r31);
+    r32 = hw::IfThenZeroElse(mflat, r32);
+    hypotenuse = hw::IfThenElse(mflat, one, hypotenuse);
+    out.R_z = __RotationZ(r31 / hypotenuse, r32 / hypotenuse);
+
+    // 3. R_gamma and the coefficients
+    const __Mat3 r_trans = __Mul(r1_prime, out.R_z);
+    out.R_gamma = __RotationZ(r_trans.m[1][1], hw::Neg(r_trans.m[0][1]));
+    out.sin_beta = hw::Neg(r_trans.m[2][0]);
+    out.cos_beta = r_trans.m[2][2];
+
+    __Vec3 p_trans[4];
+    __Mat3 F_trans[4];
+    for (int i = 0; i < 4; i++) {
+        p_trans[i] = __MulTransposed(out.R_z, points[i]);
+        F_trans[i] = __LineOfSight(__Mul(out.R_t, v[i]));
+    }
+    const __Mat3 G = __InverseOffSight(F_trans, 0.25);
+
+    // R_gamma p, R_gamma M1 p and R_gamma M2 p with M1 = [0 0 2; 0 0 0; -2 0 0] and
+    // M2 = diag(-1, 1, -1), the terms of R_beta = (I + t M1 + t^2 M2) / (1 + t^2)
+    __Vec3 g[3][4];
+    __Vec3 b[3];
+    for (int k = 0; k < 3; k++) {
+        b[k] = {{zero, zero, zero}};
+    }
+    for (int i = 0; i < 4; i++) {
+        __Vec3 const& p = p_trans[i];
+        g[0][i] = __Mul(out.R_gamma, p);
+        g[1][i] = __Mul(out.R_gamma, __Vec3{{two * p.v[2], zero, hw::Neg(two * p.v[0])}});
+        g[2][i] = __Mul(out.R_gamma, __Vec3{{hw::Neg(p.v[0]), p.v[1], hw::Neg(p.v[2])}});
+        for (int k = 0; k < 3; k++) {
+            b[k] = __Sub(b[k], __Reject(F_trans[i], g[k][i]));
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        b[k] = __Mul(G, b[k]);
+    }
+
+    for (auto& a : out.a) {
+        a = zero;
+    }
+    for (int i = 0; i < 4; i++) {
+        const __Vec3 c0 = __Reject(F_trans[i], __Add(g[0][i], b[0]));
+        const __Vec3 c1 = __Reject(F_trans[i], __Add(g[1][i], b[1]));
+        const __Vec3 c2 = __Reject(F_trans[i], __Add(g[2][i], b[2]));
+        out.a[0] = out.a[0] + __Dot(c0, c0);
+        out.a[1] = hw::MulAdd(two, __Dot(c0, c1), out.a[1]);
+        out.a[2] = out.a[2] + hw::MulAdd(two, __Dot(c0, c2), __Dot(c1, c1));
+        out.a[3] = hw::MulAdd(two, __Dot(c1, c2), out.a[3]);
+        out.a[4] = out.a[4] + __Dot(c2, c2);
+    }
+    return out;
+}
+
+// Second half of fix_pose_ambiguities, the rotation at tan(beta / 2) = tb
+inline __Mat3 __AmbiguousRotation(__Ambiguity const& ambiguity, __VD tb) {
+    constexpr hw::ScalableTag<double> d;
+    const auto one = hw::Set(d, 1.0);
+    const auto tb2 = tb * tb;
+    const auto inv = one / (one + tb2);
+
+    // Rotation about y, in the same form as __RotationZ
+    const auto c = (one - tb2) * inv;
+    const auto s = (tb + tb) * inv;
+    const auto zero = hw::Zero(d);
+    const __Mat3 r_beta = {{{c, zero, s}, {zero, one, zero}, {hw::Neg(s), zero, c}}};
+
+    return __Mul(__Mul(__Transpose(ambiguity.R_t), ambiguity.R_gamma),
+                 __Mul(r_beta, __Transpose(ambiguity.R_z)));
+}
+
+}  // namespace HWY_NAMESPACE
+HWY_AFTER_NAMESPACE();
+
+// Camera relative pose of all the detections of a frame, apriltag estimate_tag_pose in batches of
+// one detection per double lane. The homography decomposition, both orthogonal iterations and the
+// coefficients of the ambiguity run on the whole batch, only the roots of the quartic along the
+// ambiguity are found per lane.
+class PoseEstimator {
+   public:
+    static void Perform(std::vector<Detection> const& detections, TagPoseParams const& params,
+                        std::vector<TagPose>& poses) {
+        constexpr hw::ScalableTag<double> d;
+        constexpr int N = hw::Lanes(d);
+
+        poses.resize(detections.size());
+        for (size_t i = 0; i < detections.size(); i += N) {
+            PerformBatch(detections, params, i, poses);
+        }
+    }
+
+   private:
+    static void PerformBatch(std::vector<Detection> const& detections,
+                             TagPoseParams const& params, size_t first,
+                             std::vector<TagPose>& poses) {
+        namespace hn = HWY_NAMESPACE;
+        constexpr hw::ScalableTag<double> d;
+        constexpr int N = hw::Lanes(d);
+
+        // Detections transposed into lanes, the lanes past the end repeat the last one
+        HWY_ALIGN double h[9][N];
+        HWY_ALIGN double corners[8][N];
+        for (int lane = 0; lane < N; lane++) {
+            Detection const& detection = detections[std::min(first + lane, detections.size() - 1)];
+            for (int k = 0; k < 9; k++) {
+                h[k][lane] = detection.H.h[k / 3][k % 3];
+            }
+            for (int k = 0; k < 4; k++) {
+                corners[2 * k][lane] = (detection.p[k][0] - params.cx) / params.fx;
+                corners[2 * k + 1][lane] = (detection.p[k][1] - params.cy) / params.fy;
+            }
+        }
+
+        hn::__VD vh[9];
+        for (int k = 0; k < 9; k++) {
+            vh[k] = hw::Load(d, h[k]);
+        }
+
+        // Object points in the order of Detection::p, and the lines of sight of the corners
+        const double half = params.tagsize / 2.0;
+        const double object[4][2] = {{-half, half}, {half, half}, {half, -half}, {-half, -half}};
+        hn::__Vec3 points[4];
+        hn::__Vec3 v[4];
+        hn::__Mat3 F[4];
+        for (int k = 0; k < 4; k++) {
+            points[k] = {{hw::Set(d, object[k][0]), hw::Set(d, object[k][1]), hw::Zero(d)}};
+            v[k] = {{hw::Load(d, corners[2 * k]), hw::Load(d, corners[2 * k + 1]),
+                     hw::Set(d, 1.0)}};
+            F[k] = hn::__LineOfSight(v[k]);
+        }
+        const hn::__Mat3 m2_scale = hn::__InverseOffSight(F, 0.25);
+
+        hn::__Mat3 R1;
+        hn::__Vec3 t1;
+        hn::__HomographyPose(vh, params, R1, t1);
+        const auto error1 =
+                hn::__OrthogonalIteration(points, F, m2_scale, params.iterations, R1, t1);
+
+        // The other local minimum, if there is one
+        const hn::__Ambiguity ambiguity = hn::__AmbiguityCoefficients(points, v, R1, t1);
+
+        HWY_ALIGN double a[5][N];
+        HWY_ALIGN double sin_beta[N];
+        HWY_ALIGN double cos_beta[N];
+        for (int k = 0; k < 5; k++) {
+            hw::Store(ambiguity.a[k], d, a[k]);
+        }
+        hw::Store(ambiguity.sin_beta, d, sin_beta);
+        hw::Store(ambiguity.cos_beta, d, cos_beta);
+
+        HWY_ALIGN double minima[N];
+        for (int lane = 0; lane < N; lane++) {
+            const double coefficients[5] = {a[0][lane], a[1][lane], a[2][lane], a[3][lane],
+                                            a[4][lane]};
+            minima[lane] = SecondMinimum(coefficients, std::atan2(sin_beta[lane], cos_beta[lane]));
+        }
+
+        const auto vminima = hw::Load(d, minima);
+        const auto msecond = hw::Not(hw::IsNaN(vminima));
+
+        hn::__Mat3 R = R1;
+        hn::__Vec3 t = t1;
+        auto error = error1;
+        if (!hw::AllFalse(d, msecond)) {
+            const auto vtb = hw::IfThenElseZero(msecond, vminima);
+            hn::__Mat3 R2 = hn::__AmbiguousRotation(ambiguity, vtb);
+            hn::__Vec3 t2 = {{hw::Zero(d), hw::Zero(d), hw::Zero(d)}};
+            auto error2 =
+                    hn::__OrthogonalIteration(points, F, m2_scale, params.iterations, R2, t2);
+            error2 = hw::IfThenElse(msecond, error2, hw::Inf(d));
+
+            // apriltag keeps the first solution on ties
+            const auto msecond_better = hw::Lt(error2, error1);
+            for (int row = 0; row < 3; row++) {
+                for (int col = 0; col < 3; col++) {
+                    R.m[row][col] = hw::IfThenElse(msecond_better, R2.m[row][col], R1.m[row][col]);
+                }
+                t.v[row] = hw::IfThenElse(msecond_better, t2.v[row], t1.v[row]);
+            }
+            error = hw::IfThenElse(msecond_better, error2, error1);
+        }
+
+        HWY_ALIGN double out[13][N];
+        for (int k = 0; k < 9; k++) {
+            hw::Store(R.m[k / 3][k % 3], d, out[k]);
+        }
+        for (int k = 0; k < 3; k++) {
+            hw::Store(t.v[k], d, out[9 + k]);
+        }
+        hw::Store(error, d, out[12]);
+
+        const size_t lanes = std::min<size_t>(N, detections.size() - first);
+        for (size_t lane = 0; lane < lanes; lane++) {
+            TagPose& pose = poses[first + lane];
+            for (int k = 0; k < 9; k++) {
+                pose.R[k / 3][k % 3] = out[k][lane];
+            }
+            for (int k = 0; k < 3; k++) {
+                pose.t[k] = out[9 + k][lane];
+            }
+            pose.error = out[12][lane];
+        }
+    }
+
+    // p[0] + p[1] x + ... + p[degree] x^degree
+    static double Polyval(const double* p, int degree, double x) {
+        double value = p[degree];
+        for (int i = degree - 1; i >= 0; i--) {
+            value = value * x + p[i];
+        }
+        return value;
+    }
+
+    // apriltag solve_poly_approx, the real roots in [-1000, 1000] by bracketing them between the
+    // roots of the derivative, then Newton's method safeguarded by bisection. At most degree 4.
+    static int SolvePolynomial(const double* p, int degree, double* roots) {
+        constexpr double kMaxRoot = 1000;
+
+        if (degree == 1) {
+            if (std::abs(p[0]) > kMaxRoot * std::abs(p[1])) return 0;
+            roots[0] = -p[0] / p[1];
+            return 1;
+        }
+
+        double derivative[4];
+        for (int i = 0; i < degree; i++) {
+            derivative[i] = (i + 1) * p[i + 1];
+        }
+        double derivative_roots[4];
+        const int derivative_count = SolvePolynomial(derivative, degree - 1, derivative_roots);
+
+        int count = 0;
+        for (int i = 0; i <= derivative_count; i++) {
+            const double min = i == 0 ? -kMaxRoot : derivative_roots[i - 1];
+            const double max = i == derivative_count ? kMaxRoot : derivative_roots[i];
+
+            if (Polyval(p, degree, min) * Polyval(p, degree, max) < 0) {
+                double lower = min;
+                double upper = max;
+                if (Polyval(p, degree, min) > Polyval(p, degree, max)) {
+                    std::swap(lower, upper);
+                }
+
+                double root = 0.5 * (lower + upper);
+                double dx_old = upper - lower;
+                double dx = dx_old;
+                double f = Polyval(p, degree, root);
+                double df = Polyval(derivative, degree - 1, root);
+
+                for (int j = 0; j < 100; j++) {
+                    if ((f + df * (upper - root)) * (f + df * (lower - root)) > 0 ||
+                        std::abs(2 * f) > std::abs(dx_old * df)) {
+                        dx_old = dx;
+                        dx = 0.5 * (upper - lower);
+                        root = lower + dx;
+                    } else {
+                        dx_old = dx;
+                        dx = -f / df;
+                        root += dx;
+                    }
+
+                    if (root == upper || root == lower) break;
+
+                    f = Polyval(p, degree, root);
+                    df = Polyval(derivative, degree - 1, root);
+                    if (f > 0) {
+                        upper = root;
+                    } else {
+                        lower = root;
+                    }
+                }
+
+                roots[count++] = root;
+            } else if (Polyval(p, degree, max) == 0) {
+                // Double or triple root
+                roots[count++] = max;
+            }
+        }
+        return count;
+    }
+
+    // tan(beta / 2) of the one other minimum of the error along the ambiguity, NaN when there is
+    // none or apriltag would give up because there are several
+    static double SecondMinimum(const double (&a)[5], double beta_initial) {
+        // Derivative of the error, in tan(beta / 2)
+        const double p[5] = {a[1], 2 * a[2] - 4 * a[0], 3 * a[3] - 3 * a[1], 4 * a[4] - 2 * a[2],
+                             -a[3]};
+        double roots[4];
+        const int count = SolvePolynomial(p, 4, roots);
+
+        double minimum = std::numeric_limits<double>::quiet_NaN();
+        int minima = 0;
+        for (int i = 0; i < count; i++) {
+            const double t1 = roots[i];
+            const double t2 = t1 * t1;
+            const double t3 = t1 * t2;
+            const double t4 = t1 * t3;
+            const double t5 = t1 * t4;
+
+            // A minimum, qualitatively different from the known one
+            const double second = a[2] - 2 * a[0] + (3 * a[3] - 6 * a[1]) * t1 +
+                                  (6 * a[4] - 8 * a[2] + 10 * a[0]) * t2 +
+                                  (-8 * a[3] + 6 * a[1]) * t3 + (-6 * a[4] + 3 * a[2]) * t4 +
+                                  a[3] * t5;
+            if (second >= 0 && std::abs(2 * std::atan(t1) - beta_initial) > 0.1) {
+                minimum = t1;
+                minima++;
+            }
+        }
+
+        return minima == 1 ? minimum : std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+}  // namespace simdtag
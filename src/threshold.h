@@ -9,7 +9,7 @@
 
 namespace simdtag {
 
-void AdaptiveThreshold(cv::Mat1b const& input, cv::Mat1b& output) {
+inline void AdaptiveThreshold(cv::Mat1b const& input, cv::Mat1b& output) {
     Halide::Runtime::Buffer<uint8_t> grayscale = Halide::Runtime::Buffer<uint8_t>::make_interleaved(
             input.data, input.cols, input.rows, input.channels());
 
@@ -0,0 +1,97 @@
+#include "contour_clusters.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "ccl/bmrs.h"
+#include "fit_quads.h"
+#include "gradient_point.h"
+#include "quad_test_utils.h"
+
+using namespace simdtag;
+
+namespace {
+
+struct Traced {
+    cv::Mat1b threshold;
+    GradientClusterHash hash{100};
+};
+
+void TraceClusters(Traced& traced, bool reversed_border) {
+    cv::Mat1i labels{traced.threshold.size(), 0};
+    BMRS ccl{traced.threshold.size()};
+    ccl.PerformLabelingDual(traced.threshold, labels);
+
+    ContourClusters contours{traced.threshold.size()};
+    contours.Perform(traced.threshold, labels, ccl.LabelCount(), traced.hash, reversed_border);
+}
+
+}  // namespace
+
+TEST(ContourClusters, SquareInSlopeOrder) {
+    Traced traced{cv::Mat1b{200, 240, 255}};
+    traced.threshold(cv::Rect{60, 50, 80, 90}) = 0;
+    TraceClusters(traced, false);
+
+    // Only the black square is traced, one point per pixel of outline
+    ASSERT_EQ(1, traced.hash.size());
+    GradientCluster& cluster = traced.hash.begin()->second;
+    EXPECT_EQ(2 * 80 + 2 * 90, cluster.points.size());
+
+    // Around the center the angle only drops once, where it wraps
+    auto center = HWY_NAMESPACE::__FindCenterPoint(cluster.stats);
+    int drops = 0;
+    double last = 0;
+    for (size_t i = 0; i <= cluster.points.size(); i++) {
+        GradientPoint gp{cluster.points[i % cluster.points.size()]};
+        double angle = std::atan2(2 * gp.GetY() - center.second, 2 * gp.GetX() - center.first);
+        if (i > 0 && angle < last) drops++;
+        last = angle;
+    }
+    EXPECT_EQ(1, drops);
+
+    // Same border direction as the slope sort
+    ClusterStore sorted = cluster.points;
+    ScratchArena arena;
+    float dot = HWY_NAMESPACE::__SortBySlope(sorted, center, arena);
+    EXPECT_NEAR(dot, cluster.stats.Dot(center.first, center.second), 1e-3f * std::abs(dot));
+    EXPECT_GT(dot, 0.0f);
+}
+
+TEST(ContourClusters, FitQuadsWithoutSort) {
+    Traced traced{cv::Mat1b{200, 240, 255}};
+    traced.threshold(cv::Rect{60, 50, 80, 90}) = 0;
+    TraceClusters(traced, false);
+
+    FitQuadsParams params;
+    params.ordered_clusters = true;
+    std::vector<Quad> quads;
+    FitQuads::Perform(traced.hash, traced.threshold.size(), quads, params);
+
+    ASSERT_EQ(1, quads.size());
+    EXPECT_FALSE(quads[0].reversed_border);
+
+    QuadTestUtils::ExpectCorners(quads[0], {{60, 50}, {140, 50}, {140, 140}, {60, 140}});
+}
+
+TEST(ContourClusters, RingTracedFromBothSides) {
+    Traced traced{cv::Mat1b{120, 120, 255}};
+    traced.threshold(cv::Rect{20, 20, 80, 80}) = 0;
+    traced.threshold(cv::Rect{40, 40, 40, 40}) = 255;
+
+    // The outer edge of the ring, then also the inner one from the white inside
+    TraceClusters(traced, false);
+    EXPECT_EQ(1, traced.hash.size());
+
+    TraceClusters(traced, true);
+    ASSERT_EQ(2, traced.hash.size());
+
+    size_t points = 0;
+    for (auto it = traced.hash.begin(); it != traced.hash.end(); it++) {
+        points += it->second.points.size();
+    }
+    EXPECT_EQ(4 * 80 + 4 * 40, points);
+}
@@ -9,7 +9,9 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 
+#include "ccl/bmrs.h"
 #include "gradient_point.h"
+#include "quad_test_utils.h"
 
 using namespace simdtag;
 
@@ -68,7 +70,8 @@ TEST(FitQuads, QuadCenterAndSort) {
         fmt::println("{{{},{},{}}}", it->x, it->y, it->slope);
     }
 
-    HWY_NAMESPACE::__SortBySlope(points, center);
+    ScratchArena arena;
+    HWY_NAMESPACE::__SortBySlope(points, center, arena);
 
     std::vector<pt> result;
 
@@ -117,3 +120,285 @@ TEST(FitQuads, QuadCenterAndSort) {
     //     }
     // }
 }
+
+// Points around a square outline, all unique so the slope order has no ties
+static ClusterStore SquareCluster(int count) {
+    ClusterStore cluster;
+    for (int i = 0; i < count; i++) {
+        const int t = 5 + i;
+        const int side = i % 4;
+        GradientPoint gp;
+        gp.SetX(side == 0 || side == 2 ? t : (side == 1 ? 50 : 5));
+        gp.SetY(side == 1 || side == 3 ? t : (side == 0 ? 5 : 50));
+        gp.SetDxDy(i % 2, 1);
+        gp.SetBlackToWhite(0, i % 3 ? 255 : 0);
+        cluster.push_back(gp.RawValue());
+    }
+
+    return cluster;
+}
+
+TEST(FitQuads, SortKeysMatchesStdSort) {
+    std::srand(0);
+
+    // Both sides of the network cutoff, with duplicates and sizes that aren't a power of two
+    for (size_t size : {0, 1, 2, 3, 24, 37, 64, 100, 129, 255, 256, 257, 1000}) {
+        std::vector<uint64_t> keys(size);
+        for (uint64_t& key : keys) {
+            key = uint64_t(std::rand() % 512) << 32 | std::rand();
+        }
+
+        std::vector<uint64_t> expected = keys;
+        std::sort(expected.begin(), expected.end());
+
+        HWY_NAMESPACE::__SortKeys(keys.data(), keys.size());
+        EXPECT_EQ(expected, keys) << size;
+    }
+}
+
+TEST(FitQuads, SpanSortMatchesClusterStore) {
+    ClusterStore cluster = SquareCluster(40);
+
+    // Two clusters back to back in one buffer
+    std::vector<uint64_t> points;
+    for (uint32_t point : cluster) points.push_back(uint64_t{7} << 32 | point);
+    const size_t offset = points.size();
+    for (uint32_t point : cluster) points.push_back(uint64_t{9} << 32 | point);
+
+    auto center = HWY_NAMESPACE::__FindCenterPoint(cluster);
+    auto span_center = HWY_NAMESPACE::__FindCenterPoint(points.data() + offset, cluster.size());
+    EXPECT_EQ(center, span_center);
+
+    // Same center from the bounding box accumulated during clustering
+    GradientCluster stats_cluster;
+    for (uint32_t point : cluster) stats_cluster.Add(point);
+    EXPECT_EQ(center, HWY_NAMESPACE::__FindCenterPoint(stats_cluster.stats));
+
+    ScratchArena arena;
+    float dot = HWY_NAMESPACE::__SortBySlope(cluster, center, arena);
+    float span_dot = HWY_NAMESPACE::__SortBySlope(points.data() + offset, cluster.size(), center);
+    EXPECT_FLOAT_EQ(dot, span_dot);
+    EXPECT_NEAR(dot, stats_cluster.stats.Dot(center.first, center.second), 1e-3f * std::abs(dot));
+
+    for (size_t i = 0; i < cluster.size(); i++) {
+        EXPECT_EQ(cluster[i], static_cast<uint32_t>(points[offset + i]));
+
+        // The first cluster is untouched
+        EXPECT_EQ(7, points[i] >> 32);
+    }
+}
+
+TEST(FitQuads, SoASortMatchesClusterStore) {
+    // Not a multiple of the vector width, so the padding is exercised
+    ClusterStore cluster = SquareCluster(43);
+
+    GradientClusterHash hash;
+    hash.insert_unique(1, GradientCluster{cluster});
+    ClusterSoA soa;
+    soa.Build(hash);
+    ASSERT_EQ(1, soa.Count());
+
+    ClusterView view = soa.Cluster(0);
+    ASSERT_EQ(cluster.size(), view.size);
+
+    auto center = HWY_NAMESPACE::__FindCenterPoint(cluster);
+    auto soa_center = HWY_NAMESPACE::__FindCenterPoint(view);
+    EXPECT_EQ(center, soa_center);
+
+    std::vector<uint64_t> keys(cluster.size() + 16);
+    alignas(64) float scratch[64];
+    ScratchArena arena;
+    float dot = HWY_NAMESPACE::__SortBySlope(cluster, center, arena);
+    float soa_dot = HWY_NAMESPACE::__SortBySlope(view, center, keys.data(), scratch);
+    EXPECT_NEAR(dot, soa_dot, 1e-3f * std::abs(dot));
+
+    for (size_t i = 0; i < cluster.size(); i++) {
+        GradientPoint gp(cluster[i]);
+        float sign = gp.GetBlackToWhite() ? 1.0f : -1.0f;
+
+        EXPECT_EQ(gp.GetX() * 2, view.x[i]);
+        EXPECT_EQ(gp.GetY() * 2, view.y[i]);
+        EXPECT_EQ(sign * gp.GetDx(), view.gx[i]);
+        EXPECT_EQ(sign * gp.GetDy(), view.gy[i]);
+    }
+}
+
+TEST(FitQuads, FilterClusters) {
+    // Doubled coordinates, as in ClusterStats
+    struct Input {
+        float count, width, height, dot;
+        bool expected;
+    };
+    const std::vector<Input> data = {
+            {100, 40, 40, 50, true},    {10, 40, 40, 50, false},  // too few points
+            {5000, 40, 40, 50, false},                            // larger than the image
+            {100, 10, 10, 50, false},                             // smaller than a tag
+            {100, 200, 20, 50, false},                            // too long and thin
+            {100, 40, 40, -50, false},                            // reversed border
+            {24, 16, 16, 1, true},      {100, 160, 20, 50, true}, {100, 60, 30, 0, true},
+    };
+
+    // More than a vector, with a partial tail
+    const size_t size = data.size() * 3;
+    const size_t padded = hwy::RoundUpTo(size, 64);
+    auto count = hwy::AllocateAligned<float>(padded);
+    auto width = hwy::AllocateAligned<float>(padded);
+    auto height = hwy::AllocateAligned<float>(padded);
+    auto dot = hwy::AllocateAligned<float>(padded);
+    std::vector<uint32_t> expected;
+    for (size_t i = 0; i < size; i++) {
+        const Input& in = data[i % data.size()];
+        count[i] = in.count;
+        width[i] = in.width;
+        height[i] = in.height;
+        dot[i] = in.dot;
+        if (in.expected) expected.push_back(i);
+    }
+
+    HWY_NAMESPACE::ClusterFilterInput input{count.get(), width.get(), height.get(), dot.get(),
+                                            size};
+    std::vector<uint32_t> selected(padded);
+    size_t selected_size =
+            HWY_NAMESPACE::__FilterClusters(input, FitQuadsParams{}, 1000, selected.data());
+    selected.resize(selected_size);
+    EXPECT_EQ(expected, selected);
+
+    // Reversed border families keep only the negative dot products
+    FitQuadsParams reversed{.normal_border = false, .reversed_border = true};
+    selected.resize(padded);
+    selected_size = HWY_NAMESPACE::__FilterClusters(input, reversed, 1000, selected.data());
+    for (size_t i = 0; i < selected_size; i++) {
+        EXPECT_LE(dot[selected[i]], 0.0f);
+    }
+
+    // A threshold below the vector width is raised to it, the kernels load whole vectors
+    FitQuadsParams any_size;
+    any_size.min_cluster_points = 0;
+    count[0] = 1;
+    input.size = 1;
+    EXPECT_EQ(0, HWY_NAMESPACE::__FilterClusters(input, any_size, 1000, selected.data()));
+}
+
+// Black square on white, every route finds one quad with the corners on the pixel edges
+TEST(FitQuads, PerformFindsSquare) {
+    cv::Mat1b threshold{200, 240, 255};
+    threshold(cv::Rect{60, 50, 80, 90}) = 0;
+    cv::Mat1i labels{threshold.size(), 0};
+    BMRS ccl{threshold.size()};
+    ccl.PerformLabelingDual(threshold, labels);
+
+    GradientClusters gc{threshold.size()};
+    GradientClusterHash hash{100};
+    GradientClusterArray array;
+    gc.Perform(threshold, labels, hash);
+    gc.Perform(threshold, labels, array);
+
+    auto check = [](std::vector<Quad> const& quads) {
+        ASSERT_EQ(1, quads.size());
+        EXPECT_FALSE(quads[0].reversed_border);
+        QuadTestUtils::ExpectCorners(quads[0], {{60, 50}, {140, 50}, {140, 140}, {60, 140}});
+    };
+
+    std::vector<Quad> quads;
+    ClusterSoA soa;
+    soa.Build(hash);
+    FitQuads::Perform(soa, threshold.size(), quads);
+    check(quads);
+
+    FitQuads::Perform(array.Data(), array.Spans(), threshold.size(), quads);
+    check(quads);
+
+    FitQuads::Perform(hash, threshold.size(), quads);
+    check(quads);
+
+    // Weighted by the image gradient
+    FitQuads::Perform(hash, threshold.size(), quads, FitQuadsParams{}, &threshold);
+    check(quads);
+}
+
+namespace {
+
+// Squares of very different sizes, so the largest first order matters
+cv::Mat1b SquaresOfManySizes() {
+    cv::Mat1b threshold{400, 600, 255};
+    int x = 10;
+    for (int side : {12, 150, 30, 90, 20, 60, 16, 40}) {
+        threshold(cv::Rect{x, 20 + (x % 7) * 20, side, side}) = 0;
+        x += side + 12;
+    }
+    return threshold;
+}
+
+}  // namespace
+
+TEST(FitQuads, ParallelMatchesSerial) {
+    cv::Mat1b threshold = SquaresOfManySizes();
+    cv::Mat1i labels{threshold.size(), 0};
+    BMRS ccl{threshold.size()};
+    ccl.PerformLabelingDual(threshold, labels);
+
+    GradientClusters gc{threshold.size()};
+    GradientClusterHash serial_hash{100};
+    GradientClusterHash parallel_hash{100};
+    gc.Perform(threshold, labels, serial_hash);
+    gc.Perform(threshold, labels, parallel_hash);
+
+    std::vector<Quad> expected;
+    FitQuads::Perform(serial_hash, threshold.size(), expected);
+    ASSERT_EQ(8, expected.size());
+
+    auto order = [](Quad const& a, Quad const& b) {
+        return std::make_pair(a.p[0][0], a.p[0][1]) < std::make_pair(b.p[0][0], b.p[0][1]);
+    };
+    std::sort(expected.begin(), expected.end(), order);
+
+    for (size_t threads : {1, 2, 3, 8}) {
+        ThreadPool pool{threads};
+        std::vector<Quad> quads;
+        FitQuads::Perform(parallel_hash, threshold.size(), quads, pool);
+        std::sort(quads.begin(), quads.end(), order);
+
+        ASSERT_EQ(expected.size(), quads.size()) << threads;
+        for (size_t i = 0; i < quads.size(); i++) {
+            for (int corner = 0; corner < 4; corner++) {
+                EXPECT_EQ(expected[i].p[corner][0], quads[i].p[corner][0]);
+                EXPECT_EQ(expected[i].p[corner][1], quads[i].p[corner][1]);
+            }
+        }
+    }
+}
+
+TEST(FitQuads, BatchedSortMatchesSerial) {
+    cv::Mat1b threshold = SquaresOfManySizes();
+    cv::Mat1i labels{threshold.size(), 0};
+    BMRS ccl{threshold.size()};
+    ccl.PerformLabelingDual(threshold, labels);
+
+    GradientClusters gc{threshold.size()};
+    GradientClusterHash serial_hash{100};
+    GradientClusterHash batched_hash{100};
+    gc.Perform(threshold, labels, serial_hash);
+    gc.Perform(threshold, labels, batched_hash);
+
+    std::vector<Quad> expected;
+    FitQuads::Perform(serial_hash, threshold.size(), expected);
+    ASSERT_EQ(8, expected.size());
+
+    // Same keys with the same tie break, so the same points in the same order
+    FitQuadsParams params;
+    params.batched_sort = true;
+    std::vector<Quad> quads;
+    FitQuads::Perform(batched_hash, threshold.size(), quads, params);
+
+    ASSERT_EQ(expected.size(), quads.size());
+    for (size_t i = 0; i < quads.size(); i++) {
+        for (int corner = 0; corner < 4; corner++) {
+            EXPECT_EQ(expected[i].p[corner][0], quads[i].p[corner][0]);
+            EXPECT_EQ(expected[i].p[corner][1], quads[i].p[corner][1]);
+        }
+    }
+
+    for (auto it = serial_hash.begin(); it != serial_hash.end(); it++) {
+        EXPECT_EQ(it->second.points, batched_hash.find(it->first)->second.points);
+    }
+}
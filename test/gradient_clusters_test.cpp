@@ -3,14 +3,19 @@
 #include <gtest/gtest.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <map>
 #include <opencv2/opencv.hpp>
 #include <unordered_set>
+#include <vector>
 
 #include "ccl/bmrs.h"
 #include "fmt/format.h"
+#include "halide/bm_only_halide_gradient_clusters.h"
 #include "hwy/highway.h"
 #include "simdtag/highway_utils.h"
+#include "simdtag/thread_pool.h"
 #include "threshold.h"
 
 namespace hw = hwy::HWY_NAMESPACE;
@@ -199,4 +204,343 @@ TEST(GradientClusters, SimdGradientClustersCalculations) {
 }
 #endif
 
-// TODO: Add a test against an entire image
+TEST(GradientClusters, SortMatchesHash) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::GradientClusterArray array;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, hash);
+    int hash_points = gc.Size();
+    gc.Perform(threshold, labels, array);
+
+    EXPECT_EQ(hash_points, gc.Size());
+    EXPECT_EQ(hash_points, array.Size());
+    ASSERT_EQ(hash.size(), array.Spans().size());
+
+    const uint64_t* points = array.Data();
+    for (auto const& span : array.Spans()) {
+        uint32_t key = points[span.offset] >> 32;
+        GradientCluster* expected = hash.try_get(key);
+        ASSERT_NE(expected, nullptr) << "Missing cluster " << key;
+
+        std::vector<uint32_t> actual;
+        for (uint32_t i = span.offset; i < span.offset + span.length; i++) {
+            EXPECT_EQ(key, points[i] >> 32);
+            actual.push_back(static_cast<uint32_t>(points[i]));
+        }
+
+        // Points within a span are sorted, hash buckets are in insertion order
+        std::vector<uint32_t> sorted_expected = expected->points;
+        std::sort(sorted_expected.begin(), sorted_expected.end());
+        EXPECT_EQ(sorted_expected, actual);
+    }
+}
+
+TEST(GradientClusters, ParallelMatchesSerial) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::ThreadPool pool{4};
+    std::vector<simdtag::GradientClusterHash> partitions;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, hash);
+    int serial_points = gc.Size();
+    gc.Perform(threshold, labels, pool, partitions);
+
+    EXPECT_EQ(serial_points, gc.Size());
+    ASSERT_EQ(partitions.size(), pool.NumThreads());
+
+    size_t clusters = 0;
+    for (auto& partition : partitions) {
+        clusters += partition.size();
+        for (auto const& [key, cluster] : partition) {
+            GradientCluster* expected = hash.try_get(key);
+            ASSERT_NE(expected, nullptr) << "Missing cluster " << key;
+            // Bands are merged in row order, so even the point order matches
+            EXPECT_EQ(expected->points, cluster.points);
+        }
+    }
+
+    // Every cluster lives in exactly one partition
+    EXPECT_EQ(hash.size(), clusters);
+}
+
+TEST(GradientClusters, FindClusterSpans) {
+    std::srand(0);
+
+    // Cover empty, single, boundaries on and off vector edges and scalar tails
+    for (size_t size : {0, 1, 2, 7, 8, 9, 31, 64, 257}) {
+        std::vector<uint64_t> points(size);
+        std::vector<ClusterSpan> expected;
+
+        uint64_t key = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (i == 0 || std::rand() % 4 == 0) {
+                key += 1 + std::rand() % 3;
+                expected.push_back({static_cast<uint32_t>(i), 0});
+            }
+            expected.back().length++;
+            points[i] = key << 32 | static_cast<uint32_t>(std::rand());
+        }
+
+        std::vector<ClusterSpan> spans;
+        HWY_NAMESPACE::__FindClusterSpans(points.data(), size, spans);
+
+        ASSERT_EQ(expected.size(), spans.size()) << "size " << size;
+        for (size_t i = 0; i < spans.size(); i++) {
+            EXPECT_EQ(expected[i].offset, spans[i].offset);
+            EXPECT_EQ(expected[i].length, spans[i].length);
+        }
+    }
+}
+
+TEST(GradientClusters, HalideMatchesHash) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::HalideGradientClusters halide{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, hash);
+    halide.Perform(threshold, labels);
+
+    EXPECT_EQ(gc.Size(), halide.Size());
+    ASSERT_EQ(hash.size(), halide.Spans().size());
+
+    const uint64_t* points = halide.GetBuffer();
+    for (auto const& span : halide.Spans()) {
+        uint32_t key = points[span.offset] >> 32;
+        GradientCluster* expected = hash.try_get(key);
+        ASSERT_NE(expected, nullptr) << "Missing cluster " << key;
+
+        std::vector<uint32_t> actual;
+        for (uint32_t i = span.offset; i < span.offset + span.length; i++) {
+            actual.push_back(static_cast<uint32_t>(points[i]));
+        }
+
+        std::vector<uint32_t> sorted_expected = expected->points;
+        std::sort(sorted_expected.begin(), sorted_expected.end());
+        std::sort(actual.begin(), actual.end());
+        EXPECT_EQ(sorted_expected, actual);
+    }
+}
+
+TEST(GradientClusters, LabelStoreMatchesHash) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+    simdtag::LabelClusterStore store;
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, hash);
+    gc.Perform(threshold, labels, store, ccl.LabelCount());
+    EXPECT_EQ(gc.Size(), store.Size());
+
+    // Every label pair is its own cluster, the hash may merge some of them on collisions. Group
+    // the exact clusters by hash and they must add up to the hash buckets.
+    std::map<uint32_t, std::vector<uint32_t>> grouped;
+    const uint64_t* points = store.Data();
+    for (uint32_t id = 0; id < store.Spans().size(); id++) {
+        auto [label_min, label_max] = store.Labels(id);
+        EXPECT_LT(label_min, label_max);
+
+        uint64_t pair = static_cast<uint64_t>(label_min) << 32 | label_max;
+        uint32_t key = (pair * 2654435761ull) >> 32;
+
+        auto const& span = store.Spans()[id];
+        EXPECT_GT(span.length, 0);
+        for (uint32_t i = span.offset; i < span.offset + span.length; i++) {
+            EXPECT_EQ(id, points[i] >> 32);
+            grouped[key].push_back(static_cast<uint32_t>(points[i]));
+        }
+    }
+
+    ASSERT_EQ(hash.size(), grouped.size());
+    for (auto& [key, actual] : grouped) {
+        GradientCluster* expected = hash.try_get(key);
+        ASSERT_NE(expected, nullptr) << "Missing cluster " << key;
+
+        std::vector<uint32_t> sorted_expected = expected->points;
+        std::sort(sorted_expected.begin(), sorted_expected.end());
+        std::sort(actual.begin(), actual.end());
+        EXPECT_EQ(sorted_expected, actual);
+    }
+}
+
+TEST(GradientClusters, SparseMatchesDense) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash dense{100};
+    simdtag::GradientClusterHash sparse{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, dense);
+    int dense_points = gc.Size();
+    gc.PerformSparse(threshold, labels, sparse);
+
+    EXPECT_GT(dense_points, 0);
+    EXPECT_EQ(dense_points, gc.Size());
+    ASSERT_EQ(dense.size(), sparse.size());
+
+    for (auto it = dense.begin(); it != dense.end(); it++) {
+        GradientCluster* actual = sparse.try_get(it->first);
+        ASSERT_NE(actual, nullptr) << "Missing cluster " << it->first;
+
+        // Dense visits directions per vector of pixels, sparse per pixel, so only the set matches
+        std::vector<uint32_t> sorted_expected = it->second.points;
+        std::vector<uint32_t> sorted_actual = actual->points;
+        std::sort(sorted_expected.begin(), sorted_expected.end());
+        std::sort(sorted_actual.begin(), sorted_actual.end());
+        EXPECT_EQ(sorted_expected, sorted_actual);
+    }
+}
+
+// Straight port of the apriltag gradient_clusters loop, border columns are skipped
+static std::map<uint32_t, std::vector<uint32_t>> ScalarGradientClusters(cv::Mat1b const& img,
+                                                                         cv::Mat1i const& labels) {
+    std::map<uint32_t, std::vector<uint32_t>> clusters;
+
+    for (int y = 0; y < img.rows - 1; y++) {
+        for (int x = 1; x < img.cols - 1; x++) {
+            auto add = [&](int dx, int dy) {
+                const int v0 = img(y, x);
+                const int v1 = img(y + dy, x + dx);
+                if (v0 == 127 || v0 + v1 != 255) return;
+
+                const uint64_t rep0 = static_cast<uint32_t>(labels(y, x));
+                const uint64_t rep1 = static_cast<uint32_t>(labels(y + dy, x + dx));
+                const uint64_t key = std::min(rep0, rep1) << 32 | std::max(rep0, rep1);
+                const uint32_t hash = (key * 2654435761ull) >> 32;
+                clusters[hash].push_back(GradientPoint::Pack(x, y, dx, dy, v1 > v0));
+            };
+
+            add(1, 0);
+            add(0, 1);
+            add(1, 1);
+
+            const bool dup = (labels(y, x - 1) == labels(y, x) &&
+                              labels(y + 1, x) == labels(y + 1, x - 1)) ||
+                             (labels(y, x - 1) == labels(y + 1, x - 1) &&
+                              labels(y, x) == labels(y + 1, x));
+            if (!dup) add(-1, 1);
+        }
+    }
+
+    return clusters;
+}
+
+TEST(GradientClusters, DenseMatchesScalar) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+
+    gc.Perform(threshold, labels, hash);
+    auto expected = ScalarGradientClusters(threshold, labels);
+
+    size_t expected_points = 0;
+    for (auto& [key, points] : expected) {
+        expected_points += points.size();
+    }
+
+    EXPECT_GT(expected_points, 0);
+    EXPECT_EQ(expected_points, gc.Size());
+    ASSERT_EQ(expected.size(), hash.size());
+
+    for (auto& [key, points] : expected) {
+        GradientCluster* actual = hash.try_get(key);
+        ASSERT_NE(actual, nullptr) << "Missing cluster " << key;
+
+        // The fused kernel emits a whole vector per direction, so only the set matches
+        std::vector<uint32_t> sorted_actual = actual->points;
+        std::sort(points.begin(), points.end());
+        std::sort(sorted_actual.begin(), sorted_actual.end());
+        EXPECT_EQ(points, sorted_actual);
+    }
+}
+
+TEST(GradientClusters, StatsMatchPoints) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    simdtag::BMRS ccl{input.size()};
+    simdtag::GradientClusters gc{input.size()};
+    simdtag::GradientClusterHash hash{100};
+
+    simdtag::AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    for (auto it = hash.begin(); it != hash.end(); it++) {
+        ClusterStats expected;
+        for (uint32_t point : it->second.points) {
+            GradientPoint p{point};
+            uint32_t x = p.GetX() * 2;
+            uint32_t y = p.GetY() * 2;
+
+            expected.x_min = std::min(expected.x_min, x);
+            expected.x_max = std::max(expected.x_max, x);
+            expected.y_min = std::min(expected.y_min, y);
+            expected.y_max = std::max(expected.y_max, y);
+            expected.mx += x;
+            expected.my += y;
+            expected.mxx += int64_t{x} * x;
+            expected.mxy += int64_t{x} * y;
+            expected.myy += int64_t{y} * y;
+
+            const int sign = p.GetBlackToWhite() ? 1 : -1;
+            expected.gx += sign * p.GetDx();
+            expected.gy += sign * p.GetDy();
+            expected.xgx += int64_t{x} * sign * p.GetDx();
+            expected.ygy += int64_t{y} * sign * p.GetDy();
+        }
+
+        const ClusterStats& actual = it->second.stats;
+        EXPECT_EQ(expected.x_min, actual.x_min);
+        EXPECT_EQ(expected.x_max, actual.x_max);
+        EXPECT_EQ(expected.y_min, actual.y_min);
+        EXPECT_EQ(expected.y_max, actual.y_max);
+        EXPECT_EQ(expected.mx, actual.mx);
+        EXPECT_EQ(expected.my, actual.my);
+        EXPECT_EQ(expected.mxx, actual.mxx);
+        EXPECT_EQ(expected.mxy, actual.mxy);
+        EXPECT_EQ(expected.myy, actual.myy);
+        EXPECT_EQ(expected.gx, actual.gx);
+        EXPECT_EQ(expected.gy, actual.gy);
+        EXPECT_EQ(expected.xgx, actual.xgx);
+        EXPECT_EQ(expected.ygy, actual.ygy);
+    }
+}
@@ -5,6 +5,7 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <utility>
 
 #include "fmt/format.h"
 
@@ -12,7 +13,7 @@ using namespace simdtag;
 
 TEST(GradientPoint, GetSet) {
     GradientPoint pt;
-    constexpr int MAX_IMG_SIZE = 2047;
+    constexpr int MAX_IMG_SIZE = GradientPoint::kMaxImageSize - 1;
     pt.SetX(MAX_IMG_SIZE);
     pt.SetY(MAX_IMG_SIZE);
     pt.SetDxDy(-1, 1);
@@ -38,3 +39,18 @@ TEST(GradientPoint, GetSet) {
     EXPECT_EQ(0, pt.GetDy());
     EXPECT_EQ(1, pt.GetBlackToWhite());
 }
+
+TEST(GradientPoint, PackLargeImage) {
+    // 4K and 2448x2048 sensors must round trip without wrapping
+    for (auto [x, y] : {std::pair{3839, 2159}, std::pair{2447, 2047}, std::pair{4095, 4095}}) {
+        for (int dx = -1; dx <= 1; dx++) {
+            GradientPoint pt{GradientPoint::Pack(x, y, dx, 1, true)};
+
+            EXPECT_EQ(x + 0.5f * dx, pt.GetX());
+            EXPECT_EQ(y + 0.5f, pt.GetY());
+            EXPECT_EQ(dx, pt.GetDx());
+            EXPECT_EQ(1, pt.GetDy());
+            EXPECT_EQ(1, pt.GetBlackToWhite());
+        }
+    }
+}
@@ -0,0 +1,163 @@
+#include "line_fit.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "cluster_soa.h"
+#include "gradient_clusters.h"
+#include "gradient_point.h"
+
+using namespace simdtag;
+
+namespace {
+
+// Two sides of a square, not a multiple of the vector width so the tail is exercised
+ClusterStore CornerCluster() {
+    ClusterStore cluster;
+    for (int i = 0; i < 37; i++) {
+        GradientPoint gp;
+        gp.SetX(i < 20 ? 10 + i : 29);
+        gp.SetY(i < 20 ? 10 : 10 + (i - 19));
+        gp.SetBlackToWhite(0, 255);
+        cluster.push_back(gp.RawValue());
+    }
+
+    return cluster;
+}
+
+}  // namespace
+
+TEST(LineFit, PrefixMomentsMatchScalar) {
+    ClusterStore cluster = CornerCluster();
+    LineFitScratch scratch;
+    LineFitMoments moments = scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(cluster.data(), cluster.size(), moments);
+
+    double mx = 0, my = 0, mxx = 0, mxy = 0, myy = 0, w = 0;
+    for (size_t i = 0; i < cluster.size(); i++) {
+        GradientPoint gp{cluster[i]};
+        double x = gp.GetX() + 0.5;
+        double y = gp.GetY() + 0.5;
+
+        mx += x;
+        my += y;
+        mxx += x * x;
+        mxy += x * y;
+        myy += y * y;
+        w += 1;
+
+        EXPECT_DOUBLE_EQ(mx, moments.mx[i]);
+        EXPECT_DOUBLE_EQ(my, moments.my[i]);
+        EXPECT_DOUBLE_EQ(mxx, moments.mxx[i]);
+        EXPECT_DOUBLE_EQ(mxy, moments.mxy[i]);
+        EXPECT_DOUBLE_EQ(myy, moments.myy[i]);
+        EXPECT_DOUBLE_EQ(w, moments.w[i]);
+    }
+
+    // Same moments from a (slope << 32 | point) span and from the SoA planes
+    std::vector<uint64_t> span;
+    for (uint32_t point : cluster) span.push_back(uint64_t{5} << 32 | point);
+    LineFitScratch span_scratch;
+    LineFitMoments span_moments = span_scratch.Get(span.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(span.data(), span.size(), span_moments);
+
+    GradientClusterHash hash;
+    hash.insert_unique(1, GradientCluster{cluster});
+    ClusterSoA soa;
+    soa.Build(hash);
+    LineFitScratch soa_scratch;
+    LineFitMoments soa_moments = soa_scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(soa.Cluster(0), soa_moments);
+
+    for (size_t i = 0; i < cluster.size(); i++) {
+        EXPECT_DOUBLE_EQ(moments.mxy[i], span_moments.mxy[i]);
+        EXPECT_DOUBLE_EQ(moments.mxy[i], soa_moments.mxy[i]);
+        EXPECT_DOUBLE_EQ(moments.w[i], soa_moments.w[i]);
+    }
+}
+
+TEST(LineFit, FitLineSegments) {
+    ClusterStore cluster = CornerCluster();
+    LineFitScratch scratch;
+    LineFitMoments moments = scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(cluster.data(), cluster.size(), moments);
+
+    // Horizontal side, normal along y
+    LineFit top = FitLine(moments, 0, 19);
+    EXPECT_NEAR(0.0, top.mse, 1e-9);
+    EXPECT_NEAR(10.5, top.ey, 1e-9);
+    EXPECT_NEAR(1.0, std::abs(top.ny), 1e-9);
+
+    // Vertical side, normal along x
+    LineFit right = FitLine(moments, 19, 36);
+    EXPECT_NEAR(0.0, right.mse, 1e-9);
+    EXPECT_NEAR(29.5, right.ex, 1e-9);
+    EXPECT_NEAR(1.0, std::abs(right.nx), 1e-9);
+
+    // Across the corner the error grows
+    EXPECT_GT(FitLine(moments, 10, 30).mse, 1.0);
+
+    // Wrapping around the end is the same as the points in order
+    std::vector<uint32_t> rotated(cluster.begin() + 30, cluster.end());
+    rotated.insert(rotated.end(), cluster.begin(), cluster.begin() + 30);
+    LineFitScratch rotated_scratch;
+    LineFitMoments rotated_moments = rotated_scratch.Get(rotated.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(rotated.data(), rotated.size(), rotated_moments);
+
+    LineFit expected = FitLine(moments, 2, 34);
+    LineFit wrapped = FitLine(rotated_moments, 9, 4);
+    EXPECT_NEAR(expected.ex, wrapped.ex, 1e-9);
+    EXPECT_NEAR(expected.ey, wrapped.ey, 1e-9);
+    EXPECT_NEAR(expected.err, wrapped.err, 1e-6);
+}
+
+TEST(LineFit, GradientWeightsMatchScalar) {
+    std::srand(0);
+    cv::Mat1b gray{37, 53};
+    for (int y = 0; y < gray.rows; y++) {
+        for (int x = 0; x < gray.cols; x++) {
+            gray(y, x) = std::rand() % 256;
+        }
+    }
+    GrayImage image{gray.data, gray.step, gray.cols, gray.rows};
+
+    // Every pixel including the border, where the weight is 1
+    ClusterStore cluster;
+    for (int y = 0; y < gray.rows; y++) {
+        for (int x = 0; x < gray.cols; x++) {
+            GradientPoint gp;
+            gp.SetX(x);
+            gp.SetY(y);
+            cluster.push_back(gp.RawValue());
+        }
+    }
+
+    LineFitScratch scratch;
+    LineFitMoments moments = scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(cluster.data(), cluster.size(), moments, &image);
+
+    // Straight from apriltag compute_lfps
+    double w = 0, mx = 0;
+    for (size_t i = 0; i < cluster.size(); i++) {
+        GradientPoint gp{cluster[i]};
+        double x = gp.GetX() + 0.5;
+        double y = gp.GetY() + 0.5;
+        int ix = x, iy = y;
+        double weight = 1;
+
+        if (ix > 0 && ix + 1 < gray.cols && iy > 0 && iy + 1 < gray.rows) {
+            int grad_x = gray(iy, ix + 1) - gray(iy, ix - 1);
+            int grad_y = gray(iy + 1, ix) - gray(iy - 1, ix);
+            weight = std::sqrt(grad_x * grad_x + grad_y * grad_y) + 1;
+        }
+
+        w += weight;
+        mx += weight * x;
+        EXPECT_NEAR(w, moments.w[i], 1e-4 * w) << i;
+        EXPECT_NEAR(mx, moments.mx[i], 1e-4 * mx) << i;
+    }
+}
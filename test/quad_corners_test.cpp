@@ -0,0 +1,82 @@
+#include "quad_corners.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <vector>
+
+#include "fit_quads.h"
+#include "gradient_point.h"
+
+using namespace simdtag;
+
+namespace {
+
+// Slope sorted outline of a square with corners (10, 10) and (50, 50), one point per pixel
+ClusterStore SortedSquare() {
+    ClusterStore cluster;
+    for (int t = 10; t < 50; t++) {
+        for (auto [x, y] : {std::pair{t, 10}, std::pair{50, t}, std::pair{60 - t, 50},
+                            std::pair{10, 60 - t}}) {
+            GradientPoint gp;
+            gp.SetX(x);
+            gp.SetY(y);
+            gp.SetDxDy(0, 0);
+            cluster.push_back(gp.RawValue());
+        }
+    }
+
+    auto center = HWY_NAMESPACE::__FindCenterPoint(cluster);
+    ScratchArena arena;
+    HWY_NAMESPACE::__SortBySlope(cluster, center, arena);
+    return cluster;
+}
+
+}  // namespace
+
+TEST(QuadCorners, SegmentErrorsMatchFitLine) {
+    ClusterStore cluster = SortedSquare();
+    LineFitScratch scratch;
+    LineFitMoments moments = scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(cluster.data(), cluster.size(), moments);
+
+    const size_t size = cluster.size();
+    const size_t ksz = std::min<size_t>(20, size / 12);
+    std::vector<double> errors(size);
+    HWY_NAMESPACE::__SegmentErrors(moments, ksz, errors.data());
+
+    for (size_t i = 0; i < size; i++) {
+        double expected = FitLine(moments, (i + size - ksz) % size, (i + ksz) % size).err;
+        EXPECT_NEAR(expected, errors[i], 1e-6 * std::max(1.0, expected)) << i;
+    }
+}
+
+TEST(QuadCorners, FindSquareCorners) {
+    ClusterStore cluster = SortedSquare();
+    LineFitScratch scratch;
+    LineFitMoments moments = scratch.Get(cluster.size());
+    HWY_NAMESPACE::__ComputeLineFitMoments(cluster.data(), cluster.size(), moments);
+
+    FitQuadsParams params;
+    QuadCorners corners;
+    std::array<uint32_t, 4> indices;
+    ASSERT_TRUE(corners.Find(moments, params.max_nmaxima, params.max_line_fit_mse,
+                             params.cos_critical_rad, indices));
+
+    // Every corner of the square is found once
+    std::vector<std::pair<float, float>> expected = {{10, 10}, {50, 10}, {50, 50}, {10, 50}};
+    for (auto const& [ex, ey] : expected) {
+        int found = 0;
+        for (uint32_t index : indices) {
+            GradientPoint gp{cluster[index]};
+            if (std::abs(gp.GetX() - ex) <= 2 && std::abs(gp.GetY() - ey) <= 2) found++;
+        }
+        EXPECT_EQ(1, found) << ex << "," << ey;
+    }
+
+    // Too few points for a window on each side
+    LineFitMoments small = moments;
+    small.size = 23;
+    EXPECT_FALSE(corners.Find(small, params.max_nmaxima, params.max_line_fit_mse,
+                              params.cos_critical_rad, indices));
+}
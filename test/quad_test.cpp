@@ -0,0 +1,68 @@
+#include "quad.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <cmath>
+#include <vector>
+
+using namespace simdtag;
+
+namespace {
+
+// Lines through the sides of the polygon given by its corners, centered on each side with a
+// unit normal as FitLine gives them
+std::array<LineFit, 4> PolygonLines(std::array<std::array<double, 2>, 4> const& corners) {
+    std::array<LineFit, 4> lines;
+    for (int i = 0; i < 4; i++) {
+        auto const& a = corners[i];
+        auto const& b = corners[(i + 1) & 3];
+        double dx = b[0] - a[0];
+        double dy = b[1] - a[1];
+        double length = std::sqrt(dx * dx + dy * dy);
+        lines[i] = {(a[0] + b[0]) / 2, (a[1] + b[1]) / 2, -dy / length, dx / length, 0, 0};
+    }
+
+    return lines;
+}
+
+}  // namespace
+
+TEST(Quad, AssembleQuads) {
+    QuadCandidates candidates;
+
+    // Only the squares survive, more candidates than a vector so the tail is masked
+    for (int i = 0; i < 7; i++) {
+        const double o = 10 * i;
+        // Square, slope order is clockwise on screen
+        candidates.Add(PolygonLines({{{o, o}, {o + 20, o}, {o + 20, o + 20}, {o, o + 20}}}),
+                       i % 2);
+        // Too small
+        candidates.Add(PolygonLines({{{o, o}, {o + 5, o}, {o + 5, o + 5}, {o, o + 5}}}), false);
+        // Wound the other way
+        candidates.Add(PolygonLines({{{o, o}, {o, o + 20}, {o + 20, o + 20}, {o + 20, o}}}),
+                       false);
+        // The last corner is almost flat
+        candidates.Add(
+                PolygonLines({{{o, o}, {o + 40, o}, {o + 40, o + 40}, {o + 20, o + 20.3}}}),
+                false);
+    }
+
+    std::vector<Quad> quads;
+    HWY_NAMESPACE::__AssembleQuads(candidates, 8.0, 0.984807753012208, quads);
+    ASSERT_EQ(7, quads.size());
+
+    for (int i = 0; i < 7; i++) {
+        // Corner i is where line i meets line i + 1
+        const float o = 10 * i;
+        EXPECT_NEAR(o + 20, quads[i].p[0][0], 1e-3);
+        EXPECT_NEAR(o, quads[i].p[0][1], 1e-3);
+        EXPECT_NEAR(o + 20, quads[i].p[1][0], 1e-3);
+        EXPECT_NEAR(o + 20, quads[i].p[1][1], 1e-3);
+        EXPECT_NEAR(o, quads[i].p[2][0], 1e-3);
+        EXPECT_NEAR(o + 20, quads[i].p[2][1], 1e-3);
+        EXPECT_NEAR(o, quads[i].p[3][0], 1e-3);
+        EXPECT_NEAR(o, quads[i].p[3][1], 1e-3);
+        EXPECT_EQ(i % 2 == 1, quads[i].reversed_border);
+    }
+}
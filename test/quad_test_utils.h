@@ -0,0 +1,25 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "quad.h"
+
+namespace QuadTestUtils {
+
+// Every expected corner is matched by exactly one corner of quad, within a pixel
+inline void ExpectCorners(simdtag::Quad const& quad,
+                          std::vector<std::pair<float, float>> const& expected) {
+    for (auto const& [ex, ey] : expected) {
+        int found = 0;
+        for (auto const& p : quad.p) {
+            found += std::abs(p[0] - ex) < 1.0f && std::abs(p[1] - ey) < 1.0f;
+        }
+        EXPECT_EQ(1, found) << ex << "," << ey;
+    }
+}
+
+}  // namespace QuadTestUtils
@@ -0,0 +1,128 @@
+#include "refine_edges.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+#include <vector>
+
+#include "quad.h"
+
+using namespace simdtag;
+
+namespace {
+
+using Corners = std::vector<cv::Point2f>;
+
+// Black quads on white with exact area coverage on the edges, drawn at 16 times the resolution
+// and averaged down. Corners are multiples of 1 / 16 pixel.
+cv::Mat1b Render(std::vector<Corners> const& polygons) {
+    constexpr int kScale = 16;
+    cv::Mat1b large{200 * kScale, 300 * kScale, 255};
+    for (Corners const& corners : polygons) {
+        // Pixel centers are at integer coordinates with 2 fractional bits
+        std::vector<cv::Point> points;
+        for (cv::Point2f const& corner : corners) {
+            points.emplace_back(std::lround((corner.x * kScale - 0.5f) * 4),
+                                std::lround((corner.y * kScale - 0.5f) * 4));
+        }
+        cv::fillConvexPoly(large, points, 0, cv::LINE_8, 2);
+    }
+
+    cv::Mat1b gray;
+    cv::resize(large, gray, {300, 200}, 0, 0, cv::INTER_AREA);
+    return gray;
+}
+
+Quad MakeQuad(Corners const& corners, bool reversed_border = false) {
+    Quad quad{};
+    for (int k = 0; k < 4; k++) {
+        quad.p[k][0] = corners[k].x;
+        quad.p[k][1] = corners[k].y;
+    }
+    quad.reversed_border = reversed_border;
+    return quad;
+}
+
+double MaxCornerError(Quad const& quad, Corners const& corners) {
+    double error = 0;
+    for (int k = 0; k < 4; k++) {
+        error = std::max<double>(error, std::hypot(quad.p[k][0] - corners[k].x,
+                                                   quad.p[k][1] - corners[k].y));
+    }
+    return error;
+}
+
+// Slope order, clockwise on screen
+const Corners kLarge = {{20.5f, 20.25f}, {180.75f, 30.0625f}, {170.125f, 185.5f},
+                        {15.0625f, 178.875f}};
+const Corners kSmall = {{200.25f, 40.5f}, {250.0625f, 44.75f}, {246.5f, 92.125f},
+                        {197.75f, 88.0f}};
+
+// About a pixel off of each corner
+const float kOffsets[4][2] = {{0.8f, -0.6f}, {-0.7f, 0.5f}, {0.6f, 0.7f}, {-0.5f, -0.8f}};
+
+Quad Perturbed(Corners const& corners, bool reversed_border = false) {
+    Quad quad = MakeQuad(corners, reversed_border);
+    for (int k = 0; k < 4; k++) {
+        quad.p[k][0] += kOffsets[k][0];
+        quad.p[k][1] += kOffsets[k][1];
+    }
+    return quad;
+}
+
+}  // namespace
+
+TEST(EdgeRefiner, MovesCornersOntoEdges) {
+    cv::Mat1b gray = Render({kLarge, kSmall});
+
+    // Both quads in one kernel call, the large one has more than 16 samples on each edge
+    std::vector<Quad> quads = {Perturbed(kLarge), Perturbed(kSmall)};
+    EXPECT_GT(MaxCornerError(quads[0], kLarge), 0.8);
+    EXPECT_GT(MaxCornerError(quads[1], kSmall), 0.8);
+
+    EdgeRefiner refiner;
+    refiner.Refine(gray, quads);
+
+    ASSERT_EQ(2, quads.size());
+    EXPECT_LT(MaxCornerError(quads[0], kLarge), 0.1);
+    EXPECT_LT(MaxCornerError(quads[1], kSmall), 0.1);
+
+    // Refining again stays on the edges
+    refiner.Refine(gray, quads);
+    EXPECT_LT(MaxCornerError(quads[0], kLarge), 0.1);
+    EXPECT_LT(MaxCornerError(quads[1], kSmall), 0.1);
+}
+
+TEST(EdgeRefiner, ReversedBorder) {
+    cv::Mat1b gray = 255 - Render({kLarge});
+
+    std::vector<Quad> quads = {Perturbed(kLarge, true)};
+    EdgeRefiner refiner;
+    refiner.Refine(gray, quads);
+    EXPECT_LT(MaxCornerError(quads[0], kLarge), 0.1);
+}
+
+TEST(EdgeRefiner, KeepsCornersWithoutEdges) {
+    // Nothing to find on a blank image, or with the wrong polarity
+    cv::Mat1b blank{200, 300, 255};
+    cv::Mat1b gray = Render({kLarge});
+
+    const Quad original = Perturbed(kLarge);
+    std::vector<Quad> quads = {original};
+
+    EdgeRefiner refiner;
+    refiner.Refine(blank, quads);
+    for (int k = 0; k < 4; k++) {
+        EXPECT_NEAR(original.p[k][0], quads[0].p[k][0], 1e-3);
+        EXPECT_NEAR(original.p[k][1], quads[0].p[k][1], 1e-3);
+    }
+
+    quads = {Perturbed(kLarge, true)};
+    refiner.Refine(gray, quads);
+    EXPECT_GT(MaxCornerError(quads[0], kLarge), 0.5);
+
+    quads.clear();
+    refiner.Refine(gray, quads);
+    EXPECT_TRUE(quads.empty());
+}
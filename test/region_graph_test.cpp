@@ -0,0 +1,100 @@
+#include "region_graph.h"
+
+#include <gtest/gtest.h>
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "ccl/bmrs.h"
+#include "fit_quads.h"
+#include "gradient_clusters.h"
+#include "quad_test_utils.h"
+
+using namespace simdtag;
+
+namespace {
+
+// A tag like ring with a data bit, a solid square and a ring cut off by the image border
+cv::Mat1b Scene() {
+    cv::Mat1b threshold{240, 320, 255};
+    threshold(cv::Rect{40, 40, 80, 80}) = 0;
+    threshold(cv::Rect{50, 50, 60, 60}) = 255;
+    threshold(cv::Rect{70, 70, 10, 10}) = 0;
+
+    threshold(cv::Rect{160, 40, 60, 60}) = 0;
+
+    threshold(cv::Rect{250, 150, 70, 70}) = 0;
+    threshold(cv::Rect{260, 160, 50, 50}) = 255;
+    return threshold;
+}
+
+}  // namespace
+
+TEST(RegionGraph, SelectsOnlyTagBorders) {
+    cv::Mat1b threshold = Scene();
+    cv::Mat1i labels{threshold.size(), 0};
+    BMRS ccl{threshold.size()};
+    ccl.PerformLabelingDual(threshold, labels);
+
+    RegionGraph graph;
+    graph.Build(threshold, labels, ccl.LabelCount());
+
+    const uint32_t ring = labels(40, 40);
+    const uint32_t background = labels(0, 0);
+    RegionGraph::Region const& region = graph.GetRegion(ring);
+    EXPECT_TRUE(region.black);
+    EXPECT_FALSE(region.touches_border);
+    EXPECT_EQ(40, region.x_min);
+    EXPECT_EQ(119, region.x_max);
+    EXPECT_EQ(40, region.y_min);
+    EXPECT_EQ(119, region.y_max);
+    EXPECT_TRUE(graph.GetRegion(labels(150, 300)).touches_border);
+
+    // The ring shares its whole outline with the background
+    bool found = false;
+    for (auto const& edge : graph.Edges()) {
+        if (std::min(ring, background) == edge.label_min &&
+            std::max(ring, background) == edge.label_max) {
+            EXPECT_EQ(4 * 80, edge.length);
+            found = true;
+        }
+    }
+    EXPECT_TRUE(found);
+
+    EXPECT_EQ(1, graph.SelectTagBorders(FitQuadsParams{}));
+    EXPECT_TRUE(graph.IsKept(ring));
+    EXPECT_TRUE(graph.IsKept(background));
+    EXPECT_FALSE(graph.IsKept(labels(55, 55)));
+    EXPECT_FALSE(graph.IsKept(labels(75, 75)));
+    EXPECT_FALSE(graph.IsKept(labels(70, 180)));
+    EXPECT_FALSE(graph.IsKept(labels(150, 300)));
+}
+
+TEST(RegionGraph, PruneLeavesOneQuad) {
+    cv::Mat1b threshold = Scene();
+    cv::Mat1i labels{threshold.size(), 0};
+    BMRS ccl{threshold.size()};
+    ccl.PerformLabelingDual(threshold, labels);
+
+    GradientClusters gc{threshold.size()};
+    GradientClusterHash hash{100};
+    std::vector<Quad> quads;
+
+    // The solid square and the data bit are quads too without pruning
+    gc.Perform(threshold, labels, hash);
+    FitQuads::Perform(hash, threshold.size(), quads);
+    EXPECT_GE(quads.size(), 3);
+
+    RegionGraph graph;
+    graph.Build(threshold, labels, ccl.LabelCount());
+    graph.SelectTagBorders(FitQuadsParams{});
+    graph.Prune(threshold, labels);
+
+    EXPECT_EQ(127, threshold(70, 180));
+    EXPECT_EQ(0, threshold(40, 40));
+
+    gc.Perform(threshold, labels, hash);
+    FitQuads::Perform(hash, threshold.size(), quads);
+    ASSERT_EQ(1, quads.size());
+    QuadTestUtils::ExpectCorners(quads[0], {{40, 40}, {120, 40}, {120, 120}, {40, 120}});
+}
@@ -0,0 +1,42 @@
+#include "simdtag/scratch_arena.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+using namespace simdtag;
+
+TEST(ScratchArena, AlignedAndPadded) {
+    ScratchArena arena{1024};
+
+    uint8_t* a = arena.Allocate<uint8_t>(3);
+    uint64_t* b = arena.Allocate<uint64_t>(5);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(a) % ScratchArena::kAlignment);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(b) % ScratchArena::kAlignment);
+
+    // The padding of a belongs to a
+    EXPECT_GE(reinterpret_cast<uint8_t*>(b) - a, 3 + ScratchArena::kPadding);
+}
+
+TEST(ScratchArena, GrowsAndKeepsPointers) {
+    ScratchArena arena{256};
+
+    uint32_t* first = arena.Allocate<uint32_t>(16);
+    std::fill(first, first + 16, 7);
+
+    // Past the first block, which stays alive until Reset
+    uint32_t* second = arena.Allocate<uint32_t>(1000);
+    std::fill(second, second + 1000, 9);
+    EXPECT_EQ(7, first[15]);
+    EXPECT_GT(arena.Capacity(), 256);
+
+    // Blocks are merged, the same allocations then fit without growing
+    const size_t capacity = arena.Capacity();
+    arena.Reset();
+    EXPECT_EQ(capacity, arena.Capacity());
+
+    arena.Allocate<uint32_t>(16);
+    arena.Allocate<uint32_t>(1000);
+    EXPECT_EQ(capacity, arena.Capacity());
+}
@@ -0,0 +1,105 @@
+#include "tag_codebook.h"
+
+#include <gtest/gtest.h>
+
+#include <bit>
+#include <random>
+#include <vector>
+
+#include "tag_families/tag16h5.h"
+#include "tag_families/tag36h11.h"
+#include "tag_families/tagStandard41h12.h"
+
+using namespace simdtag;
+
+namespace {
+
+const std::vector<TagFamily> kFamilies = {kTag16h5, kTag36h11, kTagStandard41h12};
+
+uint64_t RotateTimes(uint64_t code, int nbits, int times) {
+    for (int i = 0; i < times; i++) {
+        code = Rotate90(code, nbits);
+    }
+    return code;
+}
+
+}  // namespace
+
+static_assert(Rotate90(Rotate90(Rotate90(Rotate90(kTag36h11Codes[7], 36), 36), 36), 36) ==
+              kTag36h11Codes[7]);
+
+TEST(TagCodebook, GeneratedFamilies) {
+    EXPECT_EQ(30, kTag16h5.codes.size());
+    EXPECT_EQ(587, kTag36h11.codes.size());
+    EXPECT_EQ(2115, kTagStandard41h12.codes.size());
+    EXPECT_EQ(36, kTag36h11.nbits);
+    EXPECT_EQ(10, kTag36h11.total_width);
+
+    for (TagFamily const& family : kFamilies) {
+        const size_t stride = CodebookStride(family.codes.size());
+        ASSERT_EQ(4 * stride, family.codebook.size()) << family.name;
+
+        // Entry r turned r more quarters is the code again
+        for (size_t id = 0; id < family.codes.size(); id++) {
+            for (int r = 0; r < 4; r++) {
+                EXPECT_EQ(family.codes[id],
+                          RotateTimes(family.codebook[r * stride + id], family.nbits, r));
+            }
+        }
+        if (stride > family.codes.size()) {
+            EXPECT_EQ(kNoCode, family.codebook[stride - 1]);
+        }
+    }
+}
+
+TEST(TagCodebook, MatchesRotatedCodesWithErrors) {
+    std::mt19937_64 rng{7};
+
+    for (TagFamily const& family : kFamilies) {
+        const size_t stride = CodebookStride(family.codes.size());
+        std::uniform_int_distribution<size_t> ids{0, family.codes.size() - 1};
+        std::uniform_int_distribution<int> bits{0, family.nbits - 1};
+
+        for (int trial = 0; trial < 200; trial++) {
+            const size_t id = ids(rng);
+            const int rotation = trial & 3;
+
+            // Up to two errors, fewer than half the minimum distance of every family here
+            uint64_t code = family.codebook[rotation * stride + id];
+            const int errors = trial % 3;
+            for (int e = 0; e < errors; e++) {
+                code ^= uint64_t{1} << ((bits(rng) + e) % family.nbits);
+            }
+            const int expected = std::popcount(code ^ family.codebook[rotation * stride + id]);
+
+            auto [index, distance] = HWY_NAMESPACE::__MatchCode(family.codebook, code);
+            EXPECT_EQ(rotation * stride + id, index) << family.name;
+            EXPECT_EQ(expected, distance) << family.name;
+        }
+    }
+}
+
+TEST(TagCodebook, MatchAgreesWithScalar) {
+    std::mt19937_64 rng{11};
+
+    for (TagFamily const& family : kFamilies) {
+        const uint64_t mask = (uint64_t{1} << family.nbits) - 1;
+        for (int trial = 0; trial < 100; trial++) {
+            const uint64_t code = rng() & mask;
+
+            size_t best_index = 0;
+            int best = 65;
+            for (size_t i = 0; i < family.codebook.size(); i++) {
+                const int distance = std::popcount(code ^ family.codebook[i]);
+                if (distance < best) {
+                    best = distance;
+                    best_index = i;
+                }
+            }
+
+            auto [index, distance] = HWY_NAMESPACE::__MatchCode(family.codebook, code);
+            EXPECT_EQ(best_index, index);
+            EXPECT_EQ(best, distance);
+        }
+    }
+}
@@ -0,0 +1,311 @@
+#include "tag_decoder.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <set>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "apriltag.h"
+#include "ccl/bmrs.h"
+#include "fit_quads.h"
+#include "gradient_clusters.h"
+#include "homography.h"
+#include "quad.h"
+#include "refine_edges.h"
+#include "tag36h11.h"
+#include "tag_families/tag36h11.h"
+#include "tag_family.h"
+#include "threshold.h"
+
+#define APRIL_TAG_IMAGE_PATH CMAKE_PROJECT_SOURCE_DIR "/assets/apriltag/tags_3_desk.jpg"
+
+using namespace simdtag;
+
+namespace {
+
+// The tag36h11 layout with a few made up codes
+constexpr int8_t kBitX[] = {1, 2, 3, 4, 5, 2, 3, 4, 3, 6, 6, 6, 6, 6, 5, 5, 5, 4,
+                            6, 5, 4, 3, 2, 5, 4, 3, 4, 1, 1, 1, 1, 1, 2, 2, 2, 3};
+constexpr int8_t kBitY[] = {1, 1, 1, 1, 1, 2, 2, 2, 3, 1, 2, 3, 4, 5, 2, 3, 4, 3,
+                            6, 6, 6, 6, 6, 5, 5, 5, 4, 6, 5, 4, 3, 2, 5, 4, 3, 4};
+constexpr uint64_t kCodes[] = {0x0d7e00984bull, 0x0a3c5f1e62ull, 0x05b2e7c4d9ull};
+
+TagFamily TestFamily() {
+    return TagFamily{"test36", kCodes, kBitX, kBitY, 36, 11, 8, 10, false};
+}
+
+// The tag with code at 10 pixels per cell, the outer corner of the border at (60, 60)
+cv::Mat1b RenderTag(TagFamily const& family, uint64_t code) {
+    cv::Mat1b gray{200, 200, 255};
+    gray(cv::Rect{60, 60, 80, 80}) = 0;
+    for (int i = 0; i < family.nbits; i++) {
+        if ((code >> (family.nbits - 1 - i)) & 1) {
+            gray(cv::Rect{60 + 10 * family.bit_x[i], 60 + 10 * family.bit_y[i], 10, 10}) = 255;
+        }
+    }
+    return gray;
+}
+
+Quad UprightQuad() {
+    return Quad{{{60, 60}, {140, 60}, {140, 140}, {60, 140}}, false};
+}
+
+}  // namespace
+
+TEST(Homography, MapsTagCornersToQuad) {
+    const std::vector<Quad> quads = {
+            UprightQuad(),
+            Quad{{{12.5f, 20}, {90, 31}, {84, 97.5f}, {20, 80}}, false},
+    };
+
+    constexpr hw::ScalableTag<double> d;
+    const size_t stride = hwy::RoundUpTo(quads.size(), hw::Lanes(d));
+    auto planes = hwy::AllocateAligned<double>(9 * stride);
+    HWY_NAMESPACE::__QuadHomographies(quads.data(), quads.size(), planes.get(), stride);
+
+    const double tag[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    for (size_t i = 0; i < quads.size(); i++) {
+        Homography H;
+        for (int k = 0; k < 9; k++) {
+            H.h[k / 3][k % 3] = planes[k * stride + i];
+        }
+        EXPECT_DOUBLE_EQ(1.0, H.h[2][2]);
+
+        for (int k = 0; k < 4; k++) {
+            auto [px, py] = H.Project(tag[k][0], tag[k][1]);
+            EXPECT_NEAR(quads[i].p[k][0], px, 1e-9);
+            EXPECT_NEAR(quads[i].p[k][1], py, 1e-9);
+        }
+    }
+}
+
+TEST(TagDecoder, DecodesUprightTag) {
+    const TagFamily family = TestFamily();
+    cv::Mat1b gray = RenderTag(family, kCodes[1]);
+
+    TagDecoder decoder{family};
+    std::vector<Detection> detections;
+    decoder.Decode(gray, {UprightQuad()}, detections);
+
+    ASSERT_EQ(1, detections.size());
+    Detection const& detection = detections[0];
+    EXPECT_EQ(1, detection.id);
+    EXPECT_EQ(0, detection.hamming);
+    EXPECT_GT(detection.decision_margin, 50.0f);
+    EXPECT_NEAR(100, detection.c[0], 1e-6);
+    EXPECT_NEAR(100, detection.c[1], 1e-6);
+
+    // Corners in the apriltag order
+    const double expected[4][2] = {{60, 140}, {140, 140}, {140, 60}, {60, 60}};
+    for (int k = 0; k < 4; k++) {
+        EXPECT_NEAR(expected[k][0], detection.p[k][0], 1e-6);
+        EXPECT_NEAR(expected[k][1], detection.p[k][1], 1e-6);
+    }
+}
+
+TEST(TagDecoder, CornerOrderDoesNotMatter) {
+    const TagFamily family = TestFamily();
+    cv::Mat1b gray = RenderTag(family, kCodes[2]);
+
+    // The same quad starting at each corner, one batch
+    std::vector<Quad> quads;
+    for (int start = 0; start < 4; start++) {
+        Quad quad = UprightQuad();
+        for (int k = 0; k < 4; k++) {
+            quad.p[k][0] = UprightQuad().p[(start + k) % 4][0];
+            quad.p[k][1] = UprightQuad().p[(start + k) % 4][1];
+        }
+        quads.push_back(quad);
+    }
+
+    TagDecoder decoder{family};
+    std::vector<Detection> detections;
+    decoder.Decode(gray, quads, detections);
+
+    ASSERT_EQ(4, detections.size());
+    for (Detection const& detection : detections) {
+        EXPECT_EQ(2, detection.id);
+        for (int k = 0; k < 4; k++) {
+            EXPECT_NEAR(detections[0].p[k][0], detection.p[k][0], 1e-6);
+            EXPECT_NEAR(detections[0].p[k][1], detection.p[k][1], 1e-6);
+        }
+    }
+}
+
+TEST(TagDecoder, DecodesPerspectiveAndBitErrors) {
+    const TagFamily family = TestFamily();
+
+    // Two wrong bits are still corrected, three are not
+    const uint64_t code = kCodes[0] ^ (1ull << 3) ^ (1ull << 20);
+    cv::Mat1b upright = RenderTag(family, code);
+
+    const std::vector<cv::Point2f> from = {{60, 60}, {140, 60}, {140, 140}, {60, 140}};
+    const std::vector<cv::Point2f> to = {{50, 70}, {150, 55}, {135, 160}, {65, 140}};
+    cv::Mat1b gray;
+    cv::warpPerspective(upright, gray, cv::getPerspectiveTransform(from, to), upright.size(),
+                        cv::INTER_LINEAR, cv::BORDER_CONSTANT, 255);
+
+    Quad quad{};
+    for (int k = 0; k < 4; k++) {
+        quad.p[k][0] = to[k].x;
+        quad.p[k][1] = to[k].y;
+    }
+
+    TagDecoder decoder{family};
+    std::vector<Detection> detections;
+    decoder.Decode(gray, {quad}, detections);
+    ASSERT_EQ(1, detections.size());
+    EXPECT_EQ(0, detections[0].id);
+    EXPECT_EQ(2, detections[0].hamming);
+
+    TagDecoder strict{family, TagDecoderParams{1, 0.25f}};
+    strict.Decode(gray, {quad}, detections);
+    EXPECT_TRUE(detections.empty());
+}
+
+TEST(TagDecoder, SkipsWrongPolarityAndOutside) {
+    const TagFamily family = TestFamily();
+    cv::Mat1b gray = RenderTag(family, kCodes[0]);
+
+    // The inverted tag is white inside black, and a quad mostly outside of the image
+    cv::Mat1b inverted = 255 - gray;
+    Quad outside{{{-300, -300}, {-220, -300}, {-220, -220}, {-300, -220}}, false};
+
+    TagDecoder decoder{family};
+    std::vector<Detection> detections;
+    decoder.Decode(inverted, {UprightQuad()}, detections);
+    EXPECT_TRUE(detections.empty());
+
+    decoder.Decode(gray, {outside, UprightQuad()}, detections);
+    ASSERT_EQ(1, detections.size());
+    EXPECT_EQ(0, detections[0].id);
+}
+
+TEST(TagDecoder, DecodesGeneratedFamily) {
+    cv::Mat1b gray = RenderTag(kTag36h11, kTag36h11Codes[42]);
+
+    TagDecoder decoder{kTag36h11};
+    std::vector<Detection> detections;
+    decoder.Decode(gray, {UprightQuad()}, detections);
+
+    ASSERT_EQ(1, detections.size());
+    EXPECT_EQ(42, detections[0].id);
+    EXPECT_EQ(0, detections[0].hamming);
+    EXPECT_EQ(&kTag36h11.codes[0], &detections[0].family->codes[0]);
+}
+
+TEST(TagDecoder, MarginOfOneColorCode) {
+    // All bits black, the margin is the black average alone as in apriltag
+    constexpr uint64_t kBlack[] = {0};
+    const TagFamily family{"black36", kBlack, kBitX, kBitY, 36, 11, 8, 10, false};
+    cv::Mat1b gray = RenderTag(family, kBlack[0]);
+
+    TagDecoder decoder{family};
+    std::vector<Detection> detections;
+    decoder.Decode(gray, {UprightQuad()}, detections);
+
+    ASSERT_EQ(1, detections.size());
+    EXPECT_EQ(0, detections[0].id);
+    EXPECT_TRUE(std::isfinite(detections[0].decision_margin));
+    EXPECT_GT(detections[0].decision_margin, 50.0f);
+}
+
+static_assert(!std::is_copy_constructible_v<TagDecoder>);
+static_assert(!std::is_copy_assignable_v<TagDecoder>);
+
+TEST(TagDecoder, MovedDecoderKeepsItsCodebook) {
+    cv::Mat1b gray = RenderTag(TestFamily(), kCodes[1]);
+
+    // The runtime codebook of the test family moves with the decoder
+    std::vector<TagDecoder> decoders;
+    decoders.emplace_back(TestFamily());
+    decoders.emplace_back(TestFamily());
+    decoders.erase(decoders.begin());
+
+    std::vector<Detection> detections;
+    decoders[0].Decode(gray, {UprightQuad()}, detections);
+    ASSERT_EQ(1, detections.size());
+    EXPECT_EQ(1, detections[0].id);
+}
+
+TEST(TagDecoder, MatchesAprilTagOnDeskImage) {
+    cv::Mat1b input = cv::imread(APRIL_TAG_IMAGE_PATH, cv::IMREAD_GRAYSCALE);
+    ASSERT_FALSE(input.empty());
+
+    // The apriltag pipeline at full resolution, as the benchmarks configure it
+    apriltag_family_t* tf = tag36h11_create();
+    apriltag_detector_t* td = apriltag_detector_create();
+    apriltag_detector_add_family_bits(td, tf, 2);
+    td->quad_decimate = 1.0;
+    td->quad_sigma = 0.0;
+    td->nthreads = 1;
+    td->refine_edges = 1;
+
+    image_u8_t im{input.cols, input.rows, static_cast<int32_t>(input.step[0]), input.data};
+    zarray_t* apriltag_detections = apriltag_detector_detect(td, &im);
+
+    std::set<std::pair<int, int>> expected;
+    std::vector<apriltag_detection_t> expected_detections;
+    for (int i = 0; i < zarray_size(apriltag_detections); i++) {
+        apriltag_detection_t* detection;
+        zarray_get(apriltag_detections, i, &detection);
+        expected.emplace(detection->id, detection->hamming);
+        expected_detections.push_back(*detection);
+    }
+    apriltag_detections_destroy(apriltag_detections);
+    apriltag_detector_destroy(td);
+    tag36h11_destroy(tf);
+    ASSERT_FALSE(expected.empty());
+
+    // simdtag up to the decoder. apriltag drops overlapping duplicates after decoding, which
+    // simdtag leaves to the caller, so the detections are compared as a set.
+    cv::Mat1b threshold = cv::Mat1b{input.size(), 0};
+    cv::Mat1i labels = cv::Mat1i{input.size(), 0};
+    BMRS ccl{input.size()};
+    GradientClusters gc{input.size()};
+    GradientClusterHash hash{100};
+
+    AdaptiveThreshold(input, threshold);
+    ccl.PerformLabelingDual(threshold, labels);
+    gc.Perform(threshold, labels, hash);
+
+    std::vector<Quad> quads;
+    FitQuads::Perform(hash, input.size(), quads, {}, &input);
+    EdgeRefiner{}.Refine(input, quads);
+
+    TagDecoder decoder{kTag36h11};
+    std::vector<Detection> detections;
+    decoder.Decode(input, quads, detections);
+
+    std::set<std::pair<int, int>> actual;
+    for (Detection const& detection : detections) {
+        actual.emplace(detection.id, detection.hamming);
+    }
+    EXPECT_EQ(expected, actual);
+
+    // The decision margin of the detection of the same tag nearest to apriltag's. The quads are
+    // fit differently, so the bit values differ slightly, but well below the k / (k + 1) of a
+    // miscounted average.
+    for (apriltag_detection_t const& truth : expected_detections) {
+        const Detection* nearest = nullptr;
+        double nearest_distance = 0;
+        for (Detection const& detection : detections) {
+            const double distance =
+                    std::hypot(detection.c[0] - truth.c[0], detection.c[1] - truth.c[1]);
+            if (detection.id == truth.id && (nearest == nullptr || distance < nearest_distance)) {
+                nearest = &detection;
+                nearest_distance = distance;
+            }
+        }
+        ASSERT_NE(nullptr, nearest) << truth.id;
+        EXPECT_LT(nearest_distance, 1.0) << truth.id;
+        EXPECT_NEAR(truth.decision_margin, nearest->decision_margin,
+                    0.02f * truth.decision_margin)
+                << truth.id;
+    }
+}
@@ -0,0 +1,206 @@
+#include "tag_pose.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+#include "tag_decoder.h"
+
+using namespace simdtag;
+
+namespace {
+
+constexpr TagPoseParams kParams{0.2, 800, 780, 320, 240};
+
+struct Pose {
+    double R[3][3];
+    double t[3];
+};
+
+// Rotations about x, then y, then z
+Pose MakePose(double rx, double ry, double rz, double tx, double ty, double tz) {
+    const double cx = std::cos(rx), sx = std::sin(rx);
+    const double cy = std::cos(ry), sy = std::sin(ry);
+    const double cz = std::cos(rz), sz = std::sin(rz);
+    return Pose{{{cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx},
+                 {sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx},
+                 {-sy, cy * sx, cy * cx}},
+                {tx, ty, tz}};
+}
+
+// Homography of a tag at pose, the tag point (x, y) at (x, y, 0) * tagsize / 2 in the camera
+Homography PoseHomography(Pose const& pose, TagPoseParams const& params) {
+    const double half = params.tagsize / 2;
+    const double K[3][3] = {{params.fx, 0, params.cx}, {0, params.fy, params.cy}, {0, 0, 1}};
+    const double M[3][3] = {{half * pose.R[0][0], half * pose.R[0][1], pose.t[0]},
+                            {half * pose.R[1][0], half * pose.R[1][1], pose.t[1]},
+                            {half * pose.R[2][0], half * pose.R[2][1], pose.t[2]}};
+
+    Homography H{};
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            for (int k = 0; k < 3; k++) {
+                H.h[row][col] += K[row][k] * M[k][col];
+            }
+        }
+    }
+    const double h22 = H.h[2][2];
+    for (auto& row : H.h) {
+        for (double& element : row) {
+            element /= h22;
+        }
+    }
+    return H;
+}
+
+// The detection with the homography H
+Detection Observe(Homography const& H) {
+    Detection detection{};
+    detection.H = H;
+
+    const double tag[4][2] = {{-1, 1}, {1, 1}, {1, -1}, {-1, -1}};
+    for (int k = 0; k < 4; k++) {
+        auto [px, py] = detection.H.Project(tag[k][0], tag[k][1]);
+        detection.p[k][0] = px;
+        detection.p[k][1] = py;
+    }
+    std::tie(detection.c[0], detection.c[1]) = detection.H.Project(0, 0);
+    return detection;
+}
+
+Detection Observe(Pose const& pose, TagPoseParams const& params) {
+    return Observe(PoseHomography(pose, params));
+}
+
+double MaxDifference(Pose const& truth, TagPose const& pose) {
+    double difference = 0;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            difference = std::max(difference, std::abs(truth.R[row][col] - pose.R[row][col]));
+        }
+    }
+    return difference;
+}
+
+void ExpectRotation(TagPose const& pose) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            const double dot = pose.R[0][i] * pose.R[0][j] + pose.R[1][i] * pose.R[1][j] +
+                               pose.R[2][i] * pose.R[2][j];
+            EXPECT_NEAR(i == j ? 1.0 : 0.0, dot, 1e-9);
+        }
+    }
+}
+
+// Far enough away that the error has a second minimum along the ambiguity, with the corners
+// off by a fraction of a pixel
+const Pose kFar = MakePose(0.4, 0.1, 0.2, 0.1, -0.05, 2.5);
+const double kNoise[4][2] = {{0.3, -0.2}, {-0.25, 0.1}, {0.15, 0.3}, {-0.1, -0.3}};
+
+Detection ObserveNoisy(Homography const& H) {
+    Detection detection = Observe(H);
+    for (int k = 0; k < 4; k++) {
+        detection.p[k][0] += kNoise[k][0];
+        detection.p[k][1] += kNoise[k][1];
+    }
+    return detection;
+}
+
+}  // namespace
+
+TEST(PoseEstimator, RecoversExactPoses) {
+    // More detections than lanes, with a partial last batch
+    std::vector<Pose> truth;
+    for (int i = 0; i < 11; i++) {
+        truth.push_back(MakePose(0.1 * i - 0.5, 0.35 - 0.07 * i, 0.6 * i, 0.05 * (i % 4) - 0.1,
+                                 0.03 * (i % 3) - 0.04, 0.6 + 0.15 * i));
+    }
+
+    std::vector<Detection> detections;
+    for (Pose const& pose : truth) {
+        detections.push_back(Observe(pose, kParams));
+    }
+
+    std::vector<TagPose> poses;
+    PoseEstimator::Perform(detections, kParams, poses);
+
+    ASSERT_EQ(truth.size(), poses.size());
+    for (size_t i = 0; i < truth.size(); i++) {
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 3; col++) {
+                EXPECT_NEAR(truth[i].R[row][col], poses[i].R[row][col], 1e-6) << i;
+            }
+            EXPECT_NEAR(truth[i].t[row], poses[i].t[row], 1e-6) << i;
+        }
+        EXPECT_LT(poses[i].error, 1e-12) << i;
+    }
+}
+
+TEST(PoseEstimator, KeepsTheBetterOfTheAmbiguousPoses) {
+    // The homography of the truth, the first solution is already the better one
+    std::vector<TagPose> poses;
+    PoseEstimator::Perform({ObserveNoisy(PoseHomography(kFar, kParams))}, kParams, poses);
+    ASSERT_EQ(1, poses.size());
+
+    // The flipped solution is rotated by about 0.7 from the truth
+    EXPECT_LT(MaxDifference(kFar, poses[0]), 0.05);
+    for (int k = 0; k < 3; k++) {
+        EXPECT_NEAR(kFar.t[k], poses[0].t[k], 0.02);
+    }
+    ExpectRotation(poses[0]);
+}
+
+TEST(PoseEstimator, FindsTheOtherMinimum) {
+    // The homography of the tag tilted the other way, so the first orthogonal iteration settles
+    // in the flipped minimum about 0.7 from the truth with an error near 5e-5. Only the second
+    // solution along the ambiguity gets back to the truth, with an error near 2e-6.
+    const Pose mirrored = MakePose(-0.4, -0.1, 0.2, 0.1, -0.05, 2.5);
+    Detection detection = ObserveNoisy(PoseHomography(kFar, kParams));
+    detection.H = PoseHomography(mirrored, kParams);
+
+    std::vector<TagPose> poses;
+    PoseEstimator::Perform({detection}, kParams, poses);
+    ASSERT_EQ(1, poses.size());
+
+    EXPECT_LT(MaxDifference(kFar, poses[0]), 0.05);
+    for (int k = 0; k < 3; k++) {
+        EXPECT_NEAR(kFar.t[k], poses[0].t[k], 0.02);
+    }
+    EXPECT_LT(poses[0].error, 1e-5);
+    ExpectRotation(poses[0]);
+}
+
+TEST(PoseEstimator, DegenerateQuad) {
+    // Parallel homography columns, the corners on one line. The lanes around it are unaffected.
+    Homography degenerate{{{1, 1, 320}, {0, 0, 240}, {0, 0, 1}}};
+    const Pose truth = MakePose(0.2, -0.1, 0.3, 0.05, 0.02, 1.2);
+    const std::vector<Detection> detections = {Observe(truth, kParams), Observe(degenerate),
+                                               Observe(truth, kParams)};
+
+    std::vector<TagPose> poses;
+    PoseEstimator::Perform(detections, kParams, poses);
+    ASSERT_EQ(3, poses.size());
+
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            EXPECT_TRUE(std::isfinite(poses[1].R[row][col]));
+        }
+        EXPECT_TRUE(std::isfinite(poses[1].t[row]));
+    }
+    EXPECT_TRUE(std::isfinite(poses[1].error));
+    ExpectRotation(poses[1]);
+
+    for (size_t i : {0, 2}) {
+        EXPECT_LT(MaxDifference(truth, poses[i]), 1e-6);
+        EXPECT_LT(poses[i].error, 1e-12);
+    }
+}
+
+TEST(PoseEstimator, NoDetections) {
+    std::vector<TagPose> poses(3);
+    PoseEstimator::Perform({}, kParams, poses);
+    EXPECT_TRUE(poses.empty());
+}